@@ -0,0 +1,359 @@
+#ifndef CHECKPOINT_H
+#define CHECKPOINT_H
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <cerrno>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <map>
+#include <stdexcept>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "stats.h"
+#include "varint.h"
+
+static const char SNAPSHOT_MAGIC[8] = {'T', 'C', 'P', 'S', 'N', 'A', 'P', '1'};
+static const uint32_t SNAPSHOT_VERSION = 1;
+static const uint32_t SEGMENT_MAGIC = 0x4d474553;
+
+struct SnapshotHeader
+{
+    char magic[8];
+    uint32_t version;
+    uint32_t header_size;
+    uint64_t segments;
+    uint64_t end;
+    uint64_t records;
+    uint64_t generation;
+    uint8_t reserved[16];
+};
+
+struct SegmentHeader
+{
+    uint32_t magic;
+    uint32_t reserved;
+    uint64_t records;
+    uint64_t bytes;
+    uint64_t checksum;
+};
+
+static_assert(sizeof(SnapshotHeader) == 64, "snapshot header layout");
+static_assert(sizeof(SegmentHeader) == 32, "segment header layout");
+
+class Checkpointer
+{
+public:
+    explicit Checkpointer(const std::string &path) : path_(path), fd_(-1), file_size_(0), hdr_()
+    {
+        open_file();
+    }
+
+    ~Checkpointer()
+    {
+        if (fd_ >= 0)
+        {
+            ::close(fd_);
+        }
+    }
+
+    Checkpointer(const Checkpointer &) = delete;
+    Checkpointer &operator=(const Checkpointer &) = delete;
+
+    std::map<uint32_t, IpStats> load() const
+    {
+        std::map<uint32_t, IpStats> out;
+        if (hdr_.end <= sizeof(SnapshotHeader))
+        {
+            return out;
+        }
+        void *m = mmap(nullptr, hdr_.end, PROT_READ, MAP_PRIVATE, fd_, 0);
+        if (m == MAP_FAILED)
+        {
+            throw std::runtime_error("checkpoint: mmap failed: " + path_);
+        }
+        const uint8_t *base = static_cast<const uint8_t *>(m);
+        madvise(m, hdr_.end, MADV_SEQUENTIAL);
+        uint64_t off = sizeof(SnapshotHeader);
+        try
+        {
+            while (off + sizeof(SegmentHeader) <= hdr_.end)
+            {
+                SegmentHeader sh;
+                std::memcpy(&sh, base + off, sizeof(sh));
+                off += sizeof(sh);
+                if (sh.magic != SEGMENT_MAGIC || sh.bytes > hdr_.end - off ||
+                    fnv1a(base + off, sh.bytes) != sh.checksum)
+                {
+                    throw std::runtime_error("checkpoint: corrupt segment in " + path_);
+                }
+                const uint8_t *p = base + off;
+                const uint8_t *end = p + sh.bytes;
+                uint64_t n = 0;
+                while (n < sh.records)
+                {
+                    uint32_t ip = static_cast<uint32_t>(get_varint(p, end));
+                    out[ip] = decode(p, end);
+                    n += 1;
+                }
+                off += sh.bytes;
+            }
+        }
+        catch (...)
+        {
+            munmap(m, hdr_.end);
+            throw;
+        }
+        munmap(m, hdr_.end);
+        return out;
+    }
+
+    void append(const std::vector<std::pair<uint32_t, IpStats>> &records)
+    {
+        std::string payload;
+        for (const auto &kv : records)
+        {
+            put_varint(payload, kv.first);
+            encode(payload, kv.second);
+        }
+        uint64_t at = hdr_.end;
+        write_at(at, segment(records.size(), payload));
+        hdr_.segments += 1;
+        hdr_.end = at + sizeof(SegmentHeader) + payload.size();
+        hdr_.records += records.size();
+        hdr_.generation += 1;
+        write_header();
+    }
+
+    void rewrite(const std::map<uint32_t, IpStats> &all)
+    {
+        std::string payload;
+        for (const auto &kv : all)
+        {
+            put_varint(payload, kv.first);
+            encode(payload, kv.second);
+        }
+        std::string tmp = path_ + ".tmp";
+        int fd = ::open(tmp.c_str(), O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        if (fd < 0)
+        {
+            throw std::runtime_error("checkpoint: cannot create " + tmp);
+        }
+        SnapshotHeader h = hdr_;
+        h.segments = 1;
+        h.records = all.size();
+        h.generation += 1;
+        std::string seg = segment(all.size(), payload);
+        h.end = sizeof(SnapshotHeader) + seg.size();
+        std::string image(reinterpret_cast<const char *>(&h), sizeof(h));
+        image += seg;
+        size_t off = 0;
+        while (off < image.size())
+        {
+            ssize_t w = ::write(fd, image.data() + off, image.size() - off);
+            if (w <= 0)
+            {
+                ::close(fd);
+                throw std::runtime_error("checkpoint: write failed: " + tmp);
+            }
+            off += static_cast<size_t>(w);
+        }
+        if (fsync(fd) != 0 || std::rename(tmp.c_str(), path_.c_str()) != 0)
+        {
+            ::close(fd);
+            throw std::runtime_error("checkpoint: cannot replace " + path_);
+        }
+        ::close(fd_);
+        fd_ = fd;
+        file_size_ = image.size();
+        hdr_ = h;
+    }
+
+    uint64_t records_written() const
+    {
+        return hdr_.records;
+    }
+
+    uint64_t generation() const
+    {
+        return hdr_.generation;
+    }
+
+    uint64_t bytes() const
+    {
+        return hdr_.end;
+    }
+
+private:
+    std::string path_;
+    int fd_;
+    uint64_t file_size_;
+    SnapshotHeader hdr_;
+
+    void open_file()
+    {
+        fd_ = ::open(path_.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+        if (fd_ < 0)
+        {
+            throw std::runtime_error("checkpoint: cannot open " + path_ + ": " + std::strerror(errno));
+        }
+        struct stat st;
+        if (fstat(fd_, &st) != 0 || !S_ISREG(st.st_mode))
+        {
+            fail("checkpoint: not a regular file: " + path_);
+        }
+        file_size_ = static_cast<uint64_t>(st.st_size);
+        if (file_size_ == 0)
+        {
+            std::memset(&hdr_, 0, sizeof(hdr_));
+            std::memcpy(hdr_.magic, SNAPSHOT_MAGIC, sizeof(SNAPSHOT_MAGIC));
+            hdr_.version = SNAPSHOT_VERSION;
+            hdr_.header_size = sizeof(SnapshotHeader);
+            hdr_.end = sizeof(SnapshotHeader);
+            write_header();
+            return;
+        }
+        if (file_size_ < sizeof(SnapshotHeader) || ::pread(fd_, &hdr_, sizeof(hdr_), 0) != static_cast<ssize_t>(sizeof(hdr_)))
+        {
+            fail("checkpoint: short header in " + path_);
+        }
+        if (std::memcmp(hdr_.magic, SNAPSHOT_MAGIC, sizeof(SNAPSHOT_MAGIC)) != 0)
+        {
+            fail("checkpoint: not a snapshot file: " + path_);
+        }
+        if (hdr_.version != SNAPSHOT_VERSION || hdr_.header_size != sizeof(SnapshotHeader) || hdr_.end > file_size_)
+        {
+            fail("checkpoint: unsupported or damaged snapshot: " + path_);
+        }
+    }
+
+    [[noreturn]] void fail(const std::string &msg)
+    {
+        ::close(fd_);
+        fd_ = -1;
+        throw std::runtime_error(msg);
+    }
+
+    static std::string segment(uint64_t records, const std::string &payload)
+    {
+        SegmentHeader sh;
+        sh.magic = SEGMENT_MAGIC;
+        sh.reserved = 0;
+        sh.records = records;
+        sh.bytes = payload.size();
+        sh.checksum = fnv1a(reinterpret_cast<const uint8_t *>(payload.data()), payload.size());
+        std::string out(reinterpret_cast<const char *>(&sh), sizeof(sh));
+        out += payload;
+        return out;
+    }
+
+    void write_header()
+    {
+        write_at(0, std::string(reinterpret_cast<const char *>(&hdr_), sizeof(hdr_)));
+    }
+
+    void write_at(uint64_t off, const std::string &data)
+    {
+        uint64_t need = off + data.size();
+        if (need > file_size_)
+        {
+            if (ftruncate(fd_, static_cast<off_t>(need)) != 0)
+            {
+                throw std::runtime_error("checkpoint: cannot grow " + path_);
+            }
+            file_size_ = need;
+        }
+        uint64_t page = static_cast<uint64_t>(sysconf(_SC_PAGESIZE));
+        uint64_t base = off - off % page;
+        size_t len = static_cast<size_t>(need - base);
+        void *m = mmap(nullptr, len, PROT_READ | PROT_WRITE, MAP_SHARED, fd_, static_cast<off_t>(base));
+        if (m == MAP_FAILED)
+        {
+            throw std::runtime_error("checkpoint: mmap failed: " + path_);
+        }
+        std::memcpy(static_cast<char *>(m) + (off - base), data.data(), data.size());
+        int rc = msync(m, len, MS_SYNC);
+        munmap(m, len);
+        if (rc != 0)
+        {
+            throw std::runtime_error("checkpoint: msync failed: " + path_);
+        }
+    }
+
+    static void encode_ports(std::string &out, const std::map<uint16_t, size_t> &ports)
+    {
+        put_varint(out, ports.size());
+        uint16_t prev = 0;
+        for (const auto &pp : ports)
+        {
+            put_varint(out, static_cast<uint64_t>(pp.first - prev));
+            put_varint(out, pp.second);
+            prev = pp.first;
+        }
+    }
+
+    static void decode_ports(const uint8_t *&p, const uint8_t *end, std::map<uint16_t, size_t> &ports)
+    {
+        uint64_t n = get_varint(p, end);
+        uint64_t port = 0;
+        uint64_t i = 0;
+        while (i < n)
+        {
+            port += get_varint(p, end);
+            ports.emplace_hint(ports.end(), static_cast<uint16_t>(port), static_cast<size_t>(get_varint(p, end)));
+            i += 1;
+        }
+    }
+
+    static void encode(std::string &out, const IpStats &st)
+    {
+        put_varint(out, st.total_sent);
+        put_varint(out, st.total_recv);
+        put_varint(out, st.connections);
+        put_varint(out, st.closed);
+        put_varint(out, st.aborted);
+        put_varint(out, st.expired);
+        put_varint(out, st.flow_us);
+        put_varint(out, st.peers.size());
+        for (const auto &peer : st.peers)
+        {
+            put_varint(out, peer.first);
+            put_varint(out, peer.second.bytes_out);
+            put_varint(out, peer.second.bytes_in);
+            encode_ports(out, peer.second.ports.bytes_out);
+            encode_ports(out, peer.second.ports.bytes_in);
+        }
+    }
+
+    static IpStats decode(const uint8_t *&p, const uint8_t *end)
+    {
+        IpStats st;
+        st.total_sent = get_varint(p, end);
+        st.total_recv = get_varint(p, end);
+        st.connections = get_varint(p, end);
+        st.closed = get_varint(p, end);
+        st.aborted = get_varint(p, end);
+        st.expired = get_varint(p, end);
+        st.flow_us = get_varint(p, end);
+        uint64_t n = get_varint(p, end);
+        uint64_t i = 0;
+        while (i < n)
+        {
+            uint32_t ip = static_cast<uint32_t>(get_varint(p, end));
+            PeerStats &ps = st.peers.emplace_hint(st.peers.end(), ip, PeerStats())->second;
+            ps.bytes_out = get_varint(p, end);
+            ps.bytes_in = get_varint(p, end);
+            decode_ports(p, end, ps.ports.bytes_out);
+            decode_ports(p, end, ps.ports.bytes_in);
+            i += 1;
+        }
+        return st;
+    }
+};
+
+#endif
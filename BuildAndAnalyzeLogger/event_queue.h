@@ -0,0 +1,34 @@
+#ifndef EVENT_QUEUE_H
+#define EVENT_QUEUE_H
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+// Transport between producers and analyzers. push blocks while the queue is
+// full, pop blocks while it is empty; both return false once the queue is
+// closed (pop only after it has been drained).
+template <typename T>
+class EventQueue
+{
+public:
+    virtual ~EventQueue() = default;
+
+    virtual bool push(const T &value) = 0;
+    virtual bool push_batch(const std::vector<T> &values) = 0;
+    virtual bool pop(T &out) = 0;
+    virtual bool pop_batch(std::vector<T> &out, size_t max) = 0;
+    virtual void close() = 0;
+
+    virtual uint64_t notifies() const
+    {
+        return 0;
+    }
+
+    virtual uint64_t elided() const
+    {
+        return 0;
+    }
+};
+
+#endif
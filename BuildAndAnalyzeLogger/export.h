@@ -0,0 +1,498 @@
+#ifndef EXPORT_H
+#define EXPORT_H
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <stdexcept>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "stats.h"
+#include "varint.h"
+
+static const char EXPORT_MAGIC[8] = {'T', 'C', 'P', 'C', 'O', 'L', '1', '\0'};
+static const uint32_t EXPORT_VERSION = 1;
+static const uint32_t ROW_GROUP_MAGIC = 0x50524752;
+static const uint32_t FOOTER_MAGIC = 0x544f4f46;
+static const size_t EXPORT_GROUP_ROWS = 65536;
+
+enum ExportStream
+{
+    STREAM_DICT,
+    STREAM_IP,
+    STREAM_PEER,
+    STREAM_PORT,
+    STREAM_BYTES_OUT,
+    STREAM_BYTES_IN,
+    STREAM_CONNECTIONS,
+    STREAM_COUNT
+};
+
+struct ExportFileHeader
+{
+    char magic[8];
+    uint32_t version;
+    uint32_t group_rows;
+};
+
+struct RowGroupHeader
+{
+    uint32_t magic;
+    uint32_t rows;
+    uint32_t dict_added;
+    uint32_t reserved;
+    uint64_t stream_bytes[STREAM_COUNT];
+    uint64_t checksum;
+};
+
+struct ExportFooter
+{
+    uint32_t magic;
+    uint32_t reserved;
+    uint64_t rows;
+    uint64_t groups;
+    uint64_t dict_size;
+};
+
+static_assert(sizeof(ExportFileHeader) == 16, "export header layout");
+static_assert(sizeof(RowGroupHeader) == 80, "row group header layout");
+static_assert(sizeof(ExportFooter) == 32, "export footer layout");
+
+// Rows of one IP are consecutive: one per (peer, port) the IP exchanged
+// bytes on, or a single peer=0 port=0 row with the IP's totals when it has
+// no peers. connections is the IP's connection count on its first row and 0
+// on the others, so every numeric column sums to the true total.
+struct ExportRow
+{
+    uint32_t ip;
+    uint32_t peer;
+    uint16_t port;
+    uint64_t bytes_out;
+    uint64_t bytes_in;
+    uint64_t connections;
+
+    ExportRow() : ip(0), peer(0), port(0), bytes_out(0), bytes_in(0), connections(0) {}
+};
+
+static inline uint64_t zigzag(int64_t v)
+{
+    return (static_cast<uint64_t>(v) << 1) ^ static_cast<uint64_t>(v >> 63);
+}
+
+static inline int64_t unzigzag(uint64_t v)
+{
+    return static_cast<int64_t>(v >> 1) ^ -static_cast<int64_t>(v & 1);
+}
+
+// Rows are buffered one row group at a time, so memory stays bounded by the
+// group size plus the address dictionary no matter how many rows are written.
+class ColumnarWriter
+{
+public:
+    explicit ColumnarWriter(const std::string &path, size_t group_rows = EXPORT_GROUP_ROWS)
+        : out_(path, std::ios::binary | std::ios::trunc), group_rows_(group_rows), dict_(), dict_new_(0),
+          streams_(STREAM_COUNT), prev_(), in_group_(0), rows_(0), bytes_out_sum_(0), connections_sum_(0), offsets_(), bytes_(0)
+    {
+        if (!out_)
+        {
+            throw std::runtime_error("export: cannot create " + path);
+        }
+        if (group_rows_ == 0 || group_rows_ > UINT32_MAX)
+        {
+            throw std::invalid_argument("export: invalid row group size");
+        }
+        ExportFileHeader h;
+        std::memcpy(h.magic, EXPORT_MAGIC, sizeof(EXPORT_MAGIC));
+        h.version = EXPORT_VERSION;
+        h.group_rows = static_cast<uint32_t>(group_rows_);
+        write(&h, sizeof(h));
+    }
+
+    void add_ip(uint32_t ip, const IpStats &st)
+    {
+        ExportRow row;
+        row.ip = ip;
+        row.connections = st.connections;
+        connections_sum_ += st.connections;
+        if (st.peers.empty())
+        {
+            row.bytes_out = st.total_sent;
+            row.bytes_in = st.total_recv;
+            add_row(row);
+            return;
+        }
+        for (const auto &peer : st.peers)
+        {
+            row.peer = peer.first;
+            const auto &out = peer.second.ports.bytes_out;
+            const auto &in = peer.second.ports.bytes_in;
+            auto o = out.begin();
+            auto i = in.begin();
+            if (o == out.end() && i == in.end())
+            {
+                row.port = 0;
+                row.bytes_out = peer.second.bytes_out;
+                row.bytes_in = peer.second.bytes_in;
+                add_row(row);
+                row.connections = 0;
+                continue;
+            }
+            while (o != out.end() || i != in.end())
+            {
+                row.bytes_out = 0;
+                row.bytes_in = 0;
+                if (i == in.end() || (o != out.end() && o->first < i->first))
+                {
+                    row.port = o->first;
+                    row.bytes_out = o->second;
+                    ++o;
+                }
+                else if (o == out.end() || i->first < o->first)
+                {
+                    row.port = i->first;
+                    row.bytes_in = i->second;
+                    ++i;
+                }
+                else
+                {
+                    row.port = o->first;
+                    row.bytes_out = o->second;
+                    row.bytes_in = i->second;
+                    ++o;
+                    ++i;
+                }
+                add_row(row);
+                row.connections = 0;
+            }
+        }
+    }
+
+    void add_row(const ExportRow &row)
+    {
+        put_delta(STREAM_IP, dict_id(row.ip));
+        put_delta(STREAM_PEER, dict_id(row.peer));
+        put_delta(STREAM_PORT, row.port);
+        put_varint(streams_[STREAM_BYTES_OUT], row.bytes_out);
+        put_varint(streams_[STREAM_BYTES_IN], row.bytes_in);
+        put_delta(STREAM_CONNECTIONS, row.connections);
+        bytes_out_sum_ += row.bytes_out;
+        in_group_ += 1;
+        rows_ += 1;
+        if (in_group_ == group_rows_)
+        {
+            flush_group();
+        }
+    }
+
+    void close()
+    {
+        if (!out_.is_open())
+        {
+            return;
+        }
+        flush_group();
+        uint64_t footer_at = bytes_;
+        ExportFooter f;
+        f.magic = FOOTER_MAGIC;
+        f.reserved = 0;
+        f.rows = rows_;
+        f.groups = offsets_.size();
+        f.dict_size = dict_.size();
+        write(&f, sizeof(f));
+        write(offsets_.data(), offsets_.size() * sizeof(uint64_t));
+        write(&footer_at, sizeof(footer_at));
+        write(EXPORT_MAGIC, sizeof(EXPORT_MAGIC));
+        out_.flush();
+        out_.close();
+        if (out_.fail())
+        {
+            throw std::runtime_error("export: write failed");
+        }
+    }
+
+    uint64_t rows() const
+    {
+        return rows_;
+    }
+
+    uint64_t groups() const
+    {
+        return offsets_.size();
+    }
+
+    uint64_t bytes() const
+    {
+        return bytes_;
+    }
+
+    uint64_t bytes_out_sum() const
+    {
+        return bytes_out_sum_;
+    }
+
+    // Sum of the connection counts of the IPs added, independent of rows.
+    uint64_t connections_sum() const
+    {
+        return connections_sum_;
+    }
+
+private:
+    std::ofstream out_;
+    size_t group_rows_;
+    std::unordered_map<uint32_t, uint32_t> dict_;
+    uint32_t dict_new_;
+    std::vector<std::string> streams_;
+    uint64_t prev_[STREAM_COUNT];
+    size_t in_group_;
+    uint64_t rows_;
+    uint64_t bytes_out_sum_;
+    uint64_t connections_sum_;
+    std::vector<uint64_t> offsets_;
+    uint64_t bytes_;
+
+    uint32_t dict_id(uint32_t ip)
+    {
+        auto it = dict_.find(ip);
+        if (it != dict_.end())
+        {
+            return it->second;
+        }
+        uint32_t id = static_cast<uint32_t>(dict_.size());
+        dict_.emplace(ip, id);
+        put_varint(streams_[STREAM_DICT], ip);
+        dict_new_ += 1;
+        return id;
+    }
+
+    void put_delta(ExportStream s, uint64_t v)
+    {
+        put_varint(streams_[s], zigzag(static_cast<int64_t>(v - prev_[s])));
+        prev_[s] = v;
+    }
+
+    void flush_group()
+    {
+        if (in_group_ == 0)
+        {
+            return;
+        }
+        RowGroupHeader h;
+        std::memset(&h, 0, sizeof(h));
+        h.magic = ROW_GROUP_MAGIC;
+        h.rows = static_cast<uint32_t>(in_group_);
+        h.dict_added = dict_new_;
+        uint64_t sum = 0xcbf29ce484222325ULL;
+        size_t s = 0;
+        while (s < STREAM_COUNT)
+        {
+            h.stream_bytes[s] = streams_[s].size();
+            sum = fnv1a_update(sum, reinterpret_cast<const uint8_t *>(streams_[s].data()), streams_[s].size());
+            s += 1;
+        }
+        h.checksum = sum;
+        offsets_.push_back(bytes_);
+        write(&h, sizeof(h));
+        s = 0;
+        while (s < STREAM_COUNT)
+        {
+            write(streams_[s].data(), streams_[s].size());
+            streams_[s].clear();
+            prev_[s] = 0;
+            s += 1;
+        }
+        dict_new_ = 0;
+        in_group_ = 0;
+    }
+
+    void write(const void *p, size_t n)
+    {
+        out_.write(static_cast<const char *>(p), static_cast<std::streamsize>(n));
+        if (!out_)
+        {
+            throw std::runtime_error("export: write failed");
+        }
+        bytes_ += n;
+    }
+};
+
+// Decodes one row group at a time from a read-only mapping of the file.
+class ColumnarReader
+{
+public:
+    explicit ColumnarReader(const std::string &path)
+        : base_(nullptr), size_(0), footer_(), dict_(), off_(0), end_(0), group_(0), rows_(), pos_(0)
+    {
+        int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+        if (fd < 0)
+        {
+            throw std::runtime_error("export: cannot open " + path);
+        }
+        struct stat st;
+        if (fstat(fd, &st) != 0 || static_cast<uint64_t>(st.st_size) < sizeof(ExportFileHeader) + sizeof(ExportFooter) + 16)
+        {
+            ::close(fd);
+            throw std::runtime_error("export: truncated file " + path);
+        }
+        size_ = static_cast<size_t>(st.st_size);
+        void *m = mmap(nullptr, size_, PROT_READ, MAP_PRIVATE, fd, 0);
+        ::close(fd);
+        if (m == MAP_FAILED)
+        {
+            throw std::runtime_error("export: mmap failed: " + path);
+        }
+        base_ = static_cast<const uint8_t *>(m);
+        madvise(m, size_, MADV_SEQUENTIAL);
+        uint64_t footer_at = 0;
+        std::memcpy(&footer_at, base_ + size_ - 16, sizeof(footer_at));
+        ExportFileHeader h;
+        std::memcpy(&h, base_, sizeof(h));
+        if (std::memcmp(h.magic, EXPORT_MAGIC, sizeof(EXPORT_MAGIC)) != 0 || h.version != EXPORT_VERSION ||
+            std::memcmp(base_ + size_ - 8, EXPORT_MAGIC, sizeof(EXPORT_MAGIC)) != 0 ||
+            footer_at < sizeof(ExportFileHeader) || footer_at > size_ - 16 - sizeof(ExportFooter))
+        {
+            unmap();
+            throw std::runtime_error("export: not a columnar export: " + path);
+        }
+        std::memcpy(&footer_, base_ + footer_at, sizeof(footer_));
+        if (footer_.magic != FOOTER_MAGIC || footer_.groups > (size_ - 16 - footer_at - sizeof(ExportFooter)) / sizeof(uint64_t))
+        {
+            unmap();
+            throw std::runtime_error("export: damaged footer in " + path);
+        }
+        dict_.reserve(static_cast<size_t>(footer_.dict_size));
+        off_ = sizeof(ExportFileHeader);
+        end_ = footer_at;
+    }
+
+    ~ColumnarReader()
+    {
+        unmap();
+    }
+
+    ColumnarReader(const ColumnarReader &) = delete;
+    ColumnarReader &operator=(const ColumnarReader &) = delete;
+
+    bool next(ExportRow &row)
+    {
+        while (pos_ == rows_.size())
+        {
+            if (group_ == footer_.groups)
+            {
+                return false;
+            }
+            load_group();
+        }
+        row = rows_[pos_];
+        pos_ += 1;
+        return true;
+    }
+
+    uint64_t rows() const
+    {
+        return footer_.rows;
+    }
+
+    uint64_t groups() const
+    {
+        return footer_.groups;
+    }
+
+    uint64_t dict_size() const
+    {
+        return footer_.dict_size;
+    }
+
+private:
+    const uint8_t *base_;
+    size_t size_;
+    ExportFooter footer_;
+    std::vector<uint32_t> dict_;
+    uint64_t off_;
+    uint64_t end_;
+    uint64_t group_;
+    std::vector<ExportRow> rows_;
+    size_t pos_;
+
+    void unmap()
+    {
+        if (base_ != nullptr)
+        {
+            munmap(const_cast<uint8_t *>(base_), size_);
+            base_ = nullptr;
+        }
+    }
+
+    void load_group()
+    {
+        RowGroupHeader h;
+        if (off_ + sizeof(h) > end_)
+        {
+            throw std::runtime_error("export: truncated row group");
+        }
+        std::memcpy(&h, base_ + off_, sizeof(h));
+        off_ += sizeof(h);
+        const uint8_t *p[STREAM_COUNT];
+        const uint8_t *e[STREAM_COUNT];
+        uint64_t sum = 0xcbf29ce484222325ULL;
+        size_t s = 0;
+        while (s < STREAM_COUNT)
+        {
+            if (h.stream_bytes[s] > end_ - off_)
+            {
+                throw std::runtime_error("export: truncated row group");
+            }
+            p[s] = base_ + off_;
+            e[s] = p[s] + h.stream_bytes[s];
+            sum = fnv1a_update(sum, p[s], h.stream_bytes[s]);
+            off_ += h.stream_bytes[s];
+            s += 1;
+        }
+        if (h.magic != ROW_GROUP_MAGIC || h.checksum != sum)
+        {
+            throw std::runtime_error("export: corrupt row group");
+        }
+        uint32_t d = 0;
+        while (d < h.dict_added)
+        {
+            dict_.push_back(static_cast<uint32_t>(get_varint(p[STREAM_DICT], e[STREAM_DICT])));
+            d += 1;
+        }
+        uint64_t prev[STREAM_COUNT] = {};
+        rows_.resize(h.rows);
+        for (ExportRow &row : rows_)
+        {
+            row.ip = lookup(get_delta(p, e, prev, STREAM_IP));
+            row.peer = lookup(get_delta(p, e, prev, STREAM_PEER));
+            row.port = static_cast<uint16_t>(get_delta(p, e, prev, STREAM_PORT));
+            row.bytes_out = get_varint(p[STREAM_BYTES_OUT], e[STREAM_BYTES_OUT]);
+            row.bytes_in = get_varint(p[STREAM_BYTES_IN], e[STREAM_BYTES_IN]);
+            row.connections = get_delta(p, e, prev, STREAM_CONNECTIONS);
+        }
+        pos_ = 0;
+        group_ += 1;
+    }
+
+    static uint64_t get_delta(const uint8_t **p, const uint8_t **e, uint64_t *prev, ExportStream s)
+    {
+        prev[s] += static_cast<uint64_t>(unzigzag(get_varint(p[s], e[s])));
+        return prev[s];
+    }
+
+    uint32_t lookup(uint64_t id) const
+    {
+        if (id >= dict_.size())
+        {
+            throw std::runtime_error("export: dictionary id out of range");
+        }
+        return dict_[static_cast<size_t>(id)];
+    }
+};
+
+#endif
@@ -0,0 +1,465 @@
+#ifndef FLOW_TABLE_H
+#define FLOW_TABLE_H
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <vector>
+
+#include "traffic.h"
+
+enum class FlowState : uint8_t
+{
+    Open,
+    Closed,
+    Aborted
+};
+
+inline uint64_t flow_addr_mix(uint32_t a, uint32_t b)
+{
+    return (static_cast<uint64_t>(a) << 32) | b;
+}
+
+inline uint64_t flow_addr_mix(const Ip6Addr &a, const Ip6Addr &b)
+{
+    return addr_bits(a) * 0xc2b2ae3d27d4eb4fULL ^ addr_bits(b);
+}
+
+template <typename A>
+struct BasicFlowKey
+{
+    A a_addr;
+    A b_addr;
+    uint16_t a_port;
+    uint16_t b_port;
+
+    BasicFlowKey() : a_addr(), b_addr(), a_port(0), b_port(0) {}
+
+    static BasicFlowKey from_pkg(const basic_tcp_pkg<A> &p)
+    {
+        BasicFlowKey k;
+        bool src_first = p.src_addr < p.dst_addr || (p.src_addr == p.dst_addr && p.src_port <= p.dst_port);
+        if (src_first)
+        {
+            k.a_addr = p.src_addr;
+            k.a_port = p.src_port;
+            k.b_addr = p.dst_addr;
+            k.b_port = p.dst_port;
+        }
+        else
+        {
+            k.a_addr = p.dst_addr;
+            k.a_port = p.dst_port;
+            k.b_addr = p.src_addr;
+            k.b_port = p.src_port;
+        }
+        return k;
+    }
+
+    bool operator==(const BasicFlowKey &o) const
+    {
+        return a_addr == o.a_addr && b_addr == o.b_addr && a_port == o.a_port && b_port == o.b_port;
+    }
+
+    uint64_t hash() const
+    {
+        uint64_t h = flow_addr_mix(a_addr, b_addr);
+        h ^= ((static_cast<uint64_t>(a_port) << 16) | b_port) * 0x9e3779b97f4a7c15ULL;
+        h ^= h >> 30;
+        h *= 0xbf58476d1ce4e5b9ULL;
+        h ^= h >> 27;
+        h *= 0x94d049bb133111ebULL;
+        h ^= h >> 31;
+        return h;
+    }
+};
+
+template <typename A>
+struct BasicFlowRecord
+{
+    BasicFlowKey<A> key;
+    FlowState state;
+    uint64_t first_us;
+    uint64_t last_us;
+
+    BasicFlowRecord() : key(), state(FlowState::Open), first_us(0), last_us(0) {}
+};
+
+struct FlowGauges
+{
+    size_t active;
+    size_t opened;
+    size_t closed;
+    size_t aborted;
+    size_t expired;
+    size_t unmatched;
+    uint64_t duration_us;
+
+    FlowGauges() : active(0), opened(0), closed(0), aborted(0), expired(0), unmatched(0), duration_us(0) {}
+
+    void add(const FlowGauges &o)
+    {
+        active += o.active;
+        opened += o.opened;
+        closed += o.closed;
+        aborted += o.aborted;
+        expired += o.expired;
+        unmatched += o.unmatched;
+        duration_us += o.duration_us;
+    }
+};
+
+template <typename A>
+class BasicFlowTable
+{
+public:
+    using Key = BasicFlowKey<A>;
+    using Record = BasicFlowRecord<A>;
+    using Pkg = basic_tcp_pkg<A>;
+
+    static constexpr uint64_t TICK_US = 1000000;
+    static constexpr size_t WHEEL_SLOTS = 256;
+
+    BasicFlowTable(size_t shards, uint64_t idle_us) : idle_us_(idle_us), linger_us_(idle_us < 5 * TICK_US ? idle_us : 5 * TICK_US)
+    {
+        if (shards == 0 || idle_us == 0)
+        {
+            throw std::invalid_argument("flow table needs shards and an idle timeout");
+        }
+        size_t i = 0;
+        while (i < shards)
+        {
+            shards_.push_back(std::make_unique<Shard>());
+            i += 1;
+        }
+    }
+
+    bool open(const Pkg &p, uint64_t ts_us, std::vector<Record> &expired)
+    {
+        Key key = Key::from_pkg(p);
+        uint64_t h = key.hash();
+        Shard &sh = shard_for(h);
+        std::lock_guard<std::mutex> lk(sh.m);
+        advance(sh, ts_us, expired);
+        uint32_t idx = find(sh, key, h);
+        if (idx != EMPTY)
+        {
+            Flow &f = sh.pool[idx];
+            if (f.state == FlowState::Open)
+            {
+                touch_flow(f, ts_us);
+                return false;
+            }
+            f.state = FlowState::Open;
+            f.first_us = ts_us;
+            f.last_us = ts_us;
+            f.deadline_us = ts_us + idle_us_;
+            sh.g.active += 1;
+            sh.g.opened += 1;
+            return true;
+        }
+        idx = insert(sh, key, h);
+        Flow &f = sh.pool[idx];
+        f.first_us = ts_us;
+        f.last_us = ts_us;
+        f.deadline_us = ts_us + idle_us_;
+        schedule(sh, idx);
+        sh.g.active += 1;
+        sh.g.opened += 1;
+        return true;
+    }
+
+    void touch(const Pkg &p, uint64_t ts_us, std::vector<Record> &expired)
+    {
+        Key key = Key::from_pkg(p);
+        uint64_t h = key.hash();
+        Shard &sh = shard_for(h);
+        std::lock_guard<std::mutex> lk(sh.m);
+        advance(sh, ts_us, expired);
+        uint32_t idx = find(sh, key, h);
+        if (idx != EMPTY && sh.pool[idx].state == FlowState::Open)
+        {
+            touch_flow(sh.pool[idx], ts_us);
+        }
+    }
+
+    bool close(const Pkg &p, bool abrupt, uint64_t ts_us, Record &rec, std::vector<Record> &expired)
+    {
+        Key key = Key::from_pkg(p);
+        uint64_t h = key.hash();
+        Shard &sh = shard_for(h);
+        std::lock_guard<std::mutex> lk(sh.m);
+        advance(sh, ts_us, expired);
+        uint32_t idx = find(sh, key, h);
+        if (idx == EMPTY)
+        {
+            sh.g.unmatched += 1;
+            return false;
+        }
+        Flow &f = sh.pool[idx];
+        if (f.state != FlowState::Open)
+        {
+            return false;
+        }
+        touch_flow(f, ts_us);
+        f.state = abrupt ? FlowState::Aborted : FlowState::Closed;
+        f.deadline_us = f.last_us + linger_us_;
+        rec = record(f);
+        sh.g.active -= 1;
+        if (abrupt)
+        {
+            sh.g.aborted += 1;
+        }
+        else
+        {
+            sh.g.closed += 1;
+        }
+        sh.g.duration_us += f.last_us - f.first_us;
+        return true;
+    }
+
+    FlowGauges gauges() const
+    {
+        FlowGauges g;
+        for (const auto &sh : shards_)
+        {
+            std::lock_guard<std::mutex> lk(sh->m);
+            g.add(sh->g);
+        }
+        return g;
+    }
+
+private:
+    static constexpr uint32_t EMPTY = 0xffffffffu;
+
+    struct Flow
+    {
+        Key key;
+        uint64_t first_us;
+        uint64_t last_us;
+        uint64_t deadline_us;
+        uint32_t gen;
+        FlowState state;
+        bool live;
+
+        Flow() : key(), first_us(0), last_us(0), deadline_us(0), gen(0), state(FlowState::Open), live(false) {}
+    };
+
+    struct Slot
+    {
+        uint32_t tag;
+        uint32_t idx;
+    };
+
+    struct Timer
+    {
+        uint32_t idx;
+        uint32_t gen;
+    };
+
+    struct alignas(64) Shard
+    {
+        mutable std::mutex m;
+        std::vector<Slot> slots;
+        size_t used;
+        std::vector<Flow> pool;
+        std::vector<uint32_t> free_list;
+        std::vector<std::vector<Timer>> wheel;
+        uint64_t tick;
+        bool started;
+        FlowGauges g;
+
+        Shard() : m(), slots(1024, Slot{0, EMPTY}), used(0), pool(), free_list(), wheel(WHEEL_SLOTS), tick(0), started(false), g() {}
+    };
+
+    uint64_t idle_us_;
+    uint64_t linger_us_;
+    std::vector<std::unique_ptr<Shard>> shards_;
+
+    Shard &shard_for(uint64_t h)
+    {
+        return *shards_[(h >> 40) % shards_.size()];
+    }
+
+    static Record record(const Flow &f)
+    {
+        Record r;
+        r.key = f.key;
+        r.state = f.state;
+        r.first_us = f.first_us;
+        r.last_us = f.last_us;
+        return r;
+    }
+
+    void touch_flow(Flow &f, uint64_t ts_us)
+    {
+        if (ts_us > f.last_us)
+        {
+            f.last_us = ts_us;
+            f.deadline_us = ts_us + idle_us_;
+        }
+    }
+
+    static uint32_t find(const Shard &sh, const Key &key, uint64_t h)
+    {
+        size_t mask = sh.slots.size() - 1;
+        uint32_t tag = static_cast<uint32_t>(h);
+        size_t pos = tag & mask;
+        while (sh.slots[pos].idx != EMPTY)
+        {
+            const Slot &s = sh.slots[pos];
+            if (s.tag == tag && sh.pool[s.idx].key == key)
+            {
+                return s.idx;
+            }
+            pos = (pos + 1) & mask;
+        }
+        return EMPTY;
+    }
+
+    static void place(std::vector<Slot> &slots, Slot s)
+    {
+        size_t mask = slots.size() - 1;
+        size_t pos = s.tag & mask;
+        while (slots[pos].idx != EMPTY)
+        {
+            pos = (pos + 1) & mask;
+        }
+        slots[pos] = s;
+    }
+
+    static uint32_t insert(Shard &sh, const Key &key, uint64_t h)
+    {
+        if ((sh.used + 1) * 2 > sh.slots.size())
+        {
+            std::vector<Slot> bigger(sh.slots.size() * 2, Slot{0, EMPTY});
+            for (const Slot &s : sh.slots)
+            {
+                if (s.idx != EMPTY)
+                {
+                    place(bigger, s);
+                }
+            }
+            sh.slots.swap(bigger);
+        }
+        uint32_t idx = 0;
+        if (!sh.free_list.empty())
+        {
+            idx = sh.free_list.back();
+            sh.free_list.pop_back();
+        }
+        else
+        {
+            if (sh.pool.size() >= EMPTY)
+            {
+                throw std::length_error("flow table shard is full");
+            }
+            idx = static_cast<uint32_t>(sh.pool.size());
+            sh.pool.emplace_back();
+        }
+        Flow &f = sh.pool[idx];
+        f.key = key;
+        f.state = FlowState::Open;
+        f.live = true;
+        place(sh.slots, Slot{static_cast<uint32_t>(h), idx});
+        sh.used += 1;
+        return idx;
+    }
+
+    static void erase(Shard &sh, uint32_t idx)
+    {
+        Flow &f = sh.pool[idx];
+        size_t mask = sh.slots.size() - 1;
+        size_t i = static_cast<uint32_t>(f.key.hash()) & mask;
+        while (sh.slots[i].idx != idx)
+        {
+            i = (i + 1) & mask;
+        }
+        size_t j = i;
+        while (true)
+        {
+            j = (j + 1) & mask;
+            if (sh.slots[j].idx == EMPTY)
+            {
+                break;
+            }
+            size_t home = sh.slots[j].tag & mask;
+            bool movable = (j > i) ? (home <= i || home > j) : (home <= i && home > j);
+            if (movable)
+            {
+                sh.slots[i] = sh.slots[j];
+                i = j;
+            }
+        }
+        sh.slots[i].idx = EMPTY;
+        sh.used -= 1;
+        f.live = false;
+        f.gen += 1;
+        sh.free_list.push_back(idx);
+    }
+
+    static void schedule(Shard &sh, uint32_t idx)
+    {
+        const Flow &f = sh.pool[idx];
+        sh.wheel[(f.deadline_us / TICK_US) % WHEEL_SLOTS].push_back(Timer{idx, f.gen});
+    }
+
+    void advance(Shard &sh, uint64_t now_us, std::vector<Record> &expired)
+    {
+        uint64_t target = now_us / TICK_US;
+        if (!sh.started)
+        {
+            sh.tick = target;
+            sh.started = true;
+            return;
+        }
+        if (target <= sh.tick)
+        {
+            return;
+        }
+        uint64_t steps = target - sh.tick;
+        if (steps > WHEEL_SLOTS)
+        {
+            steps = WHEEL_SLOTS;
+        }
+        std::vector<Timer> due;
+        uint64_t s = 1;
+        while (s <= steps)
+        {
+            due.swap(sh.wheel[(sh.tick + s) % WHEEL_SLOTS]);
+            for (const Timer &t : due)
+            {
+                Flow &f = sh.pool[t.idx];
+                if (!f.live || f.gen != t.gen)
+                {
+                    continue;
+                }
+                if (f.deadline_us > now_us)
+                {
+                    schedule(sh, t.idx);
+                    continue;
+                }
+                if (f.state == FlowState::Open)
+                {
+                    expired.push_back(record(f));
+                    sh.g.active -= 1;
+                    sh.g.expired += 1;
+                    sh.g.duration_us += f.last_us - f.first_us;
+                }
+                erase(sh, t.idx);
+            }
+            due.clear();
+            s += 1;
+        }
+        sh.tick = target;
+    }
+};
+
+using FlowKey = BasicFlowKey<uint32_t>;
+using FlowRecord = BasicFlowRecord<uint32_t>;
+using FlowTable = BasicFlowTable<uint32_t>;
+using Flow6Table = BasicFlowTable<Ip6Addr>;
+
+#endif
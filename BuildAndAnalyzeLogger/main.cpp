@@ -1,15 +1,21 @@
 #include <arpa/inet.h>
 #include <netinet/in.h>
+#include <pthread.h>
+#include <sys/resource.h>
 #include <sys/types.h>
+#include <algorithm>
 #include <chrono>
 #include <condition_variable>
+#include <csignal>
 #include <cstddef>
 #include <cstdint>
+#include <deque>
 #include <exception>
 #include <functional>
 #include <iomanip>
 #include <iostream>
 #include <map>
+#include <memory>
 #include <mutex>
 #include <optional>
 #include <queue>
@@ -17,39 +23,26 @@
 #include <stdexcept>
 #include <string>
 #include <thread>
+#include <type_traits>
 #include <vector>
 #include <atomic>
 
-struct tcp_traffic_pkg
-{
-    in_addr_t src_addr;
-    in_port_t src_port;
-    in_addr_t dst_addr;
-    in_port_t dst_port;
-    size_t sz;
-
-    tcp_traffic_pkg() : src_addr(0), src_port(0), dst_addr(0), dst_port(0), sz(0) {}
-    tcp_traffic_pkg(in_addr_t saddr, in_port_t sport, in_addr_t daddr, in_port_t dport, size_t size)
-        : src_addr(saddr), src_port(sport), dst_addr(daddr), dst_port(dport), sz(size) {}
-};
-
-enum class EventType
-{
-    Connect,
-    Send,
-    Recv,
-    Disconnect
-};
-
-struct TcpEvent
-{
-    EventType type;
-    tcp_traffic_pkg pkg;
-    bool abrupt;
-
-    TcpEvent() : type(EventType::Connect), pkg(), abrupt(false) {}
-    TcpEvent(EventType t, const tcp_traffic_pkg &p, bool ab) : type(t), pkg(p), abrupt(ab) {}
-};
+#include "checkpoint.h"
+#include "event_queue.h"
+#include "export.h"
+#include "flow_table.h"
+#include "metrics.h"
+#include "pcap.h"
+#include "prefix_rollup.h"
+#include "shm_ring.h"
+#include "sketch.h"
+#include "stats.h"
+#include "steal_executor.h"
+#include "topology.h"
+#include "topk.h"
+#include "traffic.h"
+#include "wait_strategy.h"
+#include "window_stats.h"
 
 class Logger
 {
@@ -168,10 +161,11 @@ private:
 };
 
 template <typename T>
-class BoundedQueue
+class BoundedQueue : public EventQueue<T>
 {
 public:
-    explicit BoundedQueue(size_t cap) : capacity_(cap), closed_(false)
+    explicit BoundedQueue(size_t cap, WaitStrategy wait = WaitStrategy::Block, QueueMetrics *metrics = nullptr)
+        : capacity_(cap), closed_(false), size_(0), wait_(wait), notifies_(0), elided_(0), metrics_(metrics)
     {
         if (capacity_ == 0)
         {
@@ -179,103 +173,262 @@ public:
         }
     }
 
-    bool push(const T &value)
+    bool push(const T &value) override
     {
         std::unique_lock<std::mutex> lk(m_);
-        while (!closed_ && q_.size() >= capacity_)
-        {
-            not_full_.wait(lk);
-        }
+        await(lk, not_full_, true, [this]()
+              { return has_room(); });
         if (closed_)
         {
             return false;
         }
         q_.push(value);
-        not_empty_.notify_one();
+        if (metrics_ != nullptr)
+        {
+            stamps_.push(mono_ns());
+            metrics_->enqueued.fetch_add(1, std::memory_order_relaxed);
+        }
+        size_.store(q_.size(), std::memory_order_release);
+        wake(not_empty_, false);
+        return true;
+    }
+
+    bool push_batch(const std::vector<T> &values) override
+    {
+        size_t i = 0;
+        std::unique_lock<std::mutex> lk(m_);
+        while (i < values.size())
+        {
+            await(lk, not_full_, true, [this]()
+                  { return has_room(); });
+            if (closed_)
+            {
+                return false;
+            }
+            size_t before = q_.size();
+            uint64_t now = metrics_ != nullptr ? mono_ns() : 0;
+            while (i < values.size() && q_.size() < capacity_)
+            {
+                q_.push(values[i]);
+                if (metrics_ != nullptr)
+                {
+                    stamps_.push(now);
+                }
+                i += 1;
+            }
+            if (metrics_ != nullptr)
+            {
+                metrics_->enqueued.fetch_add(q_.size() - before, std::memory_order_relaxed);
+            }
+            size_.store(q_.size(), std::memory_order_release);
+            wake(not_empty_, true);
+        }
         return true;
     }
 
-    bool pop(T &out)
+    bool pop_batch(std::vector<T> &out, size_t max) override
     {
+        out.clear();
         std::unique_lock<std::mutex> lk(m_);
-        while (q_.empty() && !closed_)
+        await(lk, not_empty_, false, [this]()
+              { return has_data(); });
+        if (q_.empty())
+        {
+            return false;
+        }
+        uint64_t now = 0;
+        if (metrics_ != nullptr)
+        {
+            metrics_->occupancy.record(q_.size());
+            now = mono_ns();
+        }
+        while (!q_.empty() && out.size() < max)
+        {
+            out.push_back(std::move(q_.front()));
+            q_.pop();
+            if (metrics_ != nullptr)
+            {
+                metrics_->latency_ns.record(now - stamps_.front());
+                stamps_.pop();
+            }
+        }
+        if (metrics_ != nullptr)
         {
-            not_empty_.wait(lk);
+            metrics_->dequeued.fetch_add(out.size(), std::memory_order_relaxed);
         }
+        size_.store(q_.size(), std::memory_order_release);
+        wake(not_full_, true);
+        return true;
+    }
+
+    bool pop(T &out) override
+    {
+        std::unique_lock<std::mutex> lk(m_);
+        await(lk, not_empty_, false, [this]()
+              { return has_data(); });
         if (q_.empty())
         {
             return false;
         }
+        if (metrics_ != nullptr)
+        {
+            metrics_->occupancy.record(q_.size());
+            metrics_->dequeued.fetch_add(1, std::memory_order_relaxed);
+            metrics_->latency_ns.record(mono_ns() - stamps_.front());
+            stamps_.pop();
+        }
         out = std::move(q_.front());
         q_.pop();
-        not_full_.notify_one();
+        size_.store(q_.size(), std::memory_order_release);
+        wake(not_full_, false);
         return true;
     }
 
-    void close()
+    void close() override
+    {
+        std::lock_guard<std::mutex> lk(m_);
+        closed_.store(true, std::memory_order_release);
+        not_empty_.cv.notify_all();
+        not_full_.cv.notify_all();
+    }
+
+    uint64_t notifies() const override
+    {
+        std::lock_guard<std::mutex> lk(m_);
+        return notifies_;
+    }
+
+    uint64_t elided() const override
     {
         std::lock_guard<std::mutex> lk(m_);
-        closed_ = true;
-        not_empty_.notify_all();
-        not_full_.notify_all();
+        return elided_;
     }
 
 private:
-    std::mutex m_;
-    std::condition_variable not_empty_;
-    std::condition_variable not_full_;
+    mutable std::mutex m_;
+    ParkingGate not_empty_;
+    ParkingGate not_full_;
     std::queue<T> q_;
+    // Enqueue times of the events in q_, kept beside them so that the
+    // events themselves carry no metrics fields; empty without metrics.
+    std::queue<uint64_t> stamps_;
     size_t capacity_;
-    bool closed_;
-};
-
-struct PortStats
-{
-    std::map<uint16_t, size_t> bytes_out;
-    std::map<uint16_t, size_t> bytes_in;
-};
+    std::atomic<bool> closed_;
+    std::atomic<size_t> size_;
+    WaitStrategy wait_;
+    uint64_t notifies_;
+    uint64_t elided_;
+    QueueMetrics *metrics_;
+
+    // Both predicates only read atomics, so spinning waiters can poll them
+    // without holding the mutex; under the mutex they are exact.
+    bool has_room() const
+    {
+        return closed_.load(std::memory_order_acquire) || size_.load(std::memory_order_acquire) < capacity_;
+    }
 
-struct PeerStats
-{
-    size_t bytes_out;
-    size_t bytes_in;
-    PortStats ports;
+    bool has_data() const
+    {
+        return closed_.load(std::memory_order_acquire) || size_.load(std::memory_order_acquire) > 0;
+    }
 
-    PeerStats() : bytes_out(0), bytes_in(0), ports() {}
-};
+    template <typename Ready>
+    void await(std::unique_lock<std::mutex> &lk, ParkingGate &g, bool full, Ready ready)
+    {
+        if (ready())
+        {
+            return;
+        }
+        uint64_t t0 = metrics_ != nullptr ? mono_ns() : 0;
+        wait_until(lk, g, ready);
+        if (metrics_ != nullptr)
+        {
+            uint64_t dt = mono_ns() - t0;
+            if (full)
+            {
+                metrics_->full_stalls.fetch_add(1, std::memory_order_relaxed);
+                metrics_->full_stall_ns.fetch_add(dt, std::memory_order_relaxed);
+            }
+            else
+            {
+                metrics_->empty_waits.fetch_add(1, std::memory_order_relaxed);
+                metrics_->empty_wait_ns.fetch_add(dt, std::memory_order_relaxed);
+            }
+        }
+    }
 
-struct IpStats
-{
-    size_t total_sent;
-    size_t total_recv;
-    size_t connections;
-    std::map<uint32_t, PeerStats> peers;
+    template <typename Ready>
+    void wait_until(std::unique_lock<std::mutex> &lk, ParkingGate &g, Ready ready)
+    {
+        size_t spins = 0;
+        while (!ready())
+        {
+            bool park = wait_ == WaitStrategy::Block ||
+                        (wait_ == WaitStrategy::SpinPark && spins >= WAIT_SPIN_LIMIT + WAIT_YIELD_LIMIT);
+            if (park)
+            {
+                g.sleepers += 1;
+                g.cv.wait(lk);
+                g.sleepers -= 1;
+                continue;
+            }
+            lk.unlock();
+            while (!ready() && (wait_ != WaitStrategy::SpinPark || spins < WAIT_SPIN_LIMIT + WAIT_YIELD_LIMIT))
+            {
+                if (wait_ == WaitStrategy::Spin || spins < WAIT_SPIN_LIMIT)
+                {
+                    cpu_relax();
+                }
+                else
+                {
+                    std::this_thread::yield();
+                }
+                spins += 1;
+            }
+            lk.lock();
+        }
+    }
 
-    IpStats() : total_sent(0), total_recv(0), connections(0), peers() {}
+    void wake(ParkingGate &g, bool all)
+    {
+        if (wait_ != WaitStrategy::Block && g.sleepers == 0)
+        {
+            elided_ += 1;
+            return;
+        }
+        notifies_ += 1;
+        if (all)
+        {
+            g.cv.notify_all();
+        }
+        else
+        {
+            g.cv.notify_one();
+        }
+    }
 };
 
 class Analyzer
 {
 public:
-    Analyzer() : done_(false) {}
+    // rollup enables per-subnet counters; prefixes adds the configured
+    // customer prefixes to them.
+    explicit Analyzer(std::shared_ptr<FlowTable> flows = nullptr, bool sketch = false, std::shared_ptr<Flow6Table> flows6 = nullptr,
+                      bool rollup = false, std::shared_ptr<const PrefixTable> prefixes = nullptr)
+        : flows_(flows), flows6_(flows6), expired_(), expired6_(), clock_s_(0), sketch_(sketch ? std::make_unique<TrafficSketch>() : nullptr),
+          sketch6_(sketch ? std::make_unique<Traffic6Sketch>() : nullptr),
+          rollup_(rollup ? std::make_unique<PrefixRollup>(prefixes) : nullptr),
+          top_sent_(TOPK_CAPACITY), top_recv_(TOPK_CAPACITY), top_conn_(TOPK_CAPACITY), version_(1), changes_(), changes6_(), done_(false) {}
 
     void consume(const TcpEvent &ev)
     {
-        if (ev.type == EventType::Connect)
-        {
-            on_connect(ev.pkg);
-        }
-        else if (ev.type == EventType::Send)
-        {
-            on_send(ev.pkg);
-        }
-        else if (ev.type == EventType::Recv)
+        if (ev.v6)
         {
-            on_recv(ev.pkg);
+            dispatch(ev, ev.take6());
         }
         else
         {
-            on_disconnect(ev.pkg, ev.abrupt);
+            dispatch(ev, ev.pkg);
         }
     }
 
@@ -298,232 +451,1065 @@ public:
         {
             return std::nullopt;
         }
-        return it->second;
+        return it->second.stats;
     }
 
-    std::map<uint32_t, IpStats> snapshot_all() const
+    std::optional<Ip6Stats> get_ip_stats(const Ip6Addr &ip) const
     {
         std::lock_guard<std::mutex> lk(m_);
-        return stats_;
-    }
-
-private:
-    mutable std::mutex m_;
-    std::map<uint32_t, IpStats> stats_;
-    bool done_;
-
-    static uint32_t key_addr(in_addr_t a)
-    {
-        return static_cast<uint32_t>(a);
+        auto it = stats6_.find(ip);
+        if (it == stats6_.end())
+        {
+            return std::nullopt;
+        }
+        return it->second.stats;
     }
 
-    static uint16_t key_port(in_port_t p)
+    uint64_t clock_s() const
     {
-        return ntohs(p);
+        return clock_s_.load(std::memory_order_relaxed);
     }
 
-    void on_connect(const tcp_traffic_pkg &p)
+    void add_windows(uint32_t ip, uint64_t now_s, IpWindows &out) const
     {
         std::lock_guard<std::mutex> lk(m_);
-        uint32_t s = key_addr(p.src_addr);
-        uint32_t d = key_addr(p.dst_addr);
-        IpStats &from = stats_[s];
-        IpStats &to = stats_[d];
-        from.connections += 1;
-        to.connections += 1;
-        PeerStats &ps = from.peers[d];
-        (void)ps;
+        auto it = stats_.find(ip);
+        if (it != stats_.end())
+        {
+            it->second.window.add_to(out, now_s);
+        }
     }
 
-    void on_send(const tcp_traffic_pkg &p)
+    void add_windows(const Ip6Addr &ip, uint64_t now_s, IpWindows &out) const
     {
         std::lock_guard<std::mutex> lk(m_);
-        uint32_t s = key_addr(p.src_addr);
-        uint32_t d = key_addr(p.dst_addr);
-        IpStats &from = stats_[s];
-        IpStats &to = stats_[d];
-        from.total_sent += p.sz;
-        to.total_recv += p.sz;
-        PeerStats &ps = from.peers[d];
-        ps.bytes_out += p.sz;
-        uint16_t dp = key_port(p.dst_port);
-        size_t before = 0;
-        auto it = ps.ports.bytes_out.find(dp);
-        if (it != ps.ports.bytes_out.end())
+        auto it = stats6_.find(ip);
+        if (it != stats6_.end())
         {
-            before = it->second;
+            it->second.window.add_to(out, now_s);
         }
-        ps.ports.bytes_out[dp] = before + p.sz;
     }
 
-    void on_recv(const tcp_traffic_pkg &p)
+    bool sketch_mode() const
     {
-        std::lock_guard<std::mutex> lk(m_);
-        uint32_t s = key_addr(p.src_addr);
-        uint32_t d = key_addr(p.dst_addr);
-        IpStats &from = stats_[s];
-        IpStats &to = stats_[d];
-        from.total_recv += p.sz;
-        to.total_sent += p.sz;
-        PeerStats &ps = to.peers[s];
-        ps.bytes_in += p.sz;
-        uint16_t sp = key_port(p.src_port);
-        size_t before = 0;
-        auto it = ps.ports.bytes_in.find(sp);
-        if (it != ps.ports.bytes_in.end())
-        {
-            before = it->second;
-        }
-        ps.ports.bytes_in[sp] = before + p.sz;
+        return sketch_ != nullptr;
     }
 
-    void on_disconnect(const tcp_traffic_pkg &p, bool)
+    size_t window_count() const
     {
         std::lock_guard<std::mutex> lk(m_);
-        uint32_t s = key_addr(p.src_addr);
-        uint32_t d = key_addr(p.dst_addr);
-        IpStats &from = stats_[s];
-        IpStats &to = stats_[d];
-        (void)from;
-        (void)to;
+        return windowed_.size() + windowed6_.size();
     }
-};
-
-class Coordinator
-{
-public:
-    explicit Coordinator(size_t capacity) : queue_(capacity) {}
 
-    void add_analyzer(std::shared_ptr<Analyzer> a)
+    void collect_ips(std::vector<uint32_t> &out) const
     {
-        analyzers_.push_back(a);
+        std::lock_guard<std::mutex> lk(m_);
+        for (const auto &kv : stats_)
+        {
+            out.push_back(kv.first);
+        }
     }
 
-    BoundedQueue<TcpEvent> &queue()
+    size_t ip_count() const
     {
-        return queue_;
+        std::lock_guard<std::mutex> lk(m_);
+        return stats_.size();
     }
 
-    IpStats query_ip(uint32_t ip)
+    // Appends the IPs modified at or after version `since` (0 means every
+    // IP, including restored ones) and closes the current version. Passing
+    // the returned value next time yields exactly the later changes. Both
+    // families share the version counter, so each caller only needs its own
+    // `since`.
+    template <typename A>
+    uint64_t changes_since(uint64_t since, std::vector<A> &out)
     {
-        IpStats result;
-        for (auto &a : analyzers_)
+        std::lock_guard<std::mutex> lk(m_);
+        auto &stats = stats_of<A>();
+        auto &changes = changes_of<A>();
+        if (since == 0)
         {
-            auto part = a->get_ip_stats(ip);
-            if (part.has_value())
+            for (const auto &kv : stats)
             {
-                const IpStats &s = part.value();
-                result.total_sent += s.total_sent;
-                result.total_recv += s.total_recv;
-                result.connections += s.connections;
-                for (const auto &kv : s.peers)
+                out.push_back(kv.first);
+            }
+        }
+        else
+        {
+            auto it = std::lower_bound(changes.begin(), changes.end(), since,
+                                       [](const std::pair<uint64_t, A> &c, uint64_t v)
+                                       { return c.first < v; });
+            while (it != changes.end())
+            {
+                if (stats[it->second].stats.version == it->first)
                 {
-                    auto it = result.peers.find(kv.first);
-                    if (it == result.peers.end())
-                    {
-                        result.peers[kv.first] = kv.second;
-                    }
-                    else
-                    {
-                        it->second.bytes_out += kv.second.bytes_out;
-                        it->second.bytes_in += kv.second.bytes_in;
-                        for (const auto &pp : kv.second.ports.bytes_out)
-                        {
-                            size_t cur = 0;
-                            auto jt = it->second.ports.bytes_out.find(pp.first);
-                            if (jt != it->second.ports.bytes_out.end())
-                            {
-                                cur = jt->second;
-                            }
-                            it->second.ports.bytes_out[pp.first] = cur + pp.second;
-                        }
-                        for (const auto &pp : kv.second.ports.bytes_in)
-                        {
-                            size_t cur = 0;
-                            auto jt = it->second.ports.bytes_in.find(pp.first);
-                            if (jt != it->second.ports.bytes_in.end())
-                            {
-                                cur = jt->second;
-                            }
-                            it->second.ports.bytes_in[pp.first] = cur + pp.second;
-                        }
-                    }
+                    out.push_back(it->second);
                 }
+                ++it;
             }
         }
-        return result;
+        version_ += 1;
+        if (changes.size() > 2 * stats.size())
+        {
+            compact_changes<A>();
+        }
+        return version_;
     }
 
-    std::map<uint32_t, IpStats> merge_all()
+    // Adds this analyzer's counters for the given IPs into out.
+    void add_stats(const std::vector<uint32_t> &ips, std::map<uint32_t, IpStats> &out) const
     {
-        std::map<uint32_t, IpStats> merged;
-        for (auto &a : analyzers_)
+        std::lock_guard<std::mutex> lk(m_);
+        for (uint32_t ip : ips)
         {
-            auto snap = a->snapshot_all();
-            for (auto &kv : snap)
+            auto it = stats_.find(ip);
+            if (it != stats_.end())
             {
-                IpStats &dst = merged[kv.first];
-                dst.total_sent += kv.second.total_sent;
-                dst.total_recv += kv.second.total_recv;
-                dst.connections += kv.second.connections;
-                for (const auto &peer : kv.second.peers)
-                {
-                    PeerStats &p = dst.peers[peer.first];
-                    p.bytes_out += peer.second.bytes_out;
-                    p.bytes_in += peer.second.bytes_in;
-                    for (const auto &pp : peer.second.ports.bytes_out)
-                    {
-                        size_t cur = 0;
-                        auto it = p.ports.bytes_out.find(pp.first);
-                        if (it != p.ports.bytes_out.end())
-                        {
-                            cur = it->second;
-                        }
-                        p.ports.bytes_out[pp.first] = cur + pp.second;
-                    }
-                    for (const auto &pp : peer.second.ports.bytes_in)
-                    {
-                        size_t cur = 0;
-                        auto it = p.ports.bytes_in.find(pp.first);
-                        if (it != p.ports.bytes_in.end())
-                        {
-                            cur = it->second;
-                        }
-                        p.ports.bytes_in[pp.first] = cur + pp.second;
-                    }
-                }
+                merge_ip_stats(out[ip], it->second.stats);
             }
         }
-        return merged;
     }
 
-private:
-    BoundedQueue<TcpEvent> queue_;
-    std::vector<std::shared_ptr<Analyzer>> analyzers_;
-};
-
-static std::string ip_to_str(uint32_t ip_be)
-{
-    in_addr a;
-    a.s_addr = ip_be;
-    char buf[INET_ADDRSTRLEN];
-    const char *res = inet_ntop(AF_INET, &a, buf, sizeof(buf));
-    if (res == nullptr)
+    void add_stats(const std::vector<Ip6Addr> &ips, std::map<Ip6Addr, Ip6Stats> &out) const
     {
-        return std::string("0.0.0.0");
+        std::lock_guard<std::mutex> lk(m_);
+        for (const Ip6Addr &ip : ips)
+        {
+            auto it = stats6_.find(ip);
+            if (it != stats6_.end())
+            {
+                merge_ip_stats(out[ip], it->second.stats);
+            }
+        }
     }
-    return std::string(buf);
-}
 
-struct Options
-{
-    int producers;
-    int consumers;
-    size_t events;
-    size_t capacity;
+    // The snapshot keeps per-IP counters but not the flow table, so
+    // connections still open at checkpoint time cannot be matched to later
+    // events; they are counted as expired, which leaves no IP with active
+    // connections that could never end. Returns how many were expired.
+    size_t restore(std::map<uint32_t, IpStats> &&base)
+    {
+        std::lock_guard<std::mutex> lk(m_);
+        stats_.clear();
+        size_t expired = 0;
+        for (auto &kv : base)
+        {
+            IpStats &st = stats_[kv.first].stats;
+            st = std::move(kv.second);
+            size_t open = st.active();
+            st.expired += open;
+            expired += open;
+            top_sent_.update(kv.first, st.total_sent);
+            top_recv_.update(kv.first, st.total_recv);
+            top_conn_.update(kv.first, st.connections);
+        }
+        return expired;
+    }
 
-    Options() : producers(2), consumers(2), events(20000), capacity(1024) {}
-};
+    uint64_t top_candidates(TopMetric m, std::vector<TopEntry> &out) const
+    {
+        std::lock_guard<std::mutex> lk(m_);
+        const TopKIndex &idx = top_index(m);
+        out.insert(out.end(), idx.entries().begin(), idx.entries().end());
+        return idx.floor();
+    }
+
+    void add_metric_values(TopMetric m, std::vector<TopEntry> &cands) const
+    {
+        std::lock_guard<std::mutex> lk(m_);
+        for (TopEntry &c : cands)
+        {
+            auto it = stats_.find(c.ip);
+            if (it != stats_.end())
+            {
+                c.value += metric_of(it->second.stats, m);
+            }
+        }
+    }
+
+    template <typename A>
+    void add_sketch_estimate(const A &ip, BasicIpStats<A> &out) const
+    {
+        std::lock_guard<std::mutex> lk(m_);
+        const BasicTrafficSketch<A> *sk = sketch_of<A>();
+        if (sk != nullptr)
+        {
+            out.total_sent += sk->sent_estimate(ip);
+            out.total_recv += sk->recv_estimate(ip);
+        }
+    }
+
+    void merge_sketch_into(TrafficSketch &out) const
+    {
+        std::lock_guard<std::mutex> lk(m_);
+        if (sketch_ != nullptr)
+        {
+            out.merge(*sketch_);
+        }
+    }
+
+    void merge_sketch_into(Traffic6Sketch &out) const
+    {
+        std::lock_guard<std::mutex> lk(m_);
+        if (sketch6_ != nullptr)
+        {
+            out.merge(*sketch6_);
+        }
+    }
+
+    void merge_rollup_into(PrefixRollup &out) const
+    {
+        std::lock_guard<std::mutex> lk(m_);
+        if (rollup_ != nullptr)
+        {
+            rollup_->merge_into(out);
+        }
+    }
+
+private:
+    mutable std::mutex m_;
+    std::map<uint32_t, BasicIpEntry<uint32_t>> stats_;
+    std::map<Ip6Addr, BasicIpEntry<Ip6Addr>> stats6_;
+    std::shared_ptr<FlowTable> flows_;
+    std::shared_ptr<Flow6Table> flows6_;
+    std::vector<FlowRecord> expired_;
+    std::vector<BasicFlowRecord<Ip6Addr>> expired6_;
+    std::atomic<uint64_t> clock_s_;
+    std::unique_ptr<TrafficSketch> sketch_;
+    std::unique_ptr<Traffic6Sketch> sketch6_;
+    std::unique_ptr<PrefixRollup> rollup_;
+    TopKIndex top_sent_;
+    TopKIndex top_recv_;
+    TopKIndex top_conn_;
+    uint64_t version_;
+    std::vector<std::pair<uint64_t, uint32_t>> changes_;
+    std::vector<std::pair<uint64_t, Ip6Addr>> changes6_;
+    // IPs with an allocated rate window, oldest first, by the second they
+    // were queued; swept as the clock advances.
+    std::deque<std::pair<uint64_t, uint32_t>> windowed_;
+    std::deque<std::pair<uint64_t, Ip6Addr>> windowed6_;
+    bool done_;
+
+    const TopKIndex &top_index(TopMetric m) const
+    {
+        if (m == TopMetric::BytesSent)
+        {
+            return top_sent_;
+        }
+        if (m == TopMetric::BytesRecv)
+        {
+            return top_recv_;
+        }
+        return top_conn_;
+    }
+
+    static uint64_t metric_of(const IpStats &st, TopMetric m)
+    {
+        if (m == TopMetric::BytesSent)
+        {
+            return st.total_sent;
+        }
+        if (m == TopMetric::BytesRecv)
+        {
+            return st.total_recv;
+        }
+        return st.connections;
+    }
+
+    static uint16_t key_port(in_port_t p)
+    {
+        return ntohs(p);
+    }
+
+    template <typename A>
+    static constexpr bool is_v6()
+    {
+        return std::is_same<A, Ip6Addr>::value;
+    }
+
+    template <typename A>
+    BasicFlowTable<A> *flow_table() const
+    {
+        if constexpr (is_v6<A>())
+        {
+            return flows6_.get();
+        }
+        else
+        {
+            return flows_.get();
+        }
+    }
+
+    template <typename A>
+    std::vector<BasicFlowRecord<A>> &expired_list()
+    {
+        if constexpr (is_v6<A>())
+        {
+            return expired6_;
+        }
+        else
+        {
+            return expired_;
+        }
+    }
+
+    template <typename A>
+    BasicTrafficSketch<A> *sketch_of() const
+    {
+        if constexpr (is_v6<A>())
+        {
+            return sketch6_.get();
+        }
+        else
+        {
+            return sketch_.get();
+        }
+    }
+
+    template <typename A>
+    std::map<A, BasicIpEntry<A>> &stats_of()
+    {
+        if constexpr (is_v6<A>())
+        {
+            return stats6_;
+        }
+        else
+        {
+            return stats_;
+        }
+    }
+
+    template <typename A>
+    std::vector<std::pair<uint64_t, A>> &changes_of()
+    {
+        if constexpr (is_v6<A>())
+        {
+            return changes6_;
+        }
+        else
+        {
+            return changes_;
+        }
+    }
+
+    template <typename A>
+    std::deque<std::pair<uint64_t, A>> &windowed_of()
+    {
+        if constexpr (is_v6<A>())
+        {
+            return windowed6_;
+        }
+        else
+        {
+            return windowed_;
+        }
+    }
+
+    template <typename A>
+    void add_window(const A &ip, BasicIpEntry<A> &e, uint64_t sec, uint64_t sent, uint64_t recv)
+    {
+        if (e.window.add(sec, sent, recv))
+        {
+            windowed_of<A>().emplace_back(sec, ip);
+        }
+    }
+
+    // Drops the rate windows of IPs idle for the whole window span. An IP
+    // that was active since it was queued goes to the back with its latest
+    // second, so each window is looked at about once per span.
+    template <typename A>
+    void sweep_windows(uint64_t now_sec)
+    {
+        auto &q = windowed_of<A>();
+        auto &stats = stats_of<A>();
+        while (!q.empty() && q.front().first + RateWindow::MAX_SPAN_S <= now_sec)
+        {
+            A ip = q.front().second;
+            q.pop_front();
+            auto it = stats.find(ip);
+            if (it != stats.end() && !it->second.window.release_if_idle(now_sec) && it->second.window.allocated())
+            {
+                q.emplace_back(it->second.window.last(), ip);
+            }
+        }
+    }
+
+    // Logs an IP at most once per version, so the change log stays sorted
+    // by version and an ingest touch costs one compare.
+    template <typename A>
+    BasicIpEntry<A> &touch_entry(const A &ip)
+    {
+        BasicIpEntry<A> &e = stats_of<A>()[ip];
+        if (e.stats.version != version_)
+        {
+            e.stats.version = version_;
+            changes_of<A>().emplace_back(version_, ip);
+        }
+        return e;
+    }
+
+    template <typename A>
+    BasicIpStats<A> &touch_ip(const A &ip)
+    {
+        return touch_entry(ip).stats;
+    }
+
+    // Drops log entries superseded by a later change of the same IP.
+    template <typename A>
+    void compact_changes()
+    {
+        auto &stats = stats_of<A>();
+        auto &changes = changes_of<A>();
+        size_t keep = 0;
+        size_t i = 0;
+        while (i < changes.size())
+        {
+            if (stats[changes[i].second].stats.version == changes[i].first)
+            {
+                changes[keep] = changes[i];
+                keep += 1;
+            }
+            i += 1;
+        }
+        changes.resize(keep);
+    }
+
+    template <typename A>
+    void finish_flow(const BasicFlowRecord<A> &rec)
+    {
+        if (sketch_of<A>() != nullptr)
+        {
+            return;
+        }
+        A ends[2] = {rec.key.a_addr, rec.key.b_addr};
+        for (const A &ip : ends)
+        {
+            auto &st = touch_ip(ip);
+            if (rec.state == FlowState::Closed)
+            {
+                st.closed += 1;
+            }
+            else if (rec.state == FlowState::Aborted)
+            {
+                st.aborted += 1;
+            }
+            else
+            {
+                st.expired += 1;
+            }
+            st.flow_us += rec.last_us - rec.first_us;
+        }
+    }
+
+    template <typename A>
+    void apply_expired()
+    {
+        std::vector<BasicFlowRecord<A>> &expired = expired_list<A>();
+        if (expired.empty())
+        {
+            return;
+        }
+        std::lock_guard<std::mutex> lk(m_);
+        for (const BasicFlowRecord<A> &rec : expired)
+        {
+            finish_flow(rec);
+        }
+        expired.clear();
+    }
+
+    uint64_t tick(uint64_t ts_us)
+    {
+        uint64_t sec = ts_us / 1000000;
+        if (sec > clock_s_.load(std::memory_order_relaxed))
+        {
+            clock_s_.store(sec, std::memory_order_relaxed);
+        }
+        return sec;
+    }
+
+    // The top-k indexes and the rollup are IPv4-only; in sketch mode each
+    // family goes to its own sketch.
+    template <typename A>
+    void on_connect(const basic_tcp_pkg<A> &p, uint64_t ts_us)
+    {
+        BasicFlowTable<A> *flows = flow_table<A>();
+        if (flows != nullptr)
+        {
+            bool fresh = flows->open(p, ts_us, expired_list<A>());
+            apply_expired<A>();
+            if (!fresh)
+            {
+                return;
+            }
+        }
+        std::lock_guard<std::mutex> lk(m_);
+        A s = p.src_addr;
+        A d = p.dst_addr;
+        if constexpr (!is_v6<A>())
+        {
+            if (rollup_ != nullptr)
+            {
+                rollup_->on_connect(s, d);
+            }
+        }
+        BasicTrafficSketch<A> *sk = sketch_of<A>();
+        if (sk != nullptr)
+        {
+            sk->on_connect(s, d);
+            return;
+        }
+        auto &from = touch_ip(s);
+        auto &to = touch_ip(d);
+        from.connections += 1;
+        to.connections += 1;
+        if constexpr (!is_v6<A>())
+        {
+            top_conn_.update(s, from.connections);
+            top_conn_.update(d, to.connections);
+        }
+        PeerStats &ps = from.peers[d];
+        (void)ps;
+    }
+
+    template <typename A>
+    void on_send(const basic_tcp_pkg<A> &p, uint64_t ts_us)
+    {
+        BasicFlowTable<A> *flows = flow_table<A>();
+        if (flows != nullptr)
+        {
+            flows->touch(p, ts_us, expired_list<A>());
+            apply_expired<A>();
+        }
+        std::lock_guard<std::mutex> lk(m_);
+        A s = p.src_addr;
+        A d = p.dst_addr;
+        if constexpr (!is_v6<A>())
+        {
+            if (rollup_ != nullptr)
+            {
+                rollup_->on_transfer(s, d, p.sz);
+            }
+        }
+        BasicTrafficSketch<A> *sk = sketch_of<A>();
+        if (sk != nullptr)
+        {
+            sk->on_transfer(s, d, key_port(p.dst_port), p.sz);
+            return;
+        }
+        BasicIpEntry<A> &from_e = touch_entry(s);
+        BasicIpEntry<A> &to_e = touch_entry(d);
+        auto &from = from_e.stats;
+        auto &to = to_e.stats;
+        from.total_sent += p.sz;
+        to.total_recv += p.sz;
+        if constexpr (!is_v6<A>())
+        {
+            top_sent_.update(s, from.total_sent);
+            top_recv_.update(d, to.total_recv);
+        }
+        uint64_t sec = tick(ts_us);
+        add_window(s, from_e, sec, p.sz, 0);
+        add_window(d, to_e, sec, 0, p.sz);
+        sweep_windows<A>(sec);
+        PeerStats &ps = from.peers[d];
+        ps.bytes_out += p.sz;
+        uint16_t dp = key_port(p.dst_port);
+        size_t before = 0;
+        auto it = ps.ports.bytes_out.find(dp);
+        if (it != ps.ports.bytes_out.end())
+        {
+            before = it->second;
+        }
+        ps.ports.bytes_out[dp] = before + p.sz;
+    }
+
+    template <typename A>
+    void on_recv(const basic_tcp_pkg<A> &p, uint64_t ts_us)
+    {
+        BasicFlowTable<A> *flows = flow_table<A>();
+        if (flows != nullptr)
+        {
+            flows->touch(p, ts_us, expired_list<A>());
+            apply_expired<A>();
+        }
+        std::lock_guard<std::mutex> lk(m_);
+        A s = p.src_addr;
+        A d = p.dst_addr;
+        if constexpr (!is_v6<A>())
+        {
+            if (rollup_ != nullptr)
+            {
+                rollup_->on_transfer(d, s, p.sz);
+            }
+        }
+        BasicTrafficSketch<A> *sk = sketch_of<A>();
+        if (sk != nullptr)
+        {
+            sk->on_transfer(d, s, key_port(p.src_port), p.sz);
+            return;
+        }
+        BasicIpEntry<A> &from_e = touch_entry(s);
+        BasicIpEntry<A> &to_e = touch_entry(d);
+        auto &from = from_e.stats;
+        auto &to = to_e.stats;
+        from.total_recv += p.sz;
+        to.total_sent += p.sz;
+        if constexpr (!is_v6<A>())
+        {
+            top_recv_.update(s, from.total_recv);
+            top_sent_.update(d, to.total_sent);
+        }
+        uint64_t sec = tick(ts_us);
+        add_window(s, from_e, sec, 0, p.sz);
+        add_window(d, to_e, sec, p.sz, 0);
+        sweep_windows<A>(sec);
+        PeerStats &ps = to.peers[s];
+        ps.bytes_in += p.sz;
+        uint16_t sp = key_port(p.src_port);
+        size_t before = 0;
+        auto it = ps.ports.bytes_in.find(sp);
+        if (it != ps.ports.bytes_in.end())
+        {
+            before = it->second;
+        }
+        ps.ports.bytes_in[sp] = before + p.sz;
+    }
+
+    template <typename A>
+    void on_disconnect(const basic_tcp_pkg<A> &p, bool abrupt, uint64_t ts_us)
+    {
+        BasicFlowTable<A> *flows = flow_table<A>();
+        if (flows == nullptr)
+        {
+            return;
+        }
+        BasicFlowRecord<A> rec;
+        bool ended = flows->close(p, abrupt, ts_us, rec, expired_list<A>());
+        apply_expired<A>();
+        if (!ended)
+        {
+            return;
+        }
+        std::lock_guard<std::mutex> lk(m_);
+        finish_flow(rec);
+    }
+
+    template <typename A>
+    void dispatch(const TcpEvent &ev, const basic_tcp_pkg<A> &p)
+    {
+        if (ev.type == EventType::Connect)
+        {
+            on_connect(p, ev.ts_us);
+        }
+        else if (ev.type == EventType::Send)
+        {
+            on_send(p, ev.ts_us);
+        }
+        else if (ev.type == EventType::Recv)
+        {
+            on_recv(p, ev.ts_us);
+        }
+        else
+        {
+            on_disconnect(p, ev.abrupt, ev.ts_us);
+        }
+    }
+};
+
+class Coordinator
+{
+public:
+    // The queues may be local BoundedQueues or any other EventQueue transport.
+    explicit Coordinator(std::vector<std::unique_ptr<EventQueue<TcpEvent>>> queues, QueueMetrics *metrics = nullptr)
+        : queues_(std::move(queues)), metrics_(metrics), analyzers_(), cp_since_(), view_m_(), view_(), view_since_(), view6_(), view6_since_()
+    {
+        if (queues_.empty())
+        {
+            throw std::invalid_argument("queue count must be positive");
+        }
+    }
+
+    void add_analyzer(std::shared_ptr<Analyzer> a)
+    {
+        analyzers_.push_back(a);
+        cp_since_.push_back(1);
+        view_since_.push_back(0);
+        view6_since_.push_back(0);
+    }
+
+    EventQueue<TcpEvent> &queue(size_t i = 0)
+    {
+        return *queues_.at(i);
+    }
+
+    size_t queue_count() const
+    {
+        return queues_.size();
+    }
+
+    QueueMetrics *metrics() const
+    {
+        return metrics_;
+    }
+
+    void close_queues()
+    {
+        for (auto &q : queues_)
+        {
+            q->close();
+        }
+    }
+
+    uint64_t queue_notifies() const
+    {
+        uint64_t n = 0;
+        for (const auto &q : queues_)
+        {
+            n += q->notifies();
+        }
+        return n;
+    }
+
+    uint64_t queue_elided() const
+    {
+        uint64_t n = 0;
+        for (const auto &q : queues_)
+        {
+            n += q->elided();
+        }
+        return n;
+    }
+
+    IpStats query_ip(uint32_t ip)
+    {
+        IpStats result;
+        uint64_t now_s = 0;
+        for (auto &a : analyzers_)
+        {
+            if (a->clock_s() > now_s)
+            {
+                now_s = a->clock_s();
+            }
+        }
+        for (auto &a : analyzers_)
+        {
+            a->add_windows(ip, now_s, result.recent);
+            a->add_sketch_estimate(ip, result);
+            auto part = a->get_ip_stats(ip);
+            if (part.has_value())
+            {
+                const IpStats &s = part.value();
+                result.total_sent += s.total_sent;
+                result.total_recv += s.total_recv;
+                result.connections += s.connections;
+                result.closed += s.closed;
+                result.aborted += s.aborted;
+                result.expired += s.expired;
+                result.flow_us += s.flow_us;
+                for (const auto &kv : s.peers)
+                {
+                    auto it = result.peers.find(kv.first);
+                    if (it == result.peers.end())
+                    {
+                        result.peers[kv.first] = kv.second;
+                    }
+                    else
+                    {
+                        it->second.bytes_out += kv.second.bytes_out;
+                        it->second.bytes_in += kv.second.bytes_in;
+                        for (const auto &pp : kv.second.ports.bytes_out)
+                        {
+                            size_t cur = 0;
+                            auto jt = it->second.ports.bytes_out.find(pp.first);
+                            if (jt != it->second.ports.bytes_out.end())
+                            {
+                                cur = jt->second;
+                            }
+                            it->second.ports.bytes_out[pp.first] = cur + pp.second;
+                        }
+                        for (const auto &pp : kv.second.ports.bytes_in)
+                        {
+                            size_t cur = 0;
+                            auto jt = it->second.ports.bytes_in.find(pp.first);
+                            if (jt != it->second.ports.bytes_in.end())
+                            {
+                                cur = jt->second;
+                            }
+                            it->second.ports.bytes_in[pp.first] = cur + pp.second;
+                        }
+                    }
+                }
+            }
+        }
+        return result;
+    }
+
+    // Brings the global view up to date by re-merging only the IPs that
+    // some analyzer changed since the previous refresh. Returns their count.
+    size_t refresh_view()
+    {
+        std::lock_guard<std::mutex> lk(view_m_);
+        std::vector<uint32_t> ips;
+        size_t i = 0;
+        while (i < analyzers_.size())
+        {
+            view_since_[i] = analyzers_[i]->changes_since(view_since_[i], ips);
+            i += 1;
+        }
+        std::sort(ips.begin(), ips.end());
+        ips.erase(std::unique(ips.begin(), ips.end()), ips.end());
+        for (uint32_t ip : ips)
+        {
+            view_[ip] = IpStats();
+        }
+        for (auto &a : analyzers_)
+        {
+            a->add_stats(ips, view_);
+        }
+        return ips.size();
+    }
+
+    size_t view_size()
+    {
+        std::lock_guard<std::mutex> lk(view_m_);
+        return view_.size();
+    }
+
+    Ip6Stats query_ip(const Ip6Addr &ip)
+    {
+        Ip6Stats result;
+        uint64_t now_s = 0;
+        for (auto &a : analyzers_)
+        {
+            now_s = std::max(now_s, a->clock_s());
+        }
+        for (auto &a : analyzers_)
+        {
+            a->add_windows(ip, now_s, result.recent);
+            a->add_sketch_estimate(ip, result);
+            auto part = a->get_ip_stats(ip);
+            if (part.has_value())
+            {
+                merge_ip_stats(result, part.value());
+            }
+        }
+        return result;
+    }
+
+    // The IPv6 view is refreshed like the IPv4 one: only addresses changed
+    // since the previous call are merged again.
+    std::map<Ip6Addr, Ip6Stats> merge_all6()
+    {
+        std::lock_guard<std::mutex> lk(view_m_);
+        std::vector<Ip6Addr> ips;
+        size_t i = 0;
+        while (i < analyzers_.size())
+        {
+            view6_since_[i] = analyzers_[i]->changes_since(view6_since_[i], ips);
+            i += 1;
+        }
+        std::sort(ips.begin(), ips.end());
+        ips.erase(std::unique(ips.begin(), ips.end()), ips.end());
+        for (const Ip6Addr &ip : ips)
+        {
+            view6_[ip] = Ip6Stats();
+        }
+        for (auto &a : analyzers_)
+        {
+            a->add_stats(ips, view6_);
+        }
+        return view6_;
+    }
+
+    std::map<uint32_t, IpStats> merge_all()
+    {
+        refresh_view();
+        std::lock_guard<std::mutex> lk(view_m_);
+        return view_;
+    }
+
+    // Rate windows currently allocated across analyzers.
+    size_t window_count() const
+    {
+        size_t n = 0;
+        for (const auto &a : analyzers_)
+        {
+            n += a->window_count();
+        }
+        return n;
+    }
+
+    void merge_rollups(PrefixRollup &out)
+    {
+        for (auto &a : analyzers_)
+        {
+            a->merge_rollup_into(out);
+        }
+    }
+
+    template <typename A>
+    BasicTrafficSketch<A> merge_sketches()
+    {
+        BasicTrafficSketch<A> merged;
+        for (auto &a : analyzers_)
+        {
+            a->merge_sketch_into(merged);
+        }
+        return merged;
+    }
+
+    TopKResult top_k(TopMetric metric, size_t k)
+    {
+        if (k == 0 || k > TOPK_CAPACITY)
+        {
+            throw std::invalid_argument("top_k: k must be in 1.." + std::to_string(TOPK_CAPACITY));
+        }
+        TopKResult result;
+        std::vector<TopEntry> cands;
+        uint64_t threshold = 0;
+        for (auto &a : analyzers_)
+        {
+            threshold += a->top_candidates(metric, cands);
+        }
+        std::sort(cands.begin(), cands.end(), [](const TopEntry &x, const TopEntry &y)
+                  { return x.ip < y.ip; });
+        cands.erase(std::unique(cands.begin(), cands.end(), [](const TopEntry &x, const TopEntry &y)
+                                { return x.ip == y.ip; }),
+                    cands.end());
+        for (TopEntry &c : cands)
+        {
+            c.value = 0;
+        }
+        for (auto &a : analyzers_)
+        {
+            a->add_metric_values(metric, cands);
+        }
+        size_t n = std::min(k, cands.size());
+        std::partial_sort(cands.begin(), cands.begin() + static_cast<std::ptrdiff_t>(n), cands.end(), [](const TopEntry &x, const TopEntry &y)
+                          { return x.value > y.value; });
+        cands.resize(n);
+        result.exact = threshold == 0 || (n == k && cands[n - 1].value >= threshold);
+        result.entries = std::move(cands);
+        return result;
+    }
+
+    size_t checkpoint(Checkpointer &cp)
+    {
+        std::vector<uint32_t> ips;
+        size_t live = 0;
+        size_t i = 0;
+        while (i < analyzers_.size())
+        {
+            cp_since_[i] = analyzers_[i]->changes_since(cp_since_[i], ips);
+            live += analyzers_[i]->ip_count();
+            i += 1;
+        }
+        if (ips.empty())
+        {
+            return 0;
+        }
+        std::sort(ips.begin(), ips.end());
+        ips.erase(std::unique(ips.begin(), ips.end()), ips.end());
+        std::vector<std::pair<uint32_t, IpStats>> records;
+        records.reserve(ips.size());
+        for (uint32_t ip : ips)
+        {
+            records.emplace_back(ip, query_ip(ip));
+        }
+        cp.append(records);
+        if (cp.records_written() > 2 * live)
+        {
+            refresh_view();
+            std::lock_guard<std::mutex> lk(view_m_);
+            cp.rewrite(view_);
+        }
+        return records.size();
+    }
+
+    void export_to(ColumnarWriter &w)
+    {
+        std::vector<uint32_t> ips;
+        for (auto &a : analyzers_)
+        {
+            a->collect_ips(ips);
+        }
+        std::sort(ips.begin(), ips.end());
+        ips.erase(std::unique(ips.begin(), ips.end()), ips.end());
+        for (uint32_t ip : ips)
+        {
+            w.add_ip(ip, query_ip(ip));
+        }
+        w.close();
+    }
+
+private:
+    std::vector<std::unique_ptr<EventQueue<TcpEvent>>> queues_;
+    QueueMetrics *metrics_;
+    std::vector<std::shared_ptr<Analyzer>> analyzers_;
+    std::vector<uint64_t> cp_since_;
+    std::mutex view_m_;
+    std::map<uint32_t, IpStats> view_;
+    std::vector<uint64_t> view_since_;
+    std::map<Ip6Addr, Ip6Stats> view6_;
+    std::vector<uint64_t> view6_since_;
+};
+
+static std::string ip_to_str(uint32_t ip_be)
+{
+    in_addr a;
+    a.s_addr = ip_be;
+    char buf[INET_ADDRSTRLEN];
+    const char *res = inet_ntop(AF_INET, &a, buf, sizeof(buf));
+    if (res == nullptr)
+    {
+        return std::string("0.0.0.0");
+    }
+    return std::string(buf);
+}
+
+static std::string ip_to_str(const Ip6Addr &ip)
+{
+    in6_addr a;
+    ip.to_bytes(a.s6_addr);
+    char buf[INET6_ADDRSTRLEN];
+    const char *res = inet_ntop(AF_INET6, &a, buf, sizeof(buf));
+    if (res == nullptr)
+    {
+        return std::string("::");
+    }
+    return std::string(buf);
+}
+
+struct Options
+{
+    int producers;
+    int consumers;
+    size_t events;
+    size_t capacity;
+    std::string pcap_in;
+    std::string pcap_out;
+    uint64_t flow_idle_s;
+    bool sketch;
+    std::string checkpoint;
+    uint64_t checkpoint_ms;
+    std::string export_out;
+    std::string export_in;
+    bool pin;
+    bool numa;
+    std::string pin_cpus;
+    WaitStrategy wait;
+    std::string metrics_out;
+    std::string executor;
+    int skew_pct;
+    std::string shm_serve;
+    std::string shm_connect;
+    int shm_producers;
+    int ipv6_pct;
+    bool rollup;
+    std::string prefixes;
+
+    Options() : producers(2), consumers(2), events(20000), capacity(1024), pcap_in(), pcap_out(), flow_idle_s(60), sketch(false), checkpoint(), checkpoint_ms(1000), export_out(), export_in(), pin(false), numa(false), pin_cpus(), wait(WaitStrategy::Block), metrics_out(), executor("queue"), skew_pct(0), shm_serve(), shm_connect(), shm_producers(1), ipv6_pct(0), rollup(false), prefixes() {}
+};
 
 static bool parse_int(const char *s, long long &out)
 {
@@ -621,7 +1607,226 @@ static Options parse_cli(int argc, char *argv[])
             {
                 throw std::invalid_argument("capacity must be >= 1");
             }
-            opt.capacity = static_cast<size_t>(v);
+            opt.capacity = static_cast<size_t>(v);
+            i += 2;
+        }
+        else if (a == "--flow-idle")
+        {
+            if (i + 1 >= argc)
+            {
+                throw std::invalid_argument("missing value for --flow-idle");
+            }
+            long long v = 0;
+            if (!parse_int(argv[i + 1], v))
+            {
+                throw std::invalid_argument("invalid --flow-idle");
+            }
+            if (v < 1)
+            {
+                throw std::invalid_argument("flow-idle must be >= 1");
+            }
+            opt.flow_idle_s = static_cast<uint64_t>(v);
+            i += 2;
+        }
+        else if (a == "--sketch")
+        {
+            opt.sketch = true;
+            i += 1;
+        }
+        else if (a == "--checkpoint")
+        {
+            if (i + 1 >= argc)
+            {
+                throw std::invalid_argument("missing value for --checkpoint");
+            }
+            opt.checkpoint = argv[i + 1];
+            i += 2;
+        }
+        else if (a == "--pin")
+        {
+            opt.pin = true;
+            if (i + 1 < argc && argv[i + 1][0] != '-')
+            {
+                opt.pin_cpus = argv[i + 1];
+                i += 1;
+            }
+            i += 1;
+        }
+        else if (a == "--numa")
+        {
+            opt.numa = true;
+            i += 1;
+        }
+        else if (a == "--executor")
+        {
+            if (i + 1 >= argc)
+            {
+                throw std::invalid_argument("missing value for --executor");
+            }
+            opt.executor = argv[i + 1];
+            if (opt.executor != "queue" && opt.executor != "steal")
+            {
+                throw std::invalid_argument("--executor must be queue or steal");
+            }
+            i += 2;
+        }
+        else if (a == "--skew")
+        {
+            if (i + 1 >= argc)
+            {
+                throw std::invalid_argument("missing value for --skew");
+            }
+            long long v = 0;
+            if (!parse_int(argv[i + 1], v))
+            {
+                throw std::invalid_argument("invalid --skew");
+            }
+            if (v < 0 || v > 100)
+            {
+                throw std::invalid_argument("skew must be in 0..100");
+            }
+            opt.skew_pct = static_cast<int>(v);
+            i += 2;
+        }
+        else if (a == "--shm-serve")
+        {
+            if (i + 1 >= argc)
+            {
+                throw std::invalid_argument("missing value for --shm-serve");
+            }
+            opt.shm_serve = argv[i + 1];
+            i += 2;
+        }
+        else if (a == "--shm-connect")
+        {
+            if (i + 1 >= argc)
+            {
+                throw std::invalid_argument("missing value for --shm-connect");
+            }
+            opt.shm_connect = argv[i + 1];
+            i += 2;
+        }
+        else if (a == "--shm-producers")
+        {
+            if (i + 1 >= argc)
+            {
+                throw std::invalid_argument("missing value for --shm-producers");
+            }
+            long long v = 0;
+            if (!parse_int(argv[i + 1], v))
+            {
+                throw std::invalid_argument("invalid --shm-producers");
+            }
+            if (v < 1)
+            {
+                throw std::invalid_argument("shm-producers must be >= 1");
+            }
+            opt.shm_producers = static_cast<int>(v);
+            i += 2;
+        }
+        else if (a == "--ipv6")
+        {
+            if (i + 1 >= argc)
+            {
+                throw std::invalid_argument("missing value for --ipv6");
+            }
+            long long v = 0;
+            if (!parse_int(argv[i + 1], v))
+            {
+                throw std::invalid_argument("invalid --ipv6");
+            }
+            if (v < 0 || v > 100)
+            {
+                throw std::invalid_argument("ipv6 must be in 0..100");
+            }
+            opt.ipv6_pct = static_cast<int>(v);
+            i += 2;
+        }
+        else if (a == "--rollup")
+        {
+            opt.rollup = true;
+            i += 1;
+        }
+        else if (a == "--prefixes")
+        {
+            if (i + 1 >= argc)
+            {
+                throw std::invalid_argument("missing value for --prefixes");
+            }
+            opt.prefixes = argv[i + 1];
+            opt.rollup = true;
+            i += 2;
+        }
+        else if (a == "--metrics")
+        {
+            if (i + 1 >= argc)
+            {
+                throw std::invalid_argument("missing value for --metrics");
+            }
+            opt.metrics_out = argv[i + 1];
+            i += 2;
+        }
+        else if (a == "--wait")
+        {
+            if (i + 1 >= argc)
+            {
+                throw std::invalid_argument("missing value for --wait");
+            }
+            opt.wait = parse_wait_strategy(argv[i + 1]);
+            i += 2;
+        }
+        else if (a == "--export")
+        {
+            if (i + 1 >= argc)
+            {
+                throw std::invalid_argument("missing value for --export");
+            }
+            opt.export_out = argv[i + 1];
+            i += 2;
+        }
+        else if (a == "--read-export")
+        {
+            if (i + 1 >= argc)
+            {
+                throw std::invalid_argument("missing value for --read-export");
+            }
+            opt.export_in = argv[i + 1];
+            i += 2;
+        }
+        else if (a == "--checkpoint-interval")
+        {
+            if (i + 1 >= argc)
+            {
+                throw std::invalid_argument("missing value for --checkpoint-interval");
+            }
+            long long v = 0;
+            if (!parse_int(argv[i + 1], v))
+            {
+                throw std::invalid_argument("invalid --checkpoint-interval");
+            }
+            if (v < 1)
+            {
+                throw std::invalid_argument("checkpoint-interval must be >= 1");
+            }
+            opt.checkpoint_ms = static_cast<uint64_t>(v);
+            i += 2;
+        }
+        else if (a == "--pcap")
+        {
+            if (i + 1 >= argc)
+            {
+                throw std::invalid_argument("missing value for --pcap");
+            }
+            opt.pcap_in = argv[i + 1];
+            i += 2;
+        }
+        else if (a == "--write-pcap")
+        {
+            if (i + 1 >= argc)
+            {
+                throw std::invalid_argument("missing value for --write-pcap");
+            }
+            opt.pcap_out = argv[i + 1];
             i += 2;
         }
         else
@@ -629,6 +1834,43 @@ static Options parse_cli(int argc, char *argv[])
             throw std::invalid_argument("unknown option: " + a);
         }
     }
+    if (opt.sketch && !opt.checkpoint.empty())
+    {
+        throw std::invalid_argument("--checkpoint cannot be combined with --sketch");
+    }
+    if (opt.executor == "steal" && (opt.numa || !opt.metrics_out.empty()))
+    {
+        throw std::invalid_argument("--executor steal cannot be combined with --numa or --metrics");
+    }
+    if (opt.sketch && !opt.export_out.empty())
+    {
+        throw std::invalid_argument("--export cannot be combined with --sketch");
+    }
+    if (opt.ipv6_pct > 0 && (!opt.checkpoint.empty() || !opt.export_out.empty()))
+    {
+        throw std::invalid_argument("--ipv6 cannot be combined with --checkpoint or --export, which keep IPv4 statistics only");
+    }
+    bool shm = !opt.shm_serve.empty() || !opt.shm_connect.empty();
+    if (!opt.shm_serve.empty() && !opt.shm_connect.empty())
+    {
+        throw std::invalid_argument("--shm-serve and --shm-connect are mutually exclusive");
+    }
+    if (shm && (opt.numa || !opt.metrics_out.empty() || opt.executor == "steal"))
+    {
+        throw std::invalid_argument("shared-memory transport cannot be combined with --numa, --metrics or --executor steal");
+    }
+    if (!opt.shm_serve.empty() && !opt.pcap_in.empty())
+    {
+        throw std::invalid_argument("--pcap is replayed by a --shm-connect process, not by the server");
+    }
+    if (!opt.shm_connect.empty() && (opt.sketch || !opt.checkpoint.empty() || !opt.export_out.empty()))
+    {
+        throw std::invalid_argument("--shm-connect only generates events; analysis options belong to the server");
+    }
+    if (!opt.shm_connect.empty() && opt.ipv6_pct > 0)
+    {
+        throw std::invalid_argument("--ipv6 cannot be combined with --shm-connect: IPv6 event bodies stay in the generating process");
+    }
     return opt;
 }
 
@@ -644,6 +1886,15 @@ static in_addr_t rand_ip(std::mt19937 &rng)
     return static_cast<in_addr_t>(be);
 }
 
+// Addresses under the 2001:db8::/32 documentation prefix.
+static Ip6Addr rand_ip6(std::mt19937 &rng)
+{
+    std::uniform_int_distribution<uint32_t> word(0, 0xffffu);
+    uint64_t hi = (uint64_t(0x20010db8) << 32) | (static_cast<uint64_t>(word(rng)) << 16) | word(rng);
+    uint64_t lo = (static_cast<uint64_t>(word(rng)) << 48) | word(rng);
+    return Ip6Addr(hi, lo);
+}
+
 static in_port_t rand_port(std::mt19937 &rng)
 {
     std::uniform_int_distribution<int> d(1024, 65535);
@@ -657,7 +1908,29 @@ static size_t rand_size(std::mt19937 &rng)
     return static_cast<size_t>(d(rng));
 }
 
-static TcpEvent make_event(std::mt19937 &rng)
+static const uint32_t HOT_SOURCES = 4;
+
+static uint64_t now_us()
+{
+    return static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::microseconds>(
+                                     std::chrono::system_clock::now().time_since_epoch())
+                                     .count());
+}
+
+static double process_cpu_secs()
+{
+    struct rusage ru;
+    if (getrusage(RUSAGE_SELF, &ru) != 0)
+    {
+        return 0.0;
+    }
+    return static_cast<double>(ru.ru_utime.tv_sec + ru.ru_stime.tv_sec) +
+           static_cast<double>(ru.ru_utime.tv_usec + ru.ru_stime.tv_usec) / 1e6;
+}
+
+// With hot_pct > 0 that share of events comes from a handful of fixed
+// sources, which is what skews per-key load; v6_pct of events are IPv6.
+static TcpEvent make_event(std::mt19937 &rng, int hot_pct = 0, int v6_pct = 0)
 {
     std::uniform_int_distribution<int> et(0, 99);
     int v = et(rng);
@@ -688,8 +1961,255 @@ static TcpEvent make_event(std::mt19937 &rng)
             abrupt = true;
         }
     }
+    if (v6_pct > 0)
+    {
+        std::uniform_int_distribution<int> f(0, 99);
+        if (f(rng) < v6_pct)
+        {
+            tcp6_traffic_pkg pkg6(rand_ip6(rng), rand_port(rng), rand_ip6(rng), rand_port(rng), rand_size(rng));
+            return TcpEvent(t, pkg6, abrupt, now_us());
+        }
+    }
     tcp_traffic_pkg pkg(rand_ip(rng), rand_port(rng), rand_ip(rng), rand_port(rng), rand_size(rng));
-    return TcpEvent(t, pkg, abrupt);
+    if (hot_pct > 0)
+    {
+        std::uniform_int_distribution<int> h(0, 99);
+        if (h(rng) < hot_pct)
+        {
+            std::uniform_int_distribution<uint32_t> which(1, HOT_SOURCES);
+            pkg.src_addr = static_cast<in_addr_t>(htonl(0x0a000000u | which(rng)));
+        }
+    }
+    return TcpEvent(t, pkg, abrupt, now_us());
+}
+
+// Per-producer staging for the stealing executor: events are grouped by the
+// shard of their source address and submitted a batch at a time.
+class ShardRouter
+{
+public:
+    ShardRouter(StealingExecutor<TcpEvent> &ex, size_t batch) : ex_(ex), batch_(batch), staged_(ex.shard_count()) {}
+
+    bool push(const TcpEvent &ev)
+    {
+        size_t s = static_cast<size_t>(sketch_mix(ev.src_bits()) % staged_.size());
+        staged_[s].push_back(ev);
+        if (staged_[s].size() < batch_)
+        {
+            return true;
+        }
+        bool ok = ex_.submit(s, std::move(staged_[s]));
+        staged_[s].clear();
+        return ok;
+    }
+
+    bool flush()
+    {
+        size_t s = 0;
+        while (s < staged_.size())
+        {
+            if (!staged_[s].empty() && !ex_.submit(s, std::move(staged_[s])))
+            {
+                return false;
+            }
+            staged_[s].clear();
+            s += 1;
+        }
+        return true;
+    }
+
+private:
+    StealingExecutor<TcpEvent> &ex_;
+    size_t batch_;
+    std::vector<std::vector<TcpEvent>> staged_;
+};
+
+static const size_t CONSUME_BATCH = 64;
+static const size_t STEAL_BATCH = 64;
+static const size_t STEAL_SHARDS_PER_WORKER = 8;
+static const size_t REPLAY_BATCH = 256;
+static const size_t FLOW_SHARDS = 64;
+static const uint64_t METRICS_PERIOD_NS = 1000000000;
+
+static void write_synthetic_pcap(const std::string &path, size_t events, int v6_pct)
+{
+    std::mt19937 rng(std::random_device{}());
+    PcapWriter w(path);
+    uint64_t ts_us = now_us();
+    size_t i = 0;
+    while (i < events)
+    {
+        TcpEvent ev = make_event(rng, 0, v6_pct);
+        w.write_event(ev, ts_us);
+        if (ev.v6)
+        {
+            Ip6BodyPool::instance().release(ev.body6);
+        }
+        ts_us += 10;
+        i += 1;
+    }
+    w.close();
+    std::cout << "WROTE packets=" << w.packets() << " bytes=" << w.bytes() << " path=" << path << std::endl;
+}
+
+static void replay_pcap(PcapReader &reader, Coordinator &coord)
+{
+    std::vector<TcpEvent> batch;
+    batch.reserve(REPLAY_BATCH);
+    size_t next = 0;
+    TcpEvent ev;
+    while (reader.next(ev))
+    {
+        batch.push_back(ev);
+        if (batch.size() == REPLAY_BATCH)
+        {
+            if (!coord.queue(next % coord.queue_count()).push_batch(batch))
+            {
+                return;
+            }
+            next += 1;
+            batch.clear();
+        }
+    }
+    if (!batch.empty())
+    {
+        coord.queue(next % coord.queue_count()).push_batch(batch);
+    }
+}
+
+static void replay_pcap_sharded(PcapReader &reader, StealingExecutor<TcpEvent> &ex)
+{
+    ShardRouter router(ex, STEAL_BATCH);
+    TcpEvent ev;
+    while (reader.next(ev))
+    {
+        if (!router.push(ev))
+        {
+            return;
+        }
+    }
+    router.flush();
+}
+
+static void read_export(const std::string &path)
+{
+    ColumnarReader r(path);
+    ExportRow row;
+    uint64_t rows = 0;
+    uint64_t sum_out = 0;
+    uint64_t sum_in = 0;
+    uint64_t sum_conn = 0;
+    while (r.next(row))
+    {
+        if (rows < 5)
+        {
+            std::cout << ip_to_str(row.ip) << " peer=" << ip_to_str(row.peer) << " port=" << row.port
+                      << " out=" << row.bytes_out << " in=" << row.bytes_in << " conn=" << row.connections << std::endl;
+        }
+        rows += 1;
+        sum_out += row.bytes_out;
+        sum_in += row.bytes_in;
+        sum_conn += row.connections;
+    }
+    std::cout << "EXPORT-READ rows=" << rows << " sum_out=" << sum_out
+              << " sum_conn=" << sum_conn
+              << " sum_in=" << sum_in
+              << " groups=" << r.groups()
+              << " dict=" << r.dict_size()
+              << std::endl;
+}
+
+template <typename A>
+static void print_sketch(const char *tag, const BasicTrafficSketch<A> &sk)
+{
+    std::cout << tag << " distinct_ips=" << static_cast<uint64_t>(sk.distinct_ips())
+              << " distinct_ports=" << static_cast<uint64_t>(sk.distinct_ports())
+              << std::endl;
+    for (const auto &t : sk.top(10))
+    {
+        std::cout << ip_to_str(t.ip)
+                  << " sent~" << t.bytes
+                  << " err<=" << t.error
+                  << " recv~" << sk.recv_estimate(t.ip)
+                  << " peers~" << static_cast<uint64_t>(t.peers.estimate())
+                  << " ports~" << static_cast<uint64_t>(t.ports.estimate())
+                  << std::endl;
+    }
+}
+
+static const size_t ROLLUP_TOP = 3;
+
+static void print_rollup(Coordinator &coord, const std::shared_ptr<const PrefixTable> &prefixes)
+{
+    auto r0 = std::chrono::steady_clock::now();
+    PrefixRollup total(prefixes);
+    coord.merge_rollups(total);
+    auto r1 = std::chrono::steady_clock::now();
+
+    std::vector<PrefixCounters> by16 = total.by16();
+    std::vector<std::pair<uint64_t, uint32_t>> nets16;
+    size_t i = 0;
+    while (i < by16.size())
+    {
+        if (by16[i].bytes() > 0 || by16[i].connections > 0)
+        {
+            nets16.emplace_back(by16[i].bytes(), static_cast<uint32_t>(i));
+        }
+        i += 1;
+    }
+    std::vector<std::pair<uint64_t, uint32_t>> nets24;
+    total.by24().for_each([&nets24](uint32_t net, const PrefixCounters &c)
+                          { nets24.emplace_back(c.bytes(), net); });
+    std::cout << "ROLLUP nets16=" << nets16.size()
+              << " nets24=" << nets24.size()
+              << " prefixes=" << (prefixes != nullptr ? prefixes->size() : 0)
+              << " unmatched_bytes=" << total.customers()[0].bytes()
+              << " merge_us=" << std::chrono::duration_cast<std::chrono::microseconds>(r1 - r0).count()
+              << std::endl;
+
+    auto by_bytes = [](const std::pair<uint64_t, uint32_t> &x, const std::pair<uint64_t, uint32_t> &y)
+    {
+        return x.first != y.first ? x.first > y.first : x.second < y.second;
+    };
+    size_t n16 = std::min(ROLLUP_TOP, nets16.size());
+    std::partial_sort(nets16.begin(), nets16.begin() + static_cast<std::ptrdiff_t>(n16), nets16.end(), by_bytes);
+    size_t n24 = std::min(ROLLUP_TOP, nets24.size());
+    std::partial_sort(nets24.begin(), nets24.begin() + static_cast<std::ptrdiff_t>(n24), nets24.end(), by_bytes);
+    auto print_net = [](const char *tag, const std::string &name, const PrefixCounters &c)
+    {
+        std::cout << tag << " " << name
+                  << " sent=" << c.sent
+                  << " recv=" << c.recv
+                  << " conn=" << c.connections
+                  << std::endl;
+    };
+    i = 0;
+    while (i < n16)
+    {
+        print_net("NET", prefix_to_str(nets16[i].second << 16, 16), by16[nets16[i].second]);
+        i += 1;
+    }
+    i = 0;
+    while (i < n24)
+    {
+        print_net("NET", prefix_to_str(nets24[i].second << 8, 24), *total.by24().find(nets24[i].second));
+        i += 1;
+    }
+    if (prefixes != nullptr)
+    {
+        uint16_t id = 1;
+        while (id <= prefixes->size())
+        {
+            const CidrPrefix &p = prefixes->prefix(id);
+            std::string label = prefix_to_str(p.addr, p.len);
+            if (!p.name.empty())
+            {
+                label += " name=" + p.name;
+            }
+            print_net("PREFIX", label, total.customers()[id]);
+            id += 1;
+        }
+    }
 }
 
 int run_app(int argc, char *argv[])
@@ -699,44 +2219,249 @@ int run_app(int argc, char *argv[])
     Logger log;
     log.set_level(Logger::Level::Info);
 
-    Coordinator coord(opt.capacity);
+    if (!opt.pcap_out.empty())
+    {
+        write_synthetic_pcap(opt.pcap_out, opt.events, opt.ipv6_pct);
+        return 0;
+    }
+
+    if (!opt.export_in.empty())
+    {
+        read_export(opt.export_in);
+        return 0;
+    }
+
+    // SIGUSR1 is blocked before any thread starts so that only the metrics
+    // thread receives it, through sigtimedwait.
+    std::unique_ptr<QueueMetrics> metrics;
+    sigset_t usr1;
+    sigemptyset(&usr1);
+    sigaddset(&usr1, SIGUSR1);
+    if (!opt.metrics_out.empty())
+    {
+        metrics = std::make_unique<QueueMetrics>();
+        pthread_sigmask(SIG_BLOCK, &usr1, nullptr);
+    }
+
+    CpuTopology topo = CpuTopology::detect();
+    std::vector<int> cpus;
+    if (opt.pin || opt.numa)
+    {
+        cpus = opt.pin_cpus.empty() ? topo.allowed() : parse_cpulist(opt.pin_cpus);
+        if (cpus.empty())
+        {
+            throw std::invalid_argument("--pin: empty cpu list");
+        }
+    }
+    // A shared-memory server has no generators of its own, a connected
+    // generator process has no analyzers.
+    bool shm_serve = !opt.shm_serve.empty();
+    bool shm_connect = !opt.shm_connect.empty();
+    int producer_threads = shm_serve ? 0 : (opt.pcap_in.empty() ? opt.producers : 1);
+    Placement place = topo.plan(cpus, producer_threads, shm_connect ? 0 : opt.consumers, opt.numa);
+    if (!cpus.empty())
+    {
+        std::cout << "PLACEMENT nodes=" << topo.node_count() << " queues=" << place.queues << " consumers=";
+        size_t k = 0;
+        while (k < place.consumer_cpu.size())
+        {
+            std::cout << (k > 0 ? "," : "") << place.consumer_cpu[k] << "@" << topo.node_of(place.consumer_cpu[k]);
+            k += 1;
+        }
+        std::cout << " producers=";
+        k = 0;
+        while (k < place.producer_cpu.size())
+        {
+            std::cout << (k > 0 ? "," : "") << place.producer_cpu[k] << "@" << topo.node_of(place.producer_cpu[k]);
+            k += 1;
+        }
+        std::cout << std::endl;
+    }
+
+    std::vector<std::unique_ptr<EventQueue<TcpEvent>>> queues;
+    ShmQueue<TcpEvent> *shm_in = nullptr;
+    if (shm_serve)
+    {
+        auto q = std::make_unique<ShmQueue<TcpEvent>>(opt.shm_serve, ShmRole::Serve, opt.capacity,
+                                                      static_cast<size_t>(opt.shm_producers));
+        shm_in = q.get();
+        queues.push_back(std::move(q));
+    }
+    else if (shm_connect)
+    {
+        // Every generator thread owns a single-producer ring.
+        size_t k = 0;
+        while (k < place.producer_queue.size())
+        {
+            queues.push_back(std::make_unique<ShmQueue<TcpEvent>>(opt.shm_connect, ShmRole::Connect));
+            place.producer_queue[k] = k;
+            k += 1;
+        }
+    }
+    else
+    {
+        size_t k = 0;
+        while (k < place.queues)
+        {
+            queues.push_back(std::make_unique<BoundedQueue<TcpEvent>>(opt.capacity, opt.wait, metrics.get()));
+            k += 1;
+        }
+    }
+    Coordinator coord(std::move(queues), metrics.get());
+    auto flows = std::make_shared<FlowTable>(FLOW_SHARDS, opt.flow_idle_s * 1000000);
+    auto flows6 = std::make_shared<Flow6Table>(FLOW_SHARDS, opt.flow_idle_s * 1000000);
+    std::shared_ptr<const PrefixTable> prefixes;
+    if (!opt.prefixes.empty())
+    {
+        prefixes = std::make_shared<const PrefixTable>(load_prefixes(opt.prefixes));
+    }
 
+    // The stealing executor keeps one analyzer per shard rather than per
+    // worker, so that a shard's state is only ever touched by the worker
+    // currently holding that shard.
+    bool steal = opt.executor == "steal";
+    size_t analyzer_count = shm_connect ? 0 : static_cast<size_t>(opt.consumers) * (steal ? STEAL_SHARDS_PER_WORKER : 1);
     std::vector<std::shared_ptr<Analyzer>> analyzers;
-    int ci = 0;
-    while (ci < opt.consumers)
+    size_t ai = 0;
+    while (ai < analyzer_count)
     {
-        analyzers.push_back(std::make_shared<Analyzer>());
+        std::shared_ptr<Analyzer> a;
+        run_on_cpu(place.consumer_cpu[ai % place.consumer_cpu.size()], [&a, &flows, &flows6, &prefixes, &opt]()
+                   { a = std::make_shared<Analyzer>(flows, opt.sketch, flows6, opt.rollup, prefixes); });
+        analyzers.push_back(a);
         coord.add_analyzer(analyzers.back());
-        ci += 1;
+        ai += 1;
+    }
+
+    std::unique_ptr<Checkpointer> cp;
+    if (!opt.checkpoint.empty())
+    {
+        auto r0 = std::chrono::steady_clock::now();
+        cp = std::make_unique<Checkpointer>(opt.checkpoint);
+        auto base = cp->load();
+        size_t restored = base.size();
+        size_t expired = analyzers.front()->restore(std::move(base));
+        auto r1 = std::chrono::steady_clock::now();
+        std::cout << "RESTORED ips=" << restored
+                  << " expired=" << expired
+                  << " generation=" << cp->generation()
+                  << " ms=" << std::chrono::duration<double, std::milli>(r1 - r0).count()
+                  << std::endl;
     }
 
+    // Opened before any thread starts, so a bad capture is reported as an
+    // error instead of unwinding past running threads.
+    std::unique_ptr<PcapReader> replay;
+    if (!opt.pcap_in.empty())
+    {
+        replay = std::make_unique<PcapReader>(opt.pcap_in, shm_connect);
+    }
+
+    auto run0 = std::chrono::steady_clock::now();
+    double cpu0 = process_cpu_secs();
+    bool track_latency = opt.pcap_in.empty();
+    std::mutex lat_m;
+    uint64_t lat_sum = 0;
+    uint64_t lat_count = 0;
+    uint64_t lat_max = 0;
+    std::unique_ptr<StealingExecutor<TcpEvent>> exec;
+    if (steal)
+    {
+        exec = std::make_unique<StealingExecutor<TcpEvent>>(static_cast<size_t>(opt.consumers), analyzers.size(),
+                                                            std::max<size_t>(1, opt.capacity / STEAL_BATCH),
+                                                            [&analyzers](size_t shard, const std::vector<TcpEvent> &batch)
+                                                            {
+                                                                for (const TcpEvent &ev : batch)
+                                                                {
+                                                                    analyzers[shard]->consume(ev);
+                                                                }
+                                                            });
+        exec->start(place.consumer_cpu);
+    }
     std::vector<std::thread> consumers;
-    for (std::shared_ptr<Analyzer> a : analyzers)
+    size_t ci = 0;
+    while (!steal && ci < analyzers.size())
     {
-        consumers.emplace_back([&coord, a]()
+        std::shared_ptr<Analyzer> a = analyzers[ci];
+        consumers.emplace_back([&coord, &lat_m, &lat_sum, &lat_count, &lat_max, track_latency, a,
+                                cpu = place.consumer_cpu[ci], qi = place.consumer_queue[ci]]()
                                {
             try {
-                TcpEvent ev;
+                if (!pin_current_thread(cpu)) {
+                    note_pin_failure(cpu);
+                }
+                EventQueue<TcpEvent> &q = coord.queue(qi);
+                std::vector<TcpEvent> batch;
+                batch.reserve(CONSUME_BATCH);
+                uint64_t sum = 0;
+                uint64_t count = 0;
+                uint64_t worst = 0;
                 bool ok = true;
-                ok = coord.queue().pop(ev);
+                ok = q.pop_batch(batch, CONSUME_BATCH);
                 while (ok) {
-                    a->consume(ev);
-                    ok = coord.queue().pop(ev);
+                    uint64_t now = track_latency ? now_us() : 0;
+                    for (const TcpEvent &ev : batch) {
+                        if (track_latency && now > ev.ts_us) {
+                            uint64_t lat = now - ev.ts_us;
+                            sum += lat;
+                            worst = std::max(worst, lat);
+                        }
+                        count += 1;
+                        a->consume(ev);
+                    }
+                    ok = q.pop_batch(batch, CONSUME_BATCH);
+                }
+                {
+                    std::lock_guard<std::mutex> lk(lat_m);
+                    lat_sum += sum;
+                    lat_count += count;
+                    lat_max = std::max(lat_max, worst);
                 }
                 a->mark_done();
             } catch (...) {
                 a->mark_done();
             } });
+        ci += 1;
     }
 
     std::atomic<size_t> produced{0};
     std::vector<std::thread> producers;
+    double replay_secs = 0.0;
+    if (replay != nullptr)
+    {
+        producers.emplace_back([&coord, &log, &replay, &replay_secs, &exec, cpu = place.producer_cpu[0]]()
+                               {
+            try {
+                if (!pin_current_thread(cpu)) {
+                    note_pin_failure(cpu);
+                }
+                auto t0 = std::chrono::steady_clock::now();
+                if (exec != nullptr) {
+                    replay_pcap_sharded(*replay, *exec);
+                } else {
+                    replay_pcap(*replay, coord);
+                }
+                auto t1 = std::chrono::steady_clock::now();
+                replay_secs = std::chrono::duration<double>(t1 - t0).count();
+            } catch (const std::exception &e) {
+                log.error(std::string("replay: ") + e.what());
+            } });
+    }
     int pi = 0;
-    while (pi < opt.producers)
+    while (replay == nullptr && pi < producer_threads)
     {
-        producers.emplace_back([&coord, &log, &produced, total = opt.events, seed = std::random_device{}() + static_cast<unsigned>(pi)]()
+        producers.emplace_back([&coord, &log, &produced, &exec, total = opt.events, skew = opt.skew_pct, v6 = opt.ipv6_pct, seed = std::random_device{}() + static_cast<unsigned>(pi),
+                                cpu = place.producer_cpu[static_cast<size_t>(pi)], qi = place.producer_queue[static_cast<size_t>(pi)]]()
                                {
             try {
+                if (!pin_current_thread(cpu)) {
+                    note_pin_failure(cpu);
+                }
+                EventQueue<TcpEvent> &q = coord.queue(qi);
+                std::unique_ptr<ShardRouter> router;
+                if (exec != nullptr) {
+                    router = std::make_unique<ShardRouter>(*exec, STEAL_BATCH);
+                }
                 std::mt19937 rng(seed);
                 bool keep = true;
                 while (keep) {
@@ -744,8 +2469,8 @@ int run_app(int argc, char *argv[])
                     if (cur >= total) {
                         break;
                     }
-                    TcpEvent ev = make_event(rng);
-                    bool pushed = coord.queue().push(ev);
+                    TcpEvent ev = make_event(rng, skew, v6);
+                    bool pushed = router != nullptr ? router->push(ev) : q.push(ev);
                     if (!pushed) {
                         break;
                     }
@@ -763,11 +2488,57 @@ int run_app(int argc, char *argv[])
                         }
                     }
                 }
+                if (router != nullptr) {
+                    router->flush();
+                }
             } catch (...) {
             } });
         pi += 1;
     }
 
+    std::mutex cp_m;
+    std::condition_variable cp_cv;
+    bool cp_stop = false;
+    std::thread cp_thread;
+    if (cp != nullptr)
+    {
+        cp_thread = std::thread([&coord, &log, &cp, &cp_m, &cp_cv, &cp_stop, interval = opt.checkpoint_ms]()
+                                {
+            std::unique_lock<std::mutex> lk(cp_m);
+            while (!cp_cv.wait_for(lk, std::chrono::milliseconds(interval), [&cp_stop]() { return cp_stop; })) {
+                try {
+                    coord.checkpoint(*cp);
+                } catch (const std::exception &e) {
+                    log.error(std::string("checkpoint: ") + e.what());
+                }
+            } });
+    }
+
+    std::atomic<bool> metrics_stop{false};
+    std::thread metrics_thread;
+    if (metrics != nullptr)
+    {
+        metrics_thread = std::thread([&metrics, &log, &metrics_stop, &usr1, path = opt.metrics_out]()
+                                     {
+            timespec tick{0, 100000000};
+            uint64_t last = mono_ns();
+            while (!metrics_stop.load(std::memory_order_acquire)) {
+                int sig = sigtimedwait(&usr1, nullptr, &tick);
+                try {
+                    if (sig == SIGUSR1) {
+                        std::cerr << metrics->render() << std::flush;
+                        metrics->write_file(path);
+                        last = mono_ns();
+                    } else if (mono_ns() - last >= METRICS_PERIOD_NS) {
+                        metrics->write_file(path);
+                        last = mono_ns();
+                    }
+                } catch (const std::exception &e) {
+                    log.error(std::string("metrics: ") + e.what());
+                }
+            } });
+    }
+
     for (auto &t : producers)
     {
         if (t.joinable())
@@ -776,7 +2547,23 @@ int run_app(int argc, char *argv[])
         }
     }
 
-    coord.queue().close();
+    // The server's queue ends by itself once every generator process has
+    // detached or died; closing it here would cut them off.
+    if (!shm_serve)
+    {
+        coord.close_queues();
+    }
+
+    if (shm_connect)
+    {
+        auto run1 = std::chrono::steady_clock::now();
+        size_t sent = replay != nullptr ? replay->events() : std::min(produced.load(), opt.events);
+        std::cout << "SHM-SENT rings=" << coord.queue_count()
+                  << " events=" << sent
+                  << " secs=" << std::chrono::duration<double>(run1 - run0).count()
+                  << std::endl;
+        return 0;
+    }
 
     for (auto &t : consumers)
     {
@@ -786,6 +2573,205 @@ int run_app(int argc, char *argv[])
         }
     }
 
+    if (exec != nullptr)
+    {
+        exec->close();
+        exec->join();
+        for (auto &a : analyzers)
+        {
+            a->mark_done();
+        }
+        uint64_t executed = 0;
+        uint64_t stolen = 0;
+        uint64_t handoffs = 0;
+        uint64_t busiest = 0;
+        for (const StealStats &s : exec->stats())
+        {
+            executed += s.executed;
+            stolen += s.stolen;
+            handoffs += s.handoffs;
+            busiest = std::max(busiest, s.executed);
+        }
+        std::cout << "STEAL workers=" << opt.consumers
+                  << " shards=" << exec->shard_count()
+                  << " batches=" << executed
+                  << " stolen=" << stolen
+                  << " handoffs=" << handoffs
+                  << " busiest_share=" << (executed > 0 ? static_cast<double>(busiest) / static_cast<double>(executed) : 0.0)
+                  << " backlog_peak=" << exec->backlog_peak()
+                  << " max_pending=" << exec->max_pending()
+                  << std::endl;
+    }
+
+    auto run1 = std::chrono::steady_clock::now();
+    double run_secs = std::chrono::duration<double>(run1 - run0).count();
+    size_t run_events = replay != nullptr ? replay->events() : std::min(produced.load(), opt.events);
+    if (shm_in != nullptr)
+    {
+        coord.close_queues();
+        run_events = lat_count;
+        std::cout << "SHM rings=" << shm_in->ring_count() << " crashed=" << shm_in->crashed() << std::endl;
+    }
+    double cpu_secs = process_cpu_secs() - cpu0;
+    std::cout << "RUN events=" << run_events
+              << " secs=" << run_secs
+              << " ev/s=" << (run_secs > 0.0 ? static_cast<double>(run_events) / run_secs : 0.0)
+              << std::endl;
+    std::cout << "WAIT strategy=" << wait_strategy_name(opt.wait)
+              << " cpu_pct=" << (run_secs > 0.0 ? cpu_secs / run_secs * 100.0 : 0.0)
+              << " notifies=" << coord.queue_notifies()
+              << " elided=" << coord.queue_elided();
+    if (track_latency)
+    {
+        std::cout << " lat_avg_us=" << (lat_count > 0 ? static_cast<double>(lat_sum) / static_cast<double>(lat_count) : 0.0)
+                  << " lat_max_us=" << lat_max;
+    }
+    std::cout << std::endl;
+
+    if (metrics != nullptr)
+    {
+        metrics_stop.store(true, std::memory_order_release);
+        metrics_thread.join();
+        metrics->write_file(opt.metrics_out);
+        std::cout << "METRICS enqueued=" << metrics->enqueued.load()
+                  << " dequeued=" << metrics->dequeued.load()
+                  << " full_stalls=" << metrics->full_stalls.load()
+                  << " empty_waits=" << metrics->empty_waits.load()
+                  << " occupancy_p99=" << metrics->occupancy.quantile(0.99)
+                  << " latency_p99_us=" << static_cast<double>(metrics->latency_ns.quantile(0.99)) / 1000.0
+                  << " file=" << opt.metrics_out
+                  << std::endl;
+    }
+
+    if (cp != nullptr)
+    {
+        {
+            std::lock_guard<std::mutex> lk(cp_m);
+            cp_stop = true;
+        }
+        cp_cv.notify_all();
+        cp_thread.join();
+        size_t written = coord.checkpoint(*cp);
+        std::cout << "CHECKPOINT ips=" << written
+                  << " generation=" << cp->generation()
+                  << " records=" << cp->records_written()
+                  << " bytes=" << cp->bytes()
+                  << std::endl;
+    }
+
+    if (replay != nullptr)
+    {
+        double mbps = replay_secs > 0.0 ? static_cast<double>(replay->bytes()) / replay_secs / 1e6 : 0.0;
+        std::cout << "REPLAY packets=" << replay->packets()
+                  << " events=" << replay->events()
+                  << " skipped=" << replay->skipped()
+                  << " secs=" << replay_secs
+                  << " MB/s=" << mbps
+                  << std::endl;
+    }
+
+    std::cout << "WINDOWS live=" << coord.window_count() << std::endl;
+    FlowGauges fg = flows->gauges();
+    fg.add(flows6->gauges());
+    size_t finished = fg.closed + fg.aborted + fg.expired;
+    std::cout << "FLOWS active=" << fg.active
+              << " opened=" << fg.opened
+              << " closed=" << fg.closed
+              << " aborted=" << fg.aborted
+              << " expired=" << fg.expired
+              << " unmatched=" << fg.unmatched
+              << " avg_ms=" << (finished > 0 ? static_cast<double>(fg.duration_us) / static_cast<double>(finished) / 1000.0 : 0.0)
+              << std::endl;
+
+    if (pin_failures().count.load() > 0)
+    {
+        log.warn("could not pin " + std::to_string(pin_failures().count.load()) + " thread(s), first to cpu " +
+                 std::to_string(pin_failures().first_cpu.load()) + "; they ran unpinned");
+    }
+    auto merged6 = coord.merge_all6();
+    if (!merged6.empty() && (!opt.checkpoint.empty() || !opt.export_out.empty()))
+    {
+        log.warn("IPv6 statistics for " + std::to_string(merged6.size()) +
+                 " addresses are not included in the checkpoint or export, which keep IPv4 statistics only");
+    }
+    if (!merged6.empty())
+    {
+        std::cout << "IPV6 ips=" << merged6.size() << " live_bodies=" << Ip6BodyPool::instance().live() << std::endl;
+        const Ip6Addr &first = merged6.begin()->first;
+        Ip6Stats live = coord.query_ip(first);
+        std::cout << "LIVE6 " << ip_to_str(first) << " sent=" << live.total_sent << " recv=" << live.total_recv
+                  << " conn=" << live.connections
+                  << " sent_60s=" << live.recent.last_60s.sent
+                  << " recv_60s=" << live.recent.last_60s.recv
+                  << std::endl;
+        size_t shown = 0;
+        for (const auto &kv : merged6)
+        {
+            if (shown >= 5)
+            {
+                break;
+            }
+            std::cout << ip_to_str(kv.first)
+                      << " sent=" << kv.second.total_sent
+                      << " recv=" << kv.second.total_recv
+                      << " conn=" << kv.second.connections
+                      << " active=" << kv.second.active()
+                      << " closed=" << kv.second.closed
+                      << " aborted=" << kv.second.aborted
+                      << std::endl;
+            shown += 1;
+        }
+    }
+
+    if (opt.rollup)
+    {
+        print_rollup(coord, prefixes);
+    }
+
+    if (opt.sketch)
+    {
+        print_sketch("SKETCH", coord.merge_sketches<uint32_t>());
+        Traffic6Sketch sk6 = coord.merge_sketches<Ip6Addr>();
+        if (sk6.distinct_ips() > 0.0)
+        {
+            print_sketch("SKETCH6", sk6);
+        }
+        return 0;
+    }
+
+    if (!opt.export_out.empty())
+    {
+        auto e0 = std::chrono::steady_clock::now();
+        ColumnarWriter w(opt.export_out);
+        coord.export_to(w);
+        auto e1 = std::chrono::steady_clock::now();
+        std::cout << "EXPORT rows=" << w.rows() << " sum_out=" << w.bytes_out_sum()
+                  << " sum_conn=" << w.connections_sum()
+                  << " groups=" << w.groups()
+                  << " bytes=" << w.bytes()
+                  << " ms=" << std::chrono::duration<double, std::milli>(e1 - e0).count()
+                  << std::endl;
+    }
+
+    auto q0 = std::chrono::steady_clock::now();
+    TopKResult top = coord.top_k(TopMetric::BytesSent, 5);
+    auto q1 = std::chrono::steady_clock::now();
+    std::cout << "TOP5 sent exact=" << (top.exact ? 1 : 0)
+              << " us=" << std::chrono::duration_cast<std::chrono::microseconds>(q1 - q0).count();
+    for (const TopEntry &e : top.entries)
+    {
+        std::cout << " " << ip_to_str(e.ip) << "=" << e.value;
+    }
+    std::cout << std::endl;
+
+    auto v0 = std::chrono::steady_clock::now();
+    size_t refreshed = coord.refresh_view();
+    auto v1 = std::chrono::steady_clock::now();
+    std::cout << "VIEW ips=" << coord.view_size()
+              << " refreshed=" << refreshed
+              << " us=" << std::chrono::duration_cast<std::chrono::microseconds>(v1 - v0).count()
+              << std::endl;
+
     auto merged = coord.merge_all();
 
     if (!merged.empty())
@@ -793,7 +2779,13 @@ int run_app(int argc, char *argv[])
         auto it = merged.begin();
         uint32_t ip = it->first;
         IpStats live = coord.query_ip(ip);
-        std::cout << "LIVE " << ip_to_str(ip) << " sent=" << live.total_sent << " recv=" << live.total_recv << " conn=" << live.connections << std::endl;
+        std::cout << "LIVE " << ip_to_str(ip) << " sent=" << live.total_sent << " recv=" << live.total_recv << " conn=" << live.connections
+                  << " sent_1s=" << live.recent.last_1s.sent
+                  << " sent_10s=" << live.recent.last_10s.sent
+                  << " sent_60s=" << live.recent.last_60s.sent
+                  << " recv_60s=" << live.recent.last_60s.recv
+                  << " rate_60s=" << live.recent.last_60s.sent_rate(60) + live.recent.last_60s.recv_rate(60) << "B/s"
+                  << std::endl;
     }
 
     size_t printed = 0;
@@ -807,6 +2799,9 @@ int run_app(int argc, char *argv[])
                   << " sent=" << kv.second.total_sent
                   << " recv=" << kv.second.total_recv
                   << " conn=" << kv.second.connections
+                  << " active=" << kv.second.active()
+                  << " closed=" << kv.second.closed
+                  << " aborted=" << kv.second.aborted
                   << std::endl;
         size_t peers_printed = 0;
         for (const auto &p : kv.second.peers)
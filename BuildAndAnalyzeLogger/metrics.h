@@ -0,0 +1,179 @@
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <fstream>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+
+static inline uint64_t mono_ns()
+{
+    return static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(
+                                     std::chrono::steady_clock::now().time_since_epoch())
+                                     .count());
+}
+
+// Log-linear histogram: 8 sub-buckets per power of two, so any reported
+// percentile is within 12.5% of the true value. Lock-free, relaxed counters.
+class Histogram
+{
+public:
+    static constexpr size_t SUB_BITS = 3;
+    static constexpr size_t SUB = 1u << SUB_BITS;
+    static constexpr size_t BUCKETS = (64 - SUB_BITS + 1) * SUB;
+
+    Histogram() : counts_(), total_(0), sum_(0), max_(0) {}
+
+    void record(uint64_t v)
+    {
+        counts_[bucket_of(v)].fetch_add(1, std::memory_order_relaxed);
+        total_.fetch_add(1, std::memory_order_relaxed);
+        sum_.fetch_add(v, std::memory_order_relaxed);
+        uint64_t cur = max_.load(std::memory_order_relaxed);
+        while (v > cur && !max_.compare_exchange_weak(cur, v, std::memory_order_relaxed))
+        {
+        }
+    }
+
+    uint64_t count() const
+    {
+        return total_.load(std::memory_order_relaxed);
+    }
+
+    uint64_t sum() const
+    {
+        return sum_.load(std::memory_order_relaxed);
+    }
+
+    uint64_t max() const
+    {
+        return max_.load(std::memory_order_relaxed);
+    }
+
+    // Upper bound of the bucket holding the q-th quantile.
+    uint64_t quantile(double q) const
+    {
+        uint64_t n = count();
+        if (n == 0)
+        {
+            return 0;
+        }
+        uint64_t rank = static_cast<uint64_t>(q * static_cast<double>(n - 1)) + 1;
+        uint64_t seen = 0;
+        size_t b = 0;
+        while (b < BUCKETS)
+        {
+            seen += counts_[b].load(std::memory_order_relaxed);
+            if (seen >= rank)
+            {
+                uint64_t hi = upper_of(b);
+                return hi < max() ? hi : max();
+            }
+            b += 1;
+        }
+        return max();
+    }
+
+private:
+    std::atomic<uint64_t> counts_[BUCKETS];
+    std::atomic<uint64_t> total_;
+    std::atomic<uint64_t> sum_;
+    std::atomic<uint64_t> max_;
+
+    static size_t bucket_of(uint64_t v)
+    {
+        if (v < SUB)
+        {
+            return static_cast<size_t>(v);
+        }
+        size_t msb = 63 - static_cast<size_t>(__builtin_clzll(v));
+        size_t shift = msb - SUB_BITS;
+        return (shift + 1) * SUB + static_cast<size_t>((v >> shift) & (SUB - 1));
+    }
+
+    static uint64_t upper_of(size_t b)
+    {
+        if (b < SUB)
+        {
+            return b;
+        }
+        size_t shift = b / SUB - 1;
+        uint64_t base = (static_cast<uint64_t>(SUB) | (b % SUB)) << shift;
+        return base + ((uint64_t(1) << shift) - 1);
+    }
+};
+
+struct QueueMetrics
+{
+    std::atomic<uint64_t> enqueued;
+    std::atomic<uint64_t> dequeued;
+    std::atomic<uint64_t> full_stalls;
+    std::atomic<uint64_t> full_stall_ns;
+    std::atomic<uint64_t> empty_waits;
+    std::atomic<uint64_t> empty_wait_ns;
+    Histogram occupancy;
+    Histogram latency_ns;
+    uint64_t start_ns;
+
+    QueueMetrics() : enqueued(0), dequeued(0), full_stalls(0), full_stall_ns(0), empty_waits(0), empty_wait_ns(0),
+                     occupancy(), latency_ns(), start_ns(mono_ns()) {}
+
+    // Prometheus text exposition format.
+    std::string render() const
+    {
+        double up = static_cast<double>(mono_ns() - start_ns) / 1e9;
+        uint64_t enq = enqueued.load(std::memory_order_relaxed);
+        uint64_t deq = dequeued.load(std::memory_order_relaxed);
+        std::ostringstream os;
+        os << "queue_uptime_seconds " << up << "\n";
+        os << "queue_enqueued_total " << enq << "\n";
+        os << "queue_dequeued_total " << deq << "\n";
+        os << "queue_enqueue_rate " << (up > 0.0 ? static_cast<double>(enq) / up : 0.0) << "\n";
+        os << "queue_dequeue_rate " << (up > 0.0 ? static_cast<double>(deq) / up : 0.0) << "\n";
+        os << "queue_full_stalls_total " << full_stalls.load(std::memory_order_relaxed) << "\n";
+        os << "queue_full_stall_seconds_total " << static_cast<double>(full_stall_ns.load(std::memory_order_relaxed)) / 1e9 << "\n";
+        os << "queue_empty_waits_total " << empty_waits.load(std::memory_order_relaxed) << "\n";
+        os << "queue_empty_wait_seconds_total " << static_cast<double>(empty_wait_ns.load(std::memory_order_relaxed)) / 1e9 << "\n";
+        render_summary(os, "queue_occupancy", occupancy, 1.0);
+        render_summary(os, "queue_latency_seconds", latency_ns, 1e-9);
+        return os.str();
+    }
+
+    void write_file(const std::string &path) const
+    {
+        std::string tmp = path + ".tmp";
+        {
+            std::ofstream out(tmp, std::ios::trunc);
+            out << render();
+            out.flush();
+            if (!out)
+            {
+                throw std::runtime_error("metrics: cannot write " + tmp);
+            }
+        }
+        if (std::rename(tmp.c_str(), path.c_str()) != 0)
+        {
+            throw std::runtime_error("metrics: cannot replace " + path);
+        }
+    }
+
+private:
+    static void render_summary(std::ostringstream &os, const char *name, const Histogram &h, double scale)
+    {
+        static const double qs[] = {0.5, 0.9, 0.99, 0.999};
+        for (double q : qs)
+        {
+            os << name << "{quantile=\"" << q << "\"} " << static_cast<double>(h.quantile(q)) * scale << "\n";
+        }
+        os << name << "_max " << static_cast<double>(h.max()) * scale << "\n";
+        os << name << "_sum " << static_cast<double>(h.sum()) * scale << "\n";
+        os << name << "_count " << h.count() << "\n";
+    }
+};
+
+#endif
@@ -0,0 +1,487 @@
+#ifndef PCAP_H
+#define PCAP_H
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <stdexcept>
+#include <string>
+#include <utility>
+
+#include "traffic.h"
+
+static const uint32_t PCAP_MAGIC_US = 0xa1b2c3d4;
+static const uint32_t PCAP_MAGIC_NS = 0xa1b23c4d;
+static const uint32_t PCAP_LINK_NULL = 0;
+static const uint32_t PCAP_LINK_ETHERNET = 1;
+static const uint32_t PCAP_LINK_RAW = 101;
+static const uint32_t PCAP_LINK_LINUX_SLL = 113;
+static const size_t PCAP_MAX_PAYLOAD = 65495;
+
+static const uint8_t TCP_FLAG_FIN = 0x01;
+static const uint8_t TCP_FLAG_SYN = 0x02;
+static const uint8_t TCP_FLAG_RST = 0x04;
+static const uint8_t TCP_FLAG_PSH = 0x08;
+static const uint8_t TCP_FLAG_ACK = 0x10;
+
+class PcapReader
+{
+public:
+    // With ipv4_only, IPv6 packets are counted as skipped.
+    explicit PcapReader(const std::string &path, bool ipv4_only = false)
+        : fd_(-1), base_(nullptr), size_(0), off_(0), swapped_(false), nanos_(false), ipv4_only_(ipv4_only), linktype_(0),
+          has_pending_(false), pending_(), packets_(0), events_(0), skipped_(0)
+    {
+        fd_ = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+        if (fd_ < 0)
+        {
+            throw std::runtime_error("pcap: cannot open " + path + ": " + std::strerror(errno));
+        }
+        struct stat st;
+        if (fstat(fd_, &st) != 0 || !S_ISREG(st.st_mode))
+        {
+            ::close(fd_);
+            throw std::runtime_error("pcap: not a regular file: " + path);
+        }
+        size_ = static_cast<size_t>(st.st_size);
+        if (size_ < 24)
+        {
+            ::close(fd_);
+            throw std::runtime_error("pcap: file too short: " + path);
+        }
+        void *p = mmap(nullptr, size_, PROT_READ, MAP_PRIVATE, fd_, 0);
+        if (p == MAP_FAILED)
+        {
+            ::close(fd_);
+            throw std::runtime_error("pcap: mmap failed: " + path);
+        }
+        base_ = static_cast<const uint8_t *>(p);
+        madvise(p, size_, MADV_SEQUENTIAL);
+
+        uint32_t magic = 0;
+        std::memcpy(&magic, base_, 4);
+        if (magic == PCAP_MAGIC_US || magic == PCAP_MAGIC_NS)
+        {
+            swapped_ = false;
+            nanos_ = (magic == PCAP_MAGIC_NS);
+        }
+        else if (__builtin_bswap32(magic) == PCAP_MAGIC_US || __builtin_bswap32(magic) == PCAP_MAGIC_NS)
+        {
+            swapped_ = true;
+            nanos_ = (__builtin_bswap32(magic) == PCAP_MAGIC_NS);
+        }
+        else
+        {
+            release();
+            throw std::runtime_error("pcap: bad magic (pcapng is not supported): " + path);
+        }
+        linktype_ = u32(base_ + 20) & 0x0fffffff;
+        if (linktype_ != PCAP_LINK_ETHERNET && linktype_ != PCAP_LINK_RAW &&
+            linktype_ != PCAP_LINK_LINUX_SLL && linktype_ != PCAP_LINK_NULL)
+        {
+            release();
+            throw std::runtime_error("pcap: unsupported link type " + std::to_string(linktype_));
+        }
+        off_ = 24;
+    }
+
+    ~PcapReader()
+    {
+        release();
+    }
+
+    PcapReader(const PcapReader &) = delete;
+    PcapReader &operator=(const PcapReader &) = delete;
+
+    bool next(TcpEvent &ev)
+    {
+        if (has_pending_)
+        {
+            has_pending_ = false;
+            ev = pending_;
+            events_ += 1;
+            return true;
+        }
+        while (off_ + 16 <= size_)
+        {
+            const uint8_t *rec = base_ + off_;
+            uint32_t caplen = u32(rec + 8);
+            uint32_t origlen = u32(rec + 12);
+            if (caplen > size_ - off_ - 16)
+            {
+                skipped_ += 1;
+                off_ = size_;
+                break;
+            }
+            off_ += 16 + static_cast<size_t>(caplen);
+            packets_ += 1;
+            uint64_t frac = u32(rec + 4);
+            uint64_t ts_us = static_cast<uint64_t>(u32(rec)) * 1000000 + (nanos_ ? frac / 1000 : frac);
+            if (decode(rec + 16, caplen, origlen, ts_us, ev))
+            {
+                events_ += 1;
+                return true;
+            }
+            skipped_ += 1;
+        }
+        return false;
+    }
+
+    size_t packets() const
+    {
+        return packets_;
+    }
+
+    size_t events() const
+    {
+        return events_;
+    }
+
+    size_t skipped() const
+    {
+        return skipped_;
+    }
+
+    size_t bytes() const
+    {
+        return size_;
+    }
+
+private:
+    int fd_;
+    const uint8_t *base_;
+    size_t size_;
+    size_t off_;
+    bool swapped_;
+    bool nanos_;
+    bool ipv4_only_;
+    uint32_t linktype_;
+    bool has_pending_;
+    TcpEvent pending_;
+    size_t packets_;
+    size_t events_;
+    size_t skipped_;
+
+    void release()
+    {
+        if (base_ != nullptr)
+        {
+            munmap(const_cast<uint8_t *>(base_), size_);
+            base_ = nullptr;
+        }
+        if (fd_ >= 0)
+        {
+            ::close(fd_);
+            fd_ = -1;
+        }
+    }
+
+    uint32_t u32(const uint8_t *p) const
+    {
+        uint32_t v = 0;
+        std::memcpy(&v, p, 4);
+        if (swapped_)
+        {
+            v = __builtin_bswap32(v);
+        }
+        return v;
+    }
+
+    static uint16_t be16(const uint8_t *p)
+    {
+        return static_cast<uint16_t>((p[0] << 8) | p[1]);
+    }
+
+    bool decode(const uint8_t *p, uint32_t caplen, uint32_t origlen, uint64_t ts_us, TcpEvent &ev)
+    {
+        size_t len = caplen;
+        uint16_t ethertype = 0x0800;
+        if (linktype_ == PCAP_LINK_ETHERNET)
+        {
+            if (len < 14)
+            {
+                return false;
+            }
+            ethertype = be16(p + 12);
+            p += 14;
+            len -= 14;
+            while ((ethertype == 0x8100 || ethertype == 0x88a8) && len >= 4)
+            {
+                ethertype = be16(p + 2);
+                p += 4;
+                len -= 4;
+            }
+        }
+        else if (linktype_ == PCAP_LINK_LINUX_SLL)
+        {
+            if (len < 16)
+            {
+                return false;
+            }
+            ethertype = be16(p + 14);
+            p += 16;
+            len -= 16;
+        }
+        else if (linktype_ == PCAP_LINK_NULL)
+        {
+            if (len < 4)
+            {
+                return false;
+            }
+            p += 4;
+            len -= 4;
+        }
+        if ((linktype_ == PCAP_LINK_RAW || linktype_ == PCAP_LINK_NULL) && len > 0 && (p[0] >> 4) == 6)
+        {
+            ethertype = 0x86dd;
+        }
+        if (ethertype == 0x86dd)
+        {
+            return !ipv4_only_ && decode6(p, len, caplen, origlen, ts_us, ev);
+        }
+        if (ethertype != 0x0800 || len < 20 || (p[0] >> 4) != 4)
+        {
+            return false;
+        }
+
+        size_t ihl = static_cast<size_t>(p[0] & 0x0f) * 4;
+        uint16_t total = be16(p + 2);
+        uint16_t frag = be16(p + 6);
+        if (ihl < 20 || len < ihl + 20 || p[9] != IPPROTO_TCP || (frag & 0x1fff) != 0)
+        {
+            return false;
+        }
+
+        tcp_traffic_pkg pkg;
+        std::memcpy(&pkg.src_addr, p + 12, 4);
+        std::memcpy(&pkg.dst_addr, p + 16, 4);
+        size_t ip_len = total;
+        if (ip_len == 0)
+        {
+            size_t link = static_cast<size_t>(caplen) - len;
+            ip_len = origlen > link ? origlen - link : len;
+        }
+        return decode_tcp(pkg, p + ihl, ip_len > ihl ? ip_len - ihl : 0, ts_us, ev);
+    }
+
+    // Only packets whose next header is TCP are taken; extension headers
+    // are counted as skipped.
+    bool decode6(const uint8_t *p, size_t len, uint32_t caplen, uint32_t origlen, uint64_t ts_us, TcpEvent &ev)
+    {
+        if (len < 60 || (p[0] >> 4) != 6 || p[6] != IPPROTO_TCP)
+        {
+            return false;
+        }
+        tcp6_traffic_pkg pkg;
+        pkg.src_addr = Ip6Addr::from_bytes(p + 8);
+        pkg.dst_addr = Ip6Addr::from_bytes(p + 24);
+        size_t tcp_len = be16(p + 4);
+        if (tcp_len == 0)
+        {
+            size_t link = static_cast<size_t>(caplen) - len;
+            tcp_len = origlen > link + 40 ? origlen - link - 40 : len - 40;
+        }
+        return decode_tcp(pkg, p + 40, tcp_len, ts_us, ev);
+    }
+
+    template <typename Pkg>
+    bool decode_tcp(Pkg &pkg, const uint8_t *tcp, size_t tcp_len, uint64_t ts_us, TcpEvent &ev)
+    {
+        size_t doff = static_cast<size_t>(tcp[12] >> 4) * 4;
+        uint8_t flags = tcp[13];
+        if (doff < 20)
+        {
+            return false;
+        }
+        size_t payload = tcp_len > doff ? tcp_len - doff : 0;
+        std::memcpy(&pkg.src_port, tcp, 2);
+        std::memcpy(&pkg.dst_port, tcp + 2, 2);
+        pkg.sz = payload;
+
+        bool closing = (flags & (TCP_FLAG_FIN | TCP_FLAG_RST)) != 0;
+        bool abrupt = (flags & TCP_FLAG_RST) != 0;
+        if ((flags & TCP_FLAG_SYN) != 0 && (flags & TCP_FLAG_ACK) == 0 && !closing)
+        {
+            ev = TcpEvent(EventType::Connect, pkg, false, ts_us);
+            return true;
+        }
+        if (payload > 0)
+        {
+            ev = TcpEvent(EventType::Send, pkg, false, ts_us);
+            if (closing)
+            {
+                pkg.sz = 0;
+                pending_ = TcpEvent(EventType::Disconnect, pkg, abrupt, ts_us);
+                has_pending_ = true;
+            }
+            return true;
+        }
+        if (closing)
+        {
+            ev = TcpEvent(EventType::Disconnect, pkg, abrupt, ts_us);
+            return true;
+        }
+        return false;
+    }
+};
+
+class PcapWriter
+{
+public:
+    explicit PcapWriter(const std::string &path)
+        : out_(path, std::ios::binary | std::ios::trunc), packets_(0), bytes_(0)
+    {
+        if (!out_)
+        {
+            throw std::runtime_error("pcap: cannot create " + path);
+        }
+        uint8_t hdr[24];
+        std::memset(hdr, 0, sizeof(hdr));
+        put32(hdr, PCAP_MAGIC_US);
+        put16(hdr + 4, 2);
+        put16(hdr + 6, 4);
+        put32(hdr + 16, 65535);
+        put32(hdr + 20, PCAP_LINK_ETHERNET);
+        write(hdr, sizeof(hdr));
+    }
+
+    void write_event(const TcpEvent &ev, uint64_t ts_us)
+    {
+        tcp_traffic_pkg pkg;
+        tcp6_traffic_pkg pkg6;
+        if (ev.v6)
+        {
+            pkg6 = ev.pkg6();
+            pkg = tcp_traffic_pkg(0, pkg6.src_port, 0, pkg6.dst_port, pkg6.sz);
+        }
+        else
+        {
+            pkg = ev.pkg;
+        }
+        uint8_t flags = TCP_FLAG_ACK;
+        size_t payload = 0;
+        if (ev.type == EventType::Connect)
+        {
+            flags = TCP_FLAG_SYN;
+        }
+        else if (ev.type == EventType::Disconnect)
+        {
+            flags = ev.abrupt ? TCP_FLAG_RST : static_cast<uint8_t>(TCP_FLAG_FIN | TCP_FLAG_ACK);
+        }
+        else
+        {
+            flags = static_cast<uint8_t>(TCP_FLAG_PSH | TCP_FLAG_ACK);
+            payload = pkg.sz > PCAP_MAX_PAYLOAD ? PCAP_MAX_PAYLOAD : pkg.sz;
+            if (ev.type == EventType::Recv)
+            {
+                std::swap(pkg.src_addr, pkg.dst_addr);
+                std::swap(pkg.src_port, pkg.dst_port);
+                std::swap(pkg6.src_addr, pkg6.dst_addr);
+            }
+        }
+
+        uint8_t frame[74];
+        std::memset(frame, 0, sizeof(frame));
+        frame[0] = 0x02;
+        frame[6] = 0x02;
+        uint8_t *ip = frame + 14;
+        uint8_t *tcp = nullptr;
+        size_t frame_len = 0;
+        if (ev.v6)
+        {
+            frame[12] = 0x86;
+            frame[13] = 0xdd;
+            size_t tcp_len = 20 + payload;
+            ip[0] = 0x60;
+            ip[4] = static_cast<uint8_t>(tcp_len >> 8);
+            ip[5] = static_cast<uint8_t>(tcp_len & 0xff);
+            ip[6] = IPPROTO_TCP;
+            ip[7] = 64;
+            pkg6.src_addr.to_bytes(ip + 8);
+            pkg6.dst_addr.to_bytes(ip + 24);
+            tcp = ip + 40;
+            frame_len = 74;
+        }
+        else
+        {
+            frame[12] = 0x08;
+            size_t ip_len = 40 + payload;
+            ip[0] = 0x45;
+            ip[2] = static_cast<uint8_t>(ip_len >> 8);
+            ip[3] = static_cast<uint8_t>(ip_len & 0xff);
+            ip[8] = 64;
+            ip[9] = IPPROTO_TCP;
+            std::memcpy(ip + 12, &pkg.src_addr, 4);
+            std::memcpy(ip + 16, &pkg.dst_addr, 4);
+            tcp = ip + 20;
+            frame_len = 54;
+        }
+        std::memcpy(tcp, &pkg.src_port, 2);
+        std::memcpy(tcp + 2, &pkg.dst_port, 2);
+        tcp[12] = 0x50;
+        tcp[13] = flags;
+
+        uint8_t rec[16];
+        put32(rec, static_cast<uint32_t>(ts_us / 1000000));
+        put32(rec + 4, static_cast<uint32_t>(ts_us % 1000000));
+        put32(rec + 8, static_cast<uint32_t>(frame_len + payload));
+        put32(rec + 12, static_cast<uint32_t>(frame_len + payload));
+        write(rec, sizeof(rec));
+        write(frame, frame_len);
+        static const uint8_t zeros[PCAP_MAX_PAYLOAD] = {};
+        write(zeros, payload);
+        packets_ += 1;
+    }
+
+    void close()
+    {
+        out_.flush();
+        out_.close();
+        if (out_.fail())
+        {
+            throw std::runtime_error("pcap: write failed");
+        }
+    }
+
+    size_t packets() const
+    {
+        return packets_;
+    }
+
+    size_t bytes() const
+    {
+        return bytes_;
+    }
+
+private:
+    std::ofstream out_;
+    size_t packets_;
+    size_t bytes_;
+
+    static void put16(uint8_t *p, uint16_t v)
+    {
+        std::memcpy(p, &v, 2);
+    }
+
+    static void put32(uint8_t *p, uint32_t v)
+    {
+        std::memcpy(p, &v, 4);
+    }
+
+    void write(const uint8_t *p, size_t n)
+    {
+        out_.write(reinterpret_cast<const char *>(p), static_cast<std::streamsize>(n));
+        if (!out_)
+        {
+            throw std::runtime_error("pcap: write failed");
+        }
+        bytes_ += n;
+    }
+};
+
+#endif
@@ -0,0 +1,379 @@
+#ifndef PREFIX_ROLLUP_H
+#define PREFIX_ROLLUP_H
+
+#include <arpa/inet.h>
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <fstream>
+#include <memory>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+struct CidrPrefix
+{
+    uint32_t addr;
+    uint8_t len;
+    std::string name;
+
+    CidrPrefix() : addr(0), len(0), name() {}
+};
+
+static inline uint32_t prefix_mask(uint8_t len)
+{
+    return len == 0 ? 0 : ~uint32_t(0) << (32 - len);
+}
+
+// "a.b.c.d/len"; the address is kept in host order with host bits cleared.
+static inline CidrPrefix parse_cidr(const std::string &text)
+{
+    size_t slash = text.find('/');
+    if (slash == std::string::npos)
+    {
+        throw std::invalid_argument("prefix: missing /len in " + text);
+    }
+    in_addr a;
+    if (inet_pton(AF_INET, text.substr(0, slash).c_str(), &a) != 1)
+    {
+        throw std::invalid_argument("prefix: bad address in " + text);
+    }
+    std::string len = text.substr(slash + 1);
+    if (len.empty() || len.size() > 2 || len.find_first_not_of("0123456789") != std::string::npos || std::stoi(len) > 32)
+    {
+        throw std::invalid_argument("prefix: bad length in " + text);
+    }
+    CidrPrefix p;
+    p.len = static_cast<uint8_t>(std::stoi(len));
+    p.addr = ntohl(a.s_addr) & prefix_mask(p.len);
+    return p;
+}
+
+// One prefix per line, "CIDR [name]"; blank lines and '#' comments are skipped.
+static inline std::vector<CidrPrefix> load_prefixes(const std::string &path)
+{
+    std::ifstream in(path);
+    if (!in)
+    {
+        throw std::runtime_error("prefix: cannot open " + path);
+    }
+    std::vector<CidrPrefix> out;
+    std::string line;
+    while (std::getline(in, line))
+    {
+        size_t hash = line.find('#');
+        if (hash != std::string::npos)
+        {
+            line.resize(hash);
+        }
+        std::istringstream ls(line);
+        std::string cidr;
+        std::string name;
+        if (!(ls >> cidr))
+        {
+            continue;
+        }
+        CidrPrefix p = parse_cidr(cidr);
+        if (ls >> name)
+        {
+            p.name = name;
+        }
+        out.push_back(p);
+    }
+    return out;
+}
+
+static inline std::string prefix_to_str(uint32_t addr_host, uint8_t len)
+{
+    in_addr a;
+    a.s_addr = htonl(addr_host);
+    char buf[INET_ADDRSTRLEN];
+    if (inet_ntop(AF_INET, &a, buf, sizeof(buf)) == nullptr)
+    {
+        return "0.0.0.0/0";
+    }
+    return std::string(buf) + "/" + std::to_string(len);
+}
+
+// DIR-24-8 longest-prefix-match table: the top 24 bits index a flat table
+// whose entry is either a prefix id or a pointer to a 256-entry block for
+// the last octet, so a lookup is one or two reads. Prefixes are inserted
+// shortest first, which makes longer ones overwrite the shorter ones they
+// nest in. Ids are 1-based; 0 means no match.
+class PrefixTable
+{
+public:
+    static constexpr uint16_t GROUP = 0x8000;
+
+    explicit PrefixTable(std::vector<CidrPrefix> prefixes)
+        : prefixes_(std::move(prefixes)), tbl24_(size_t(1) << 24, 0), tbl8_()
+    {
+        if (prefixes_.size() >= GROUP)
+        {
+            throw std::invalid_argument("prefix: too many prefixes");
+        }
+        std::vector<uint16_t> order;
+        size_t i = 0;
+        while (i < prefixes_.size())
+        {
+            order.push_back(static_cast<uint16_t>(i + 1));
+            i += 1;
+        }
+        std::stable_sort(order.begin(), order.end(), [this](uint16_t x, uint16_t y)
+                         { return prefixes_[x - 1].len < prefixes_[y - 1].len; });
+        for (uint16_t id : order)
+        {
+            insert(prefixes_[id - 1], id);
+        }
+    }
+
+    uint16_t lookup(uint32_t ip_host) const
+    {
+        uint16_t e = tbl24_[ip_host >> 8];
+        if ((e & GROUP) != 0)
+        {
+            return tbl8_[(static_cast<size_t>(e & ~GROUP) << 8) | (ip_host & 0xff)];
+        }
+        return e;
+    }
+
+    size_t size() const
+    {
+        return prefixes_.size();
+    }
+
+    const CidrPrefix &prefix(uint16_t id) const
+    {
+        return prefixes_.at(static_cast<size_t>(id) - 1);
+    }
+
+    size_t groups() const
+    {
+        return tbl8_.size() / 256;
+    }
+
+private:
+    std::vector<CidrPrefix> prefixes_;
+    std::vector<uint16_t> tbl24_;
+    std::vector<uint16_t> tbl8_;
+
+    void insert(const CidrPrefix &p, uint16_t id)
+    {
+        if (p.len <= 24)
+        {
+            size_t first = p.addr >> 8;
+            size_t n = size_t(1) << (24 - p.len);
+            std::fill(tbl24_.begin() + static_cast<std::ptrdiff_t>(first),
+                      tbl24_.begin() + static_cast<std::ptrdiff_t>(first + n), id);
+            return;
+        }
+        uint16_t &e = tbl24_[p.addr >> 8];
+        if ((e & GROUP) == 0)
+        {
+            size_t group = tbl8_.size() / 256;
+            if (group >= GROUP)
+            {
+                throw std::invalid_argument("prefix: too many prefixes longer than /24");
+            }
+            tbl8_.resize(tbl8_.size() + 256, e);
+            e = static_cast<uint16_t>(GROUP | group);
+        }
+        size_t base = static_cast<size_t>(e & ~GROUP) << 8;
+        size_t first = p.addr & 0xff;
+        size_t n = size_t(1) << (32 - p.len);
+        std::fill(tbl8_.begin() + static_cast<std::ptrdiff_t>(base + first),
+                  tbl8_.begin() + static_cast<std::ptrdiff_t>(base + first + n), id);
+    }
+};
+
+struct PrefixCounters
+{
+    uint64_t sent;
+    uint64_t recv;
+    uint64_t connections;
+
+    PrefixCounters() : sent(0), recv(0), connections(0) {}
+
+    void add(const PrefixCounters &o)
+    {
+        sent += o.sent;
+        recv += o.recv;
+        connections += o.connections;
+    }
+
+    uint64_t bytes() const
+    {
+        return sent + recv;
+    }
+};
+
+// Counters per /24 (address >> 8) in an open-addressing table: the key is
+// hashed with one multiply and probed linearly over a flat array, so there
+// is no node allocation per subnet and an empty table is a few hundred
+// bytes. Keys are below 2^24, which leaves EMPTY free as the vacant mark.
+class SubnetCounters
+{
+public:
+    SubnetCounters() : keys_(size_t(1) << INITIAL_BITS, EMPTY), vals_(keys_.size()), used_(0), shift_(64 - INITIAL_BITS) {}
+
+    PrefixCounters &operator[](uint32_t net)
+    {
+        size_t i = slot(net);
+        if (keys_[i] == net)
+        {
+            return vals_[i];
+        }
+        if ((used_ + 1) * 2 > keys_.size())
+        {
+            grow();
+            i = slot(net);
+        }
+        keys_[i] = net;
+        used_ += 1;
+        return vals_[i];
+    }
+
+    const PrefixCounters *find(uint32_t net) const
+    {
+        size_t i = slot(net);
+        return keys_[i] == net ? &vals_[i] : nullptr;
+    }
+
+    template <typename Fn>
+    void for_each(Fn fn) const
+    {
+        size_t i = 0;
+        while (i < keys_.size())
+        {
+            if (keys_[i] != EMPTY)
+            {
+                fn(keys_[i], vals_[i]);
+            }
+            i += 1;
+        }
+    }
+
+    size_t size() const
+    {
+        return used_;
+    }
+
+private:
+    static constexpr uint32_t EMPTY = ~uint32_t(0);
+    static constexpr unsigned INITIAL_BITS = 4;
+
+    std::vector<uint32_t> keys_;
+    std::vector<PrefixCounters> vals_;
+    size_t used_;
+    unsigned shift_;
+
+    // The table size is 2^(64 - shift_), so the top bits of the product pick
+    // the home slot.
+    size_t slot(uint32_t net) const
+    {
+        size_t mask = keys_.size() - 1;
+        size_t i = static_cast<size_t>((net * UINT64_C(0x9E3779B97F4A7C15)) >> shift_);
+        while (keys_[i] != EMPTY && keys_[i] != net)
+        {
+            i = (i + 1) & mask;
+        }
+        return i;
+    }
+
+    void grow()
+    {
+        std::vector<uint32_t> keys(keys_.size() * 2, EMPTY);
+        std::vector<PrefixCounters> vals(keys.size());
+        keys_.swap(keys);
+        vals_.swap(vals);
+        shift_ -= 1;
+        size_t i = 0;
+        while (i < keys.size())
+        {
+            if (keys[i] != EMPTY)
+            {
+                size_t j = slot(keys[i]);
+                keys_[j] = keys[i];
+                vals_[j] = vals[i];
+            }
+            i += 1;
+        }
+    }
+};
+
+// Per-analyzer rollup of IPv4 traffic by /24 and configured prefixes. Only
+// the counters live here: the prefix table is shared read-only between all
+// analyzers, and /16 totals are summed from the /24 ones when the rollups
+// are merged, so an idle analyzer (e.g. one of many steal-mode shards)
+// costs almost nothing. Not synchronized: it is updated under the owning
+// analyzer's lock.
+class PrefixRollup
+{
+public:
+    explicit PrefixRollup(std::shared_ptr<const PrefixTable> table = nullptr)
+        : table_(table), by24_(), customers_(table != nullptr ? table->size() + 1 : 1) {}
+
+    // Addresses in network order, as they come in events.
+    void on_connect(uint32_t a, uint32_t b)
+    {
+        at(ntohl(a), [](PrefixCounters &c)
+           { c.connections += 1; });
+        at(ntohl(b), [](PrefixCounters &c)
+           { c.connections += 1; });
+    }
+
+    void on_transfer(uint32_t from, uint32_t to, size_t sz)
+    {
+        at(ntohl(from), [sz](PrefixCounters &c)
+           { c.sent += sz; });
+        at(ntohl(to), [sz](PrefixCounters &c)
+           { c.recv += sz; });
+    }
+
+    void merge_into(PrefixRollup &out) const
+    {
+        by24_.for_each([&out](uint32_t net, const PrefixCounters &c)
+                       { out.by24_[net].add(c); });
+        size_t i = 0;
+        while (i < customers_.size() && i < out.customers_.size())
+        {
+            out.customers_[i].add(customers_[i]);
+            i += 1;
+        }
+    }
+
+    // Indexed by the top 16 bits of the address; built on demand.
+    std::vector<PrefixCounters> by16() const
+    {
+        std::vector<PrefixCounters> out(size_t(1) << 16);
+        by24_.for_each([&out](uint32_t net, const PrefixCounters &c)
+                       { out[net >> 8].add(c); });
+        return out;
+    }
+
+    const SubnetCounters &by24() const
+    {
+        return by24_;
+    }
+
+    // Indexed by PrefixTable id; slot 0 collects unmatched traffic.
+    const std::vector<PrefixCounters> &customers() const
+    {
+        return customers_;
+    }
+
+private:
+    std::shared_ptr<const PrefixTable> table_;
+    SubnetCounters by24_;
+    std::vector<PrefixCounters> customers_;
+
+    template <typename Fn>
+    void at(uint32_t ip_host, Fn fn)
+    {
+        fn(by24_[ip_host >> 8]);
+        fn(customers_[table_ != nullptr ? table_->lookup(ip_host) : 0]);
+    }
+};
+
+#endif
@@ -0,0 +1,535 @@
+#ifndef SHM_RING_H
+#define SHM_RING_H
+
+#include <fcntl.h>
+#include <linux/futex.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <climits>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <ctime>
+#include <memory>
+#include <mutex>
+#include <new>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <type_traits>
+#include <vector>
+
+#include "event_queue.h"
+
+static const char SHM_MAGIC[8] = {'T', 'C', 'P', 'R', 'I', 'N', 'G', '1'};
+static const uint32_t SHM_VERSION = 1;
+static const uint32_t SHM_RING_FREE = 0;
+static const uint32_t SHM_RING_ATTACHED = 1;
+static const uint32_t SHM_RING_DONE = 2;
+// Futex waits time out this often so that a peer that died without waking
+// us is noticed; it is also the poll period while waiting for the segment.
+static const long SHM_POLL_NS = 10000000;
+static const int SHM_ATTACH_TIMEOUT_MS = 5000;
+
+static_assert(sizeof(std::atomic<uint32_t>) == sizeof(uint32_t) && std::atomic<uint32_t>::is_always_lock_free,
+              "futex words must be plain 32-bit atomics");
+static_assert(std::atomic<uint64_t>::is_always_lock_free, "ring indexes must be address-free atomics");
+
+struct alignas(64) ShmControl
+{
+    char magic[8];
+    uint32_t version;
+    uint32_t slot_size;
+    uint32_t rings;
+    uint32_t capacity;
+    std::atomic<int32_t> server_pid;
+    std::atomic<uint32_t> ready;
+    std::atomic<uint32_t> closed;
+    std::atomic<uint32_t> data_seq;
+    std::atomic<uint32_t> data_waiters;
+};
+
+// One single-producer ring per generator thread. The indexes are free-running
+// and live on separate cache lines; a slot is visible to the consumer once
+// tail has been stored past it, so a producer killed mid-write never exposes
+// a torn event.
+struct ShmRing
+{
+    alignas(64) std::atomic<uint64_t> tail;
+    std::atomic<uint32_t> space_seq;
+    std::atomic<uint32_t> space_waiters;
+    alignas(64) std::atomic<uint64_t> head;
+    alignas(64) std::atomic<uint32_t> state;
+    std::atomic<int32_t> pid;
+};
+
+enum class ShmRole
+{
+    Serve,
+    Connect
+};
+
+static inline void futex_wait(std::atomic<uint32_t> &word, uint32_t expected)
+{
+    timespec ts{0, SHM_POLL_NS};
+    syscall(SYS_futex, reinterpret_cast<uint32_t *>(&word), FUTEX_WAIT, expected, &ts, nullptr, 0);
+}
+
+static inline void futex_wake(std::atomic<uint32_t> &word, int count)
+{
+    syscall(SYS_futex, reinterpret_cast<uint32_t *>(&word), FUTEX_WAKE, count, nullptr, nullptr, 0);
+}
+
+static inline bool process_alive(int32_t pid)
+{
+    if (pid <= 0)
+    {
+        return true;
+    }
+    return kill(pid, 0) == 0 || errno == EPERM;
+}
+
+static inline std::string shm_object_name(const std::string &name)
+{
+    if (name.empty())
+    {
+        throw std::invalid_argument("shm: empty segment name");
+    }
+    return name[0] == '/' ? name : "/" + name;
+}
+
+// EventQueue over a POSIX shared-memory segment, so that generators can run
+// as separate processes. The Serve side creates the segment with one ring per
+// expected generator stream and pops from all of them; each Connect handle
+// claims one ring and pushes into it. Consumers sleep on a single futex that
+// every publish bumps, producers sleep on their ring's futex when it is full.
+// The Serve side finishes once every ring has been claimed and is either
+// closed or owned by a dead process, and has been drained.
+template <typename T>
+class ShmQueue : public EventQueue<T>
+{
+    static_assert(std::is_trivially_copyable<T>::value, "shm slots are copied as raw bytes");
+
+public:
+    ShmQueue(const std::string &name, ShmRole role, size_t capacity = 0, size_t rings = 0)
+        : name_(shm_object_name(name)), role_(role), base_(nullptr), size_(0), ctl_(nullptr), rings_(nullptr),
+          slots_(nullptr), mask_(0), ring_(0), next_(0), locks_(), closed_(false)
+    {
+        if (role_ == ShmRole::Serve)
+        {
+            create(capacity, rings);
+        }
+        else
+        {
+            connect();
+        }
+    }
+
+    ~ShmQueue() override
+    {
+        close();
+        if (base_ != nullptr)
+        {
+            munmap(base_, size_);
+        }
+        if (role_ == ShmRole::Serve)
+        {
+            shm_unlink(name_.c_str());
+        }
+    }
+
+    ShmQueue(const ShmQueue &) = delete;
+    ShmQueue &operator=(const ShmQueue &) = delete;
+
+    bool push(const T &value) override
+    {
+        return push_range(&value, 1);
+    }
+
+    bool push_batch(const std::vector<T> &values) override
+    {
+        return values.empty() || push_range(values.data(), values.size());
+    }
+
+    bool pop(T &out) override
+    {
+        std::vector<T> one;
+        if (!pop_batch(one, 1))
+        {
+            return false;
+        }
+        out = one.front();
+        return true;
+    }
+
+    bool pop_batch(std::vector<T> &out, size_t max) override
+    {
+        if (role_ != ShmRole::Serve)
+        {
+            throw std::logic_error("shm: only the serving side pops");
+        }
+        out.clear();
+        while (true)
+        {
+            if (drain(out, max))
+            {
+                return true;
+            }
+            uint32_t seq = ctl_->data_seq.load();
+            if (drain(out, max))
+            {
+                return true;
+            }
+            if (finished())
+            {
+                return false;
+            }
+            ctl_->data_waiters.fetch_add(1);
+            futex_wait(ctl_->data_seq, seq);
+            ctl_->data_waiters.fetch_sub(1);
+        }
+    }
+
+    // Connect side: marks the ring done. Serve side: stops the transport, so
+    // blocked producers and consumers give up.
+    void close() override
+    {
+        if (base_ == nullptr || closed_.exchange(true))
+        {
+            return;
+        }
+        if (role_ == ShmRole::Connect)
+        {
+            rings_[ring_].state.store(SHM_RING_DONE);
+            ctl_->data_seq.fetch_add(1);
+            futex_wake(ctl_->data_seq, INT_MAX);
+            return;
+        }
+        ctl_->closed.store(1);
+        ctl_->data_seq.fetch_add(1);
+        futex_wake(ctl_->data_seq, INT_MAX);
+        uint32_t r = 0;
+        while (r < ctl_->rings)
+        {
+            rings_[r].space_seq.fetch_add(1);
+            futex_wake(rings_[r].space_seq, INT_MAX);
+            r += 1;
+        }
+    }
+
+    size_t ring_count() const
+    {
+        return ctl_->rings;
+    }
+
+    // Rings whose owner died without closing them.
+    size_t crashed() const
+    {
+        size_t n = 0;
+        uint32_t r = 0;
+        while (r < ctl_->rings)
+        {
+            if (rings_[r].state.load() == SHM_RING_ATTACHED && !process_alive(rings_[r].pid.load()))
+            {
+                n += 1;
+            }
+            r += 1;
+        }
+        return n;
+    }
+
+private:
+    std::string name_;
+    ShmRole role_;
+    void *base_;
+    size_t size_;
+    ShmControl *ctl_;
+    ShmRing *rings_;
+    T *slots_;
+    uint64_t mask_;
+    uint32_t ring_;
+    std::atomic<uint32_t> next_;
+    std::unique_ptr<std::mutex[]> locks_;
+    std::atomic<bool> closed_;
+
+    static size_t segment_size(size_t rings, size_t capacity)
+    {
+        return sizeof(ShmControl) + rings * sizeof(ShmRing) + rings * capacity * sizeof(T);
+    }
+
+    void map(int fd, size_t size)
+    {
+        void *m = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        if (m == MAP_FAILED)
+        {
+            throw std::runtime_error("shm: mmap failed: " + name_);
+        }
+        base_ = m;
+        size_ = size;
+        ctl_ = static_cast<ShmControl *>(m);
+        rings_ = reinterpret_cast<ShmRing *>(static_cast<uint8_t *>(m) + sizeof(ShmControl));
+    }
+
+    void layout()
+    {
+        slots_ = reinterpret_cast<T *>(reinterpret_cast<uint8_t *>(rings_) + ctl_->rings * sizeof(ShmRing));
+        mask_ = ctl_->capacity - 1;
+    }
+
+    void create(size_t capacity, size_t rings)
+    {
+        if (capacity == 0 || rings == 0)
+        {
+            throw std::invalid_argument("shm: capacity and rings must be positive");
+        }
+        size_t cap = 1;
+        while (cap < capacity)
+        {
+            cap <<= 1;
+        }
+        shm_unlink(name_.c_str());
+        int fd = shm_open(name_.c_str(), O_RDWR | O_CREAT | O_EXCL, 0600);
+        if (fd < 0)
+        {
+            throw std::runtime_error("shm: cannot create " + name_ + ": " + std::strerror(errno));
+        }
+        size_t size = segment_size(rings, cap);
+        if (ftruncate(fd, static_cast<off_t>(size)) != 0)
+        {
+            ::close(fd);
+            shm_unlink(name_.c_str());
+            throw std::runtime_error("shm: cannot size " + name_);
+        }
+        try
+        {
+            map(fd, size);
+        }
+        catch (...)
+        {
+            ::close(fd);
+            shm_unlink(name_.c_str());
+            throw;
+        }
+        ::close(fd);
+        new (ctl_) ShmControl();
+        std::memcpy(ctl_->magic, SHM_MAGIC, sizeof(SHM_MAGIC));
+        ctl_->version = SHM_VERSION;
+        ctl_->slot_size = sizeof(T);
+        ctl_->rings = static_cast<uint32_t>(rings);
+        ctl_->capacity = static_cast<uint32_t>(cap);
+        ctl_->server_pid.store(static_cast<int32_t>(getpid()));
+        size_t r = 0;
+        while (r < rings)
+        {
+            new (&rings_[r]) ShmRing();
+            r += 1;
+        }
+        layout();
+        locks_ = std::make_unique<std::mutex[]>(rings);
+        ctl_->ready.store(1);
+    }
+
+    // Waits for a live server to publish the segment, then claims a free ring.
+    void connect()
+    {
+        auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(SHM_ATTACH_TIMEOUT_MS);
+        while (!try_open())
+        {
+            if (std::chrono::steady_clock::now() >= deadline)
+            {
+                throw std::runtime_error("shm: no server on " + name_);
+            }
+            std::this_thread::sleep_for(std::chrono::nanoseconds(SHM_POLL_NS));
+        }
+        uint32_t r = 0;
+        while (r < ctl_->rings)
+        {
+            uint32_t expected = SHM_RING_FREE;
+            if (rings_[r].state.compare_exchange_strong(expected, SHM_RING_ATTACHED))
+            {
+                rings_[r].pid.store(static_cast<int32_t>(getpid()));
+                ring_ = r;
+                return;
+            }
+            r += 1;
+        }
+        munmap(base_, size_);
+        base_ = nullptr;
+        throw std::runtime_error("shm: no free ring in " + name_);
+    }
+
+    bool try_open()
+    {
+        int fd = shm_open(name_.c_str(), O_RDWR, 0);
+        if (fd < 0)
+        {
+            return false;
+        }
+        struct stat st;
+        if (fstat(fd, &st) != 0 || static_cast<size_t>(st.st_size) < sizeof(ShmControl))
+        {
+            ::close(fd);
+            return false;
+        }
+        size_t size = static_cast<size_t>(st.st_size);
+        try
+        {
+            map(fd, size);
+        }
+        catch (...)
+        {
+            ::close(fd);
+            throw;
+        }
+        ::close(fd);
+        bool ok = ctl_->ready.load() == 1 && process_alive(ctl_->server_pid.load()) &&
+                  ctl_->closed.load() == 0;
+        if (ok && (std::memcmp(ctl_->magic, SHM_MAGIC, sizeof(SHM_MAGIC)) != 0 || ctl_->version != SHM_VERSION ||
+                   ctl_->slot_size != sizeof(T) || size < segment_size(ctl_->rings, ctl_->capacity)))
+        {
+            munmap(base_, size_);
+            base_ = nullptr;
+            throw std::runtime_error("shm: incompatible segment " + name_);
+        }
+        if (!ok)
+        {
+            munmap(base_, size_);
+            base_ = nullptr;
+            return false;
+        }
+        layout();
+        return true;
+    }
+
+    bool push_range(const T *values, size_t n)
+    {
+        if (role_ != ShmRole::Connect)
+        {
+            throw std::logic_error("shm: only a connected generator pushes");
+        }
+        ShmRing &ring = rings_[ring_];
+        T *slots = slots_ + static_cast<size_t>(ring_) * ctl_->capacity;
+        uint64_t cap = ctl_->capacity;
+        uint64_t tail = ring.tail.load(std::memory_order_relaxed);
+        size_t i = 0;
+        while (i < n)
+        {
+            uint64_t room = cap - (tail - ring.head.load(std::memory_order_acquire));
+            if (room == 0)
+            {
+                if (!await_space(ring, tail))
+                {
+                    return false;
+                }
+                continue;
+            }
+            while (room > 0 && i < n)
+            {
+                slots[tail & mask_] = values[i];
+                tail += 1;
+                room -= 1;
+                i += 1;
+            }
+            ring.tail.store(tail, std::memory_order_release);
+            ctl_->data_seq.fetch_add(1);
+            if (ctl_->data_waiters.load() > 0)
+            {
+                futex_wake(ctl_->data_seq, n > 1 ? INT_MAX : 1);
+            }
+        }
+        return true;
+    }
+
+    bool await_space(ShmRing &ring, uint64_t tail)
+    {
+        if (ctl_->closed.load() != 0 || !process_alive(ctl_->server_pid.load()))
+        {
+            return false;
+        }
+        uint32_t seq = ring.space_seq.load();
+        if (tail - ring.head.load(std::memory_order_acquire) < ctl_->capacity)
+        {
+            return true;
+        }
+        ring.space_waiters.fetch_add(1);
+        futex_wait(ring.space_seq, seq);
+        ring.space_waiters.fetch_sub(1);
+        return true;
+    }
+
+    // Takes whatever one ring holds, starting from a rotating position so
+    // that concurrent consumers spread over the rings.
+    bool drain(std::vector<T> &out, size_t max)
+    {
+        uint32_t n = ctl_->rings;
+        uint32_t start = next_.fetch_add(1, std::memory_order_relaxed);
+        uint32_t k = 0;
+        while (k < n)
+        {
+            uint32_t r = (start + k) % n;
+            ShmRing &ring = rings_[r];
+            k += 1;
+            if (ring.tail.load(std::memory_order_acquire) == ring.head.load(std::memory_order_relaxed))
+            {
+                continue;
+            }
+            std::unique_lock<std::mutex> lk(locks_[r], std::try_to_lock);
+            if (!lk.owns_lock())
+            {
+                continue;
+            }
+            uint64_t head = ring.head.load(std::memory_order_relaxed);
+            uint64_t tail = ring.tail.load(std::memory_order_acquire);
+            const T *slots = slots_ + static_cast<size_t>(r) * ctl_->capacity;
+            while (head != tail && out.size() < max)
+            {
+                out.push_back(slots[head & mask_]);
+                head += 1;
+            }
+            ring.head.store(head, std::memory_order_release);
+            lk.unlock();
+            ring.space_seq.fetch_add(1);
+            if (ring.space_waiters.load() > 0)
+            {
+                futex_wake(ring.space_seq, 1);
+            }
+            if (!out.empty())
+            {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    bool finished() const
+    {
+        if (closed_.load())
+        {
+            return true;
+        }
+        uint32_t r = 0;
+        while (r < ctl_->rings)
+        {
+            const ShmRing &ring = rings_[r];
+            uint32_t st = ring.state.load();
+            if (st == SHM_RING_FREE || ring.tail.load() != ring.head.load())
+            {
+                return false;
+            }
+            if (st == SHM_RING_ATTACHED && process_alive(ring.pid.load()))
+            {
+                return false;
+            }
+            r += 1;
+        }
+        return true;
+    }
+};
+
+#endif
@@ -0,0 +1,469 @@
+#ifndef SKETCH_H
+#define SKETCH_H
+
+#include <algorithm>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <stdexcept>
+#include <vector>
+
+#include "traffic.h"
+
+static inline uint64_t sketch_mix(uint64_t x)
+{
+    x += 0x9e3779b97f4a7c15ULL;
+    x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    x = (x ^ (x >> 27)) * 0x94d049bb133111ebULL;
+    return x ^ (x >> 31);
+}
+
+class CountMin
+{
+public:
+    CountMin(size_t width_log2, size_t depth) : width_(static_cast<size_t>(1) << width_log2), depth_(depth), cells_(width_ * depth, 0)
+    {
+        if (depth_ == 0 || width_log2 == 0 || width_log2 > 24)
+        {
+            throw std::invalid_argument("bad count-min dimensions");
+        }
+    }
+
+    void add(uint64_t key, uint64_t v)
+    {
+        uint64_t h = sketch_mix(key);
+        uint32_t h1 = static_cast<uint32_t>(h);
+        uint32_t h2 = static_cast<uint32_t>(h >> 32) | 1;
+        size_t r = 0;
+        while (r < depth_)
+        {
+            cells_[r * width_ + ((h1 + r * h2) & (width_ - 1))] += v;
+            r += 1;
+        }
+    }
+
+    uint64_t estimate(uint64_t key) const
+    {
+        uint64_t h = sketch_mix(key);
+        uint32_t h1 = static_cast<uint32_t>(h);
+        uint32_t h2 = static_cast<uint32_t>(h >> 32) | 1;
+        uint64_t best = UINT64_MAX;
+        size_t r = 0;
+        while (r < depth_)
+        {
+            best = std::min(best, cells_[r * width_ + ((h1 + r * h2) & (width_ - 1))]);
+            r += 1;
+        }
+        return best;
+    }
+
+    void merge(const CountMin &o)
+    {
+        if (o.width_ != width_ || o.depth_ != depth_)
+        {
+            throw std::invalid_argument("count-min dimensions differ");
+        }
+        size_t i = 0;
+        while (i < cells_.size())
+        {
+            cells_[i] += o.cells_[i];
+            i += 1;
+        }
+    }
+
+private:
+    size_t width_;
+    size_t depth_;
+    std::vector<uint64_t> cells_;
+};
+
+class HyperLogLog
+{
+public:
+    explicit HyperLogLog(uint8_t precision) : p_(precision), regs_(static_cast<size_t>(1) << precision, 0)
+    {
+        if (p_ < 4 || p_ > 16)
+        {
+            throw std::invalid_argument("hyperloglog precision must be 4..16");
+        }
+    }
+
+    void add(uint64_t key)
+    {
+        uint64_t h = sketch_mix(key ^ 0x5bd1e9955bd1e995ULL);
+        size_t idx = static_cast<size_t>(h >> (64 - p_));
+        uint64_t rest = (h << p_) | (static_cast<uint64_t>(1) << (p_ - 1));
+        uint8_t rank = static_cast<uint8_t>(__builtin_clzll(rest) + 1);
+        if (rank > regs_[idx])
+        {
+            regs_[idx] = rank;
+        }
+    }
+
+    double estimate() const
+    {
+        double m = static_cast<double>(regs_.size());
+        double sum = 0.0;
+        size_t zeros = 0;
+        for (uint8_t r : regs_)
+        {
+            sum += std::ldexp(1.0, -static_cast<int>(r));
+            if (r == 0)
+            {
+                zeros += 1;
+            }
+        }
+        double alpha = 0.7213 / (1.0 + 1.079 / m);
+        double e = alpha * m * m / sum;
+        if (e <= 2.5 * m && zeros > 0)
+        {
+            e = m * std::log(m / static_cast<double>(zeros));
+        }
+        return e;
+    }
+
+    void merge(const HyperLogLog &o)
+    {
+        if (o.p_ != p_)
+        {
+            throw std::invalid_argument("hyperloglog precision differs");
+        }
+        size_t i = 0;
+        while (i < regs_.size())
+        {
+            regs_[i] = std::max(regs_[i], o.regs_[i]);
+            i += 1;
+        }
+    }
+
+    void clear()
+    {
+        std::fill(regs_.begin(), regs_.end(), 0);
+    }
+
+private:
+    uint8_t p_;
+    std::vector<uint8_t> regs_;
+};
+
+// Keyed by the address type like the exact tables; the count-min and
+// hyperloglog parts only ever see addr_bits() of an address.
+template <typename A>
+struct BasicTalker
+{
+    A ip;
+    uint64_t bytes;
+    uint64_t error;
+    HyperLogLog peers;
+    HyperLogLog ports;
+
+    BasicTalker() : ip(), bytes(0), error(0), peers(TALKER_HLL_P), ports(TALKER_HLL_P) {}
+
+    static constexpr uint8_t TALKER_HLL_P = 8;
+};
+
+using Talker = BasicTalker<uint32_t>;
+
+template <typename A>
+class BasicSpaceSaving
+{
+public:
+    using Talker = BasicTalker<A>;
+
+    explicit BasicSpaceSaving(size_t k) : k_(k), heap_(), slots_(), mask_(0)
+    {
+        if (k_ == 0)
+        {
+            throw std::invalid_argument("space-saving capacity must be positive");
+        }
+        size_t cap = 16;
+        while (cap < k_ * 4)
+        {
+            cap *= 2;
+        }
+        slots_.assign(cap, EMPTY);
+        mask_ = cap - 1;
+        heap_.reserve(k_);
+    }
+
+    void add(const A &ip, uint64_t bytes, const A &peer, uint16_t port)
+    {
+        size_t pos = locate(ip);
+        if (pos == EMPTY)
+        {
+            if (heap_.size() < k_)
+            {
+                heap_.emplace_back();
+                pos = heap_.size() - 1;
+                heap_[pos].ip = ip;
+                set_slot(ip, pos);
+                pos = sift_up(pos);
+            }
+            else
+            {
+                pos = 0;
+                Talker &victim = heap_[0];
+                unset_slot(victim.ip);
+                victim.error = victim.bytes;
+                victim.ip = ip;
+                victim.peers.clear();
+                victim.ports.clear();
+                set_slot(ip, 0);
+            }
+        }
+        Talker &t = heap_[pos];
+        t.bytes += bytes;
+        t.peers.add(addr_bits(peer));
+        t.ports.add(port);
+        sift_down(pos);
+    }
+
+    void merge(const BasicSpaceSaving &o)
+    {
+        uint64_t my_min = heap_.size() < k_ || heap_.empty() ? 0 : heap_[0].bytes;
+        uint64_t other_min = o.heap_.size() < o.k_ || o.heap_.empty() ? 0 : o.heap_[0].bytes;
+        std::vector<Talker> all = heap_;
+        for (Talker &t : all)
+        {
+            size_t at = o.locate(t.ip);
+            if (at != EMPTY)
+            {
+                t.bytes += o.heap_[at].bytes;
+                t.error += o.heap_[at].error;
+                t.peers.merge(o.heap_[at].peers);
+                t.ports.merge(o.heap_[at].ports);
+            }
+            else
+            {
+                t.bytes += other_min;
+                t.error += other_min;
+            }
+        }
+        for (const Talker &t : o.heap_)
+        {
+            if (locate(t.ip) == EMPTY)
+            {
+                Talker c = t;
+                c.bytes += my_min;
+                c.error += my_min;
+                all.push_back(c);
+            }
+        }
+        std::sort(all.begin(), all.end(), [](const Talker &a, const Talker &b)
+                  { return a.bytes > b.bytes; });
+        if (all.size() > k_)
+        {
+            all.resize(k_);
+        }
+        std::reverse(all.begin(), all.end());
+        heap_.swap(all);
+        std::fill(slots_.begin(), slots_.end(), EMPTY);
+        size_t i = 0;
+        while (i < heap_.size())
+        {
+            set_slot(heap_[i].ip, i);
+            i += 1;
+        }
+    }
+
+    std::vector<Talker> top(size_t n) const
+    {
+        std::vector<Talker> out = heap_;
+        std::sort(out.begin(), out.end(), [](const Talker &a, const Talker &b)
+                  { return a.bytes > b.bytes; });
+        if (out.size() > n)
+        {
+            out.resize(n);
+        }
+        return out;
+    }
+
+private:
+    static constexpr size_t EMPTY = SIZE_MAX;
+
+    size_t k_;
+    std::vector<Talker> heap_;
+    std::vector<size_t> slots_;
+    size_t mask_;
+
+    size_t home(const A &ip) const
+    {
+        return static_cast<size_t>(sketch_mix(addr_bits(ip))) & mask_;
+    }
+
+    size_t locate(const A &ip) const
+    {
+        size_t i = home(ip);
+        while (slots_[i] != EMPTY)
+        {
+            if (heap_[slots_[i]].ip == ip)
+            {
+                return slots_[i];
+            }
+            i = (i + 1) & mask_;
+        }
+        return EMPTY;
+    }
+
+    size_t slot_of(const A &ip) const
+    {
+        size_t i = home(ip);
+        while (slots_[i] != EMPTY && heap_[slots_[i]].ip != ip)
+        {
+            i = (i + 1) & mask_;
+        }
+        return i;
+    }
+
+    void set_slot(const A &ip, size_t pos)
+    {
+        slots_[slot_of(ip)] = pos;
+    }
+
+    void unset_slot(const A &ip)
+    {
+        size_t i = slot_of(ip);
+        size_t j = i;
+        while (true)
+        {
+            j = (j + 1) & mask_;
+            if (slots_[j] == EMPTY)
+            {
+                break;
+            }
+            size_t h = home(heap_[slots_[j]].ip);
+            bool movable = (j > i) ? (h <= i || h > j) : (h <= i && h > j);
+            if (movable)
+            {
+                slots_[i] = slots_[j];
+                i = j;
+            }
+        }
+        slots_[i] = EMPTY;
+    }
+
+    void swap_entries(size_t a, size_t b)
+    {
+        size_t sa = slot_of(heap_[a].ip);
+        size_t sb = slot_of(heap_[b].ip);
+        std::swap(heap_[a], heap_[b]);
+        slots_[sa] = b;
+        slots_[sb] = a;
+    }
+
+    size_t sift_up(size_t i)
+    {
+        while (i > 0)
+        {
+            size_t parent = (i - 1) / 2;
+            if (heap_[parent].bytes <= heap_[i].bytes)
+            {
+                break;
+            }
+            swap_entries(i, parent);
+            i = parent;
+        }
+        return i;
+    }
+
+    void sift_down(size_t i)
+    {
+        while (true)
+        {
+            size_t l = 2 * i + 1;
+            size_t r = l + 1;
+            size_t m = i;
+            if (l < heap_.size() && heap_[l].bytes < heap_[m].bytes)
+            {
+                m = l;
+            }
+            if (r < heap_.size() && heap_[r].bytes < heap_[m].bytes)
+            {
+                m = r;
+            }
+            if (m == i)
+            {
+                return;
+            }
+            swap_entries(i, m);
+            i = m;
+        }
+    }
+};
+
+template <typename A>
+class BasicTrafficSketch
+{
+public:
+    using Talker = BasicTalker<A>;
+
+    static constexpr size_t CM_WIDTH_LOG2 = 14;
+    static constexpr size_t CM_DEPTH = 4;
+    static constexpr size_t TOP_K = 128;
+    static constexpr uint8_t GLOBAL_HLL_P = 12;
+
+    BasicTrafficSketch()
+        : sent_(CM_WIDTH_LOG2, CM_DEPTH), recv_(CM_WIDTH_LOG2, CM_DEPTH), talkers_(TOP_K), ips_(GLOBAL_HLL_P), ports_(GLOBAL_HLL_P) {}
+
+    void on_transfer(const A &sender, const A &receiver, uint16_t port, uint64_t bytes)
+    {
+        sent_.add(addr_bits(sender), bytes);
+        recv_.add(addr_bits(receiver), bytes);
+        talkers_.add(sender, bytes, receiver, port);
+        ips_.add(addr_bits(sender));
+        ips_.add(addr_bits(receiver));
+        ports_.add(port);
+    }
+
+    void on_connect(const A &a, const A &b)
+    {
+        ips_.add(addr_bits(a));
+        ips_.add(addr_bits(b));
+    }
+
+    void merge(const BasicTrafficSketch &o)
+    {
+        sent_.merge(o.sent_);
+        recv_.merge(o.recv_);
+        talkers_.merge(o.talkers_);
+        ips_.merge(o.ips_);
+        ports_.merge(o.ports_);
+    }
+
+    uint64_t sent_estimate(const A &ip) const
+    {
+        return sent_.estimate(addr_bits(ip));
+    }
+
+    uint64_t recv_estimate(const A &ip) const
+    {
+        return recv_.estimate(addr_bits(ip));
+    }
+
+    std::vector<Talker> top(size_t n) const
+    {
+        return talkers_.top(n);
+    }
+
+    double distinct_ips() const
+    {
+        return ips_.estimate();
+    }
+
+    double distinct_ports() const
+    {
+        return ports_.estimate();
+    }
+
+private:
+    CountMin sent_;
+    CountMin recv_;
+    BasicSpaceSaving<A> talkers_;
+    HyperLogLog ips_;
+    HyperLogLog ports_;
+};
+
+using TrafficSketch = BasicTrafficSketch<uint32_t>;
+using Traffic6Sketch = BasicTrafficSketch<Ip6Addr>;
+
+#endif
@@ -0,0 +1,91 @@
+#ifndef STATS_H
+#define STATS_H
+
+#include <cstddef>
+#include <cstdint>
+#include <map>
+
+#include "traffic.h"
+#include "window_stats.h"
+
+struct PortStats
+{
+    std::map<uint16_t, size_t> bytes_out;
+    std::map<uint16_t, size_t> bytes_in;
+};
+
+struct PeerStats
+{
+    size_t bytes_out;
+    size_t bytes_in;
+    PortStats ports;
+
+    PeerStats() : bytes_out(0), bytes_in(0), ports() {}
+};
+
+template <typename K>
+struct BasicIpStats
+{
+    size_t total_sent;
+    size_t total_recv;
+    size_t connections;
+    size_t closed;
+    size_t aborted;
+    size_t expired;
+    uint64_t flow_us;
+    std::map<K, PeerStats> peers;
+    IpWindows recent;
+    uint64_t version;
+
+    BasicIpStats() : total_sent(0), total_recv(0), connections(0), closed(0), aborted(0), expired(0), flow_us(0), peers(), recent(), version(0) {}
+
+    size_t active() const
+    {
+        size_t ended = closed + aborted + expired;
+        return connections > ended ? connections - ended : 0;
+    }
+};
+
+using IpStats = BasicIpStats<uint32_t>;
+using Ip6Stats = BasicIpStats<Ip6Addr>;
+
+// An analyzer's record for one IP: the counters and the ring of per-second
+// buckets behind their windowed totals, so an event finds both with one
+// lookup. Only the counters leave the analyzer.
+template <typename K>
+struct BasicIpEntry
+{
+    BasicIpStats<K> stats;
+    RateWindow window;
+
+    BasicIpEntry() : stats(), window() {}
+};
+
+// Adds src's counters to dst; windows and version are left alone.
+template <typename K>
+inline void merge_ip_stats(BasicIpStats<K> &dst, const BasicIpStats<K> &src)
+{
+    dst.total_sent += src.total_sent;
+    dst.total_recv += src.total_recv;
+    dst.connections += src.connections;
+    dst.closed += src.closed;
+    dst.aborted += src.aborted;
+    dst.expired += src.expired;
+    dst.flow_us += src.flow_us;
+    for (const auto &peer : src.peers)
+    {
+        PeerStats &p = dst.peers[peer.first];
+        p.bytes_out += peer.second.bytes_out;
+        p.bytes_in += peer.second.bytes_in;
+        for (const auto &pp : peer.second.ports.bytes_out)
+        {
+            p.ports.bytes_out[pp.first] += pp.second;
+        }
+        for (const auto &pp : peer.second.ports.bytes_in)
+        {
+            p.ports.bytes_in[pp.first] += pp.second;
+        }
+    }
+}
+
+#endif
@@ -0,0 +1,338 @@
+#ifndef STEAL_EXECUTOR_H
+#define STEAL_EXECUTOR_H
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include "topology.h"
+
+struct StealStats
+{
+    uint64_t executed;
+    uint64_t stolen;
+    uint64_t handoffs;
+
+    StealStats() : executed(0), stolen(0), handoffs(0) {}
+};
+
+// Runs batches of T on a fixed set of workers. Every batch belongs to a shard
+// and is queued on the shard's home worker; idle workers steal whole batches
+// from the front of other workers' deques. A shard is processed by at most one
+// worker at a time: a batch is popped and its shard claimed under the deque
+// lock, and a batch for a busy shard goes to the shard's mailbox instead, which
+// the busy worker drains before letting go. Since one shard's batches sit in
+// one deque, they run in the order they were submitted. A batch counts against
+// max_pending from submit() until its handler returns, so batches parked in a
+// hot shard's mailbox still hold producers back.
+template <typename T>
+class StealingExecutor
+{
+public:
+    using Batch = std::vector<T>;
+    using Handler = std::function<void(size_t shard, const Batch &batch)>;
+
+    StealingExecutor(size_t workers, size_t shards, size_t max_pending, Handler fn)
+        : workers_(), shards_(), fn_(std::move(fn)), max_pending_(max_pending), pending_(0), queued_(0), mailed_(0),
+          backlog_peak_(0), closed_(false),
+          idle_m_(), idle_cv_(), space_cv_(), sleepers_(0), threads_()
+    {
+        if (workers == 0 || shards == 0 || max_pending == 0)
+        {
+            throw std::invalid_argument("executor: workers, shards and max_pending must be positive");
+        }
+        size_t i = 0;
+        while (i < workers)
+        {
+            workers_.push_back(std::make_unique<Worker>());
+            i += 1;
+        }
+        i = 0;
+        while (i < shards)
+        {
+            shards_.push_back(std::make_unique<Shard>());
+            i += 1;
+        }
+    }
+
+    ~StealingExecutor()
+    {
+        close();
+        join();
+    }
+
+    StealingExecutor(const StealingExecutor &) = delete;
+    StealingExecutor &operator=(const StealingExecutor &) = delete;
+
+    void start(const std::vector<int> &cpus)
+    {
+        size_t i = 0;
+        while (i < workers_.size())
+        {
+            int cpu = i < cpus.size() ? cpus[i] : -1;
+            threads_.emplace_back([this, i, cpu]()
+                                  {
+                if (!pin_current_thread(cpu)) {
+                    note_pin_failure(cpu);
+                }
+                run(i); });
+            i += 1;
+        }
+    }
+
+    size_t shard_count() const
+    {
+        return shards_.size();
+    }
+
+    size_t home_of(size_t shard) const
+    {
+        return shard % workers_.size();
+    }
+
+    // Blocks while max_pending batches are queued or running. Returns false
+    // after close().
+    bool submit(size_t shard, Batch &&batch)
+    {
+        {
+            std::unique_lock<std::mutex> lk(idle_m_);
+            space_cv_.wait(lk, [this]()
+                           { return closed_ || pending_.load(std::memory_order_relaxed) < max_pending_; });
+            if (closed_)
+            {
+                return false;
+            }
+            pending_.fetch_add(1, std::memory_order_relaxed);
+        }
+        Worker &w = *workers_[home_of(shard)];
+        {
+            std::lock_guard<std::mutex> lk(w.m);
+            w.q.emplace_back(shard, std::move(batch));
+            size_t queued = queued_.fetch_add(1, std::memory_order_relaxed) + 1;
+            note_backlog(queued + mailed_.load(std::memory_order_relaxed));
+        }
+        std::lock_guard<std::mutex> lk(idle_m_);
+        if (sleepers_ > 0)
+        {
+            idle_cv_.notify_one();
+        }
+        return true;
+    }
+
+    // Workers finish everything already submitted before exiting.
+    void close()
+    {
+        std::lock_guard<std::mutex> lk(idle_m_);
+        closed_ = true;
+        idle_cv_.notify_all();
+        space_cv_.notify_all();
+    }
+
+    void join()
+    {
+        for (auto &t : threads_)
+        {
+            if (t.joinable())
+            {
+                t.join();
+            }
+        }
+    }
+
+    std::vector<StealStats> stats() const
+    {
+        std::vector<StealStats> out;
+        for (const auto &w : workers_)
+        {
+            StealStats s;
+            s.executed = w->executed.load(std::memory_order_relaxed);
+            s.stolen = w->stolen.load(std::memory_order_relaxed);
+            s.handoffs = w->handoffs.load(std::memory_order_relaxed);
+            out.push_back(s);
+        }
+        return out;
+    }
+
+    size_t max_pending() const
+    {
+        return max_pending_;
+    }
+
+    // Most batches ever held at once in the deques and mailboxes together.
+    size_t backlog_peak() const
+    {
+        return backlog_peak_.load(std::memory_order_relaxed);
+    }
+
+private:
+    struct Task
+    {
+        size_t shard;
+        Batch batch;
+
+        Task() : shard(0), batch() {}
+        Task(size_t s, Batch &&b) : shard(s), batch(std::move(b)) {}
+    };
+
+    struct alignas(64) Worker
+    {
+        std::mutex m;
+        std::deque<Task> q;
+        std::atomic<uint64_t> executed;
+        std::atomic<uint64_t> stolen;
+        std::atomic<uint64_t> handoffs;
+
+        Worker() : m(), q(), executed(0), stolen(0), handoffs(0) {}
+    };
+
+    struct alignas(64) Shard
+    {
+        std::mutex m;
+        bool busy;
+        std::deque<Batch> mailbox;
+
+        Shard() : m(), busy(false), mailbox() {}
+    };
+
+    std::vector<std::unique_ptr<Worker>> workers_;
+    std::vector<std::unique_ptr<Shard>> shards_;
+    Handler fn_;
+    size_t max_pending_;
+    std::atomic<size_t> pending_;
+    std::atomic<size_t> queued_; // batches in the deques, changed under their locks
+    std::atomic<size_t> mailed_; // batches in the mailboxes, changed under their locks
+    std::atomic<size_t> backlog_peak_;
+    bool closed_;
+    std::mutex idle_m_;
+    std::condition_variable idle_cv_;
+    std::condition_variable space_cv_;
+    size_t sleepers_;
+    std::vector<std::thread> threads_;
+
+    // Pops batches until one whose shard it could claim; batches for busy
+    // shards are handed to their mailbox on the way. Popping and claiming
+    // under the deque lock keeps a later batch of a shard from overtaking an
+    // earlier one. Returns the number of batches popped.
+    size_t take(size_t self, Task &out, bool &claimed)
+    {
+        size_t n = workers_.size();
+        size_t popped = 0;
+        claimed = false;
+        size_t k = 0;
+        while (k < n && !claimed)
+        {
+            Worker &w = *workers_[(self + k) % n];
+            std::lock_guard<std::mutex> lk(w.m);
+            while (!w.q.empty() && !claimed)
+            {
+                // Uncounted before it is mailed, so no batch is ever in both
+                // queued_ and mailed_ and the backlog is never overstated.
+                queued_.fetch_sub(1, std::memory_order_relaxed);
+                Task &t = w.q.front();
+                Shard &s = *shards_[t.shard];
+                {
+                    std::lock_guard<std::mutex> sl(s.m);
+                    if (s.busy)
+                    {
+                        s.mailbox.push_back(std::move(t.batch));
+                        size_t mailed = mailed_.fetch_add(1, std::memory_order_relaxed) + 1;
+                        note_backlog(queued_.load(std::memory_order_relaxed) + mailed);
+                        workers_[self]->handoffs.fetch_add(1, std::memory_order_relaxed);
+                    }
+                    else
+                    {
+                        s.busy = true;
+                        out = std::move(t);
+                        claimed = true;
+                        if (k > 0)
+                        {
+                            workers_[self]->stolen.fetch_add(1, std::memory_order_relaxed);
+                        }
+                    }
+                }
+                w.q.pop_front();
+                popped += 1;
+            }
+            k += 1;
+        }
+        return popped;
+    }
+
+    void note_backlog(size_t held)
+    {
+        size_t peak = backlog_peak_.load(std::memory_order_relaxed);
+        while (held > peak && !backlog_peak_.compare_exchange_weak(peak, held, std::memory_order_relaxed))
+        {
+        }
+    }
+
+    // Called once per batch after its handler has run.
+    void finished()
+    {
+        pending_.fetch_sub(1, std::memory_order_relaxed);
+        std::lock_guard<std::mutex> lk(idle_m_);
+        space_cv_.notify_all();
+    }
+
+    // The shard is already claimed by take().
+    void execute(size_t self, Task &t)
+    {
+        Shard &s = *shards_[t.shard];
+        Batch cur = std::move(t.batch);
+        while (true)
+        {
+            fn_(t.shard, cur);
+            workers_[self]->executed.fetch_add(1, std::memory_order_relaxed);
+            finished();
+            std::lock_guard<std::mutex> lk(s.m);
+            if (s.mailbox.empty())
+            {
+                s.busy = false;
+                return;
+            }
+            cur = std::move(s.mailbox.front());
+            s.mailbox.pop_front();
+            mailed_.fetch_sub(1, std::memory_order_relaxed);
+        }
+    }
+
+    void run(size_t self)
+    {
+        Task t;
+        while (true)
+        {
+            bool claimed = false;
+            size_t popped = take(self, t, claimed);
+            if (claimed)
+            {
+                execute(self, t);
+                continue;
+            }
+            if (popped > 0)
+            {
+                continue;
+            }
+            std::unique_lock<std::mutex> lk(idle_m_);
+            sleepers_ += 1;
+            idle_cv_.wait(lk, [this]()
+                          { return closed_ || queued_.load(std::memory_order_relaxed) > 0; });
+            sleepers_ -= 1;
+            if (closed_ && queued_.load(std::memory_order_relaxed) == 0)
+            {
+                return;
+            }
+        }
+    }
+};
+
+#endif
@@ -0,0 +1,142 @@
+#ifndef TOPK_H
+#define TOPK_H
+
+#include <cstddef>
+#include <cstdint>
+#include <stdexcept>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+static const size_t TOPK_CAPACITY = 64;
+
+enum class TopMetric
+{
+    BytesSent,
+    BytesRecv,
+    Connections
+};
+
+struct TopEntry
+{
+    uint32_t ip;
+    uint64_t value;
+
+    TopEntry() : ip(0), value(0) {}
+    TopEntry(uint32_t a, uint64_t v) : ip(a), value(v) {}
+};
+
+struct TopKResult
+{
+    std::vector<TopEntry> entries;
+    bool exact;
+
+    TopKResult() : entries(), exact(true) {}
+};
+
+class TopKIndex
+{
+public:
+    explicit TopKIndex(size_t k) : k_(k), heap_(), pos_()
+    {
+        if (k_ == 0)
+        {
+            throw std::invalid_argument("top-k capacity must be positive");
+        }
+        heap_.reserve(k_);
+        pos_.reserve(k_ * 2);
+    }
+
+    void update(uint32_t ip, uint64_t value)
+    {
+        auto it = pos_.find(ip);
+        if (it != pos_.end())
+        {
+            heap_[it->second].value = value;
+            sift_down(it->second);
+            return;
+        }
+        if (heap_.size() < k_)
+        {
+            heap_.emplace_back(ip, value);
+            pos_[ip] = heap_.size() - 1;
+            sift_up(heap_.size() - 1);
+            return;
+        }
+        if (value <= heap_[0].value)
+        {
+            return;
+        }
+        pos_.erase(heap_[0].ip);
+        heap_[0] = TopEntry(ip, value);
+        pos_[ip] = 0;
+        sift_down(0);
+    }
+
+    const std::vector<TopEntry> &entries() const
+    {
+        return heap_;
+    }
+
+    uint64_t floor() const
+    {
+        return heap_.size() < k_ ? 0 : heap_[0].value;
+    }
+
+    size_t capacity() const
+    {
+        return k_;
+    }
+
+private:
+    size_t k_;
+    std::vector<TopEntry> heap_;
+    std::unordered_map<uint32_t, size_t> pos_;
+
+    void swap_entries(size_t a, size_t b)
+    {
+        std::swap(heap_[a], heap_[b]);
+        pos_[heap_[a].ip] = a;
+        pos_[heap_[b].ip] = b;
+    }
+
+    void sift_up(size_t i)
+    {
+        while (i > 0)
+        {
+            size_t parent = (i - 1) / 2;
+            if (heap_[parent].value <= heap_[i].value)
+            {
+                return;
+            }
+            swap_entries(i, parent);
+            i = parent;
+        }
+    }
+
+    void sift_down(size_t i)
+    {
+        while (true)
+        {
+            size_t l = 2 * i + 1;
+            size_t r = l + 1;
+            size_t m = i;
+            if (l < heap_.size() && heap_[l].value < heap_[m].value)
+            {
+                m = l;
+            }
+            if (r < heap_.size() && heap_[r].value < heap_[m].value)
+            {
+                m = r;
+            }
+            if (m == i)
+            {
+                return;
+            }
+            swap_entries(i, m);
+            i = m;
+        }
+    }
+};
+
+#endif
@@ -0,0 +1,314 @@
+#ifndef TOPOLOGY_H
+#define TOPOLOGY_H
+
+#include <dirent.h>
+#include <pthread.h>
+#include <sched.h>
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <cstdlib>
+#include <exception>
+#include <fstream>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+static std::vector<int> parse_cpulist(const std::string &s)
+{
+    std::vector<int> out;
+    size_t i = 0;
+    while (i < s.size())
+    {
+        size_t comma = s.find(',', i);
+        if (comma == std::string::npos)
+        {
+            comma = s.size();
+        }
+        std::string part = s.substr(i, comma - i);
+        while (!part.empty() && (part.back() == '\n' || part.back() == ' '))
+        {
+            part.pop_back();
+        }
+        if (!part.empty())
+        {
+            size_t dash = part.find('-');
+            char *end = nullptr;
+            long lo = std::strtol(part.c_str(), &end, 10);
+            long hi = lo;
+            if (dash != std::string::npos)
+            {
+                if (end != part.c_str() + dash)
+                {
+                    throw std::invalid_argument("invalid cpu list: " + s);
+                }
+                hi = std::strtol(part.c_str() + dash + 1, &end, 10);
+            }
+            if (*end != '\0' || lo < 0 || hi < lo || hi >= CPU_SETSIZE)
+            {
+                throw std::invalid_argument("invalid cpu list: " + s);
+            }
+            long c = lo;
+            while (c <= hi)
+            {
+                out.push_back(static_cast<int>(c));
+                c += 1;
+            }
+        }
+        i = comma + 1;
+    }
+    std::sort(out.begin(), out.end());
+    out.erase(std::unique(out.begin(), out.end()), out.end());
+    return out;
+}
+
+static bool pin_current_thread(int cpu)
+{
+    if (cpu < 0)
+    {
+        return true;
+    }
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    return pthread_setaffinity_np(pthread_self(), sizeof(set), &set) == 0;
+}
+
+// A thread that cannot be pinned (cpu offline or outside the cpuset) keeps
+// running unpinned. Failures are counted here so the caller can warn once
+// for the whole run rather than once per thread.
+struct PinFailures
+{
+    std::atomic<size_t> count{0};
+    std::atomic<int> first_cpu{-1};
+};
+
+static PinFailures &pin_failures()
+{
+    static PinFailures f;
+    return f;
+}
+
+static void note_pin_failure(int cpu)
+{
+    int none = -1;
+    pin_failures().first_cpu.compare_exchange_strong(none, cpu);
+    pin_failures().count.fetch_add(1);
+}
+
+// Runs fn on a short-lived thread pinned to cpu, so memory it allocates and
+// touches first is placed on that cpu's node by the default first-touch policy.
+template <typename F>
+static void run_on_cpu(int cpu, F fn)
+{
+    if (cpu < 0)
+    {
+        fn();
+        return;
+    }
+    std::exception_ptr err;
+    std::thread t([cpu, &fn, &err]()
+                  {
+        try {
+            if (!pin_current_thread(cpu)) {
+                note_pin_failure(cpu);
+            }
+            fn();
+        } catch (...) {
+            err = std::current_exception();
+        } });
+    t.join();
+    if (err)
+    {
+        std::rethrow_exception(err);
+    }
+}
+
+struct Placement
+{
+    std::vector<int> producer_cpu;
+    std::vector<int> consumer_cpu;
+    std::vector<size_t> producer_queue;
+    std::vector<size_t> consumer_queue;
+    size_t queues;
+
+    Placement() : producer_cpu(), consumer_cpu(), producer_queue(), consumer_queue(), queues(1) {}
+};
+
+class CpuTopology
+{
+public:
+    static CpuTopology detect()
+    {
+        CpuTopology t;
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        if (sched_getaffinity(0, sizeof(set), &set) == 0)
+        {
+            int c = 0;
+            while (c < CPU_SETSIZE)
+            {
+                if (CPU_ISSET(c, &set))
+                {
+                    t.allowed_.push_back(c);
+                }
+                c += 1;
+            }
+        }
+        if (t.allowed_.empty())
+        {
+            t.allowed_.push_back(0);
+        }
+        DIR *d = opendir("/sys/devices/system/node");
+        if (d != nullptr)
+        {
+            std::vector<int> ids;
+            struct dirent *e = readdir(d);
+            while (e != nullptr)
+            {
+                std::string name(e->d_name);
+                if (name.size() > 4 && name.compare(0, 4, "node") == 0 &&
+                    name.find_first_not_of("0123456789", 4) == std::string::npos)
+                {
+                    ids.push_back(std::atoi(name.c_str() + 4));
+                }
+                e = readdir(d);
+            }
+            closedir(d);
+            std::sort(ids.begin(), ids.end());
+            for (int id : ids)
+            {
+                std::ifstream f("/sys/devices/system/node/node" + std::to_string(id) + "/cpulist");
+                std::string line;
+                std::getline(f, line);
+                std::vector<int> cpus;
+                try
+                {
+                    cpus = parse_cpulist(line);
+                }
+                catch (const std::invalid_argument &)
+                {
+                    continue;
+                }
+                if (!cpus.empty())
+                {
+                    t.nodes_.push_back(cpus);
+                }
+            }
+        }
+        if (t.nodes_.empty())
+        {
+            t.nodes_.push_back(t.allowed_);
+        }
+        return t;
+    }
+
+    const std::vector<int> &allowed() const
+    {
+        return allowed_;
+    }
+
+    size_t node_count() const
+    {
+        return nodes_.size();
+    }
+
+    size_t node_of(int cpu) const
+    {
+        size_t n = 0;
+        while (n < nodes_.size())
+        {
+            if (std::binary_search(nodes_[n].begin(), nodes_[n].end(), cpu))
+            {
+                return n;
+            }
+            n += 1;
+        }
+        return 0;
+    }
+
+    // Without numa every thread gets the next cpu from the list and all share
+    // one queue. With numa the cpus are grouped by node, consumers are spread
+    // over nodes, each node that has a consumer gets its own queue, and
+    // producers are placed on those nodes and feed the local queue.
+    Placement plan(const std::vector<int> &cpus, int producers, int consumers, bool numa) const
+    {
+        Placement p;
+        p.producer_queue.assign(static_cast<size_t>(producers), 0);
+        p.consumer_queue.assign(static_cast<size_t>(consumers), 0);
+        if (cpus.empty())
+        {
+            p.producer_cpu.assign(static_cast<size_t>(producers), -1);
+            p.consumer_cpu.assign(static_cast<size_t>(consumers), -1);
+            return p;
+        }
+        if (!numa)
+        {
+            size_t next = 0;
+            int i = 0;
+            while (i < consumers)
+            {
+                p.consumer_cpu.push_back(cpus[next % cpus.size()]);
+                next += 1;
+                i += 1;
+            }
+            i = 0;
+            while (i < producers)
+            {
+                p.producer_cpu.push_back(cpus[next % cpus.size()]);
+                next += 1;
+                i += 1;
+            }
+            return p;
+        }
+        std::vector<std::vector<int>> groups;
+        for (const std::vector<int> &node : nodes_)
+        {
+            std::vector<int> g;
+            for (int c : node)
+            {
+                if (std::binary_search(cpus.begin(), cpus.end(), c))
+                {
+                    g.push_back(c);
+                }
+            }
+            if (!g.empty())
+            {
+                groups.push_back(g);
+            }
+        }
+        if (groups.empty())
+        {
+            groups.push_back(cpus);
+        }
+        size_t used = std::min(groups.size(), static_cast<size_t>(consumers));
+        std::vector<size_t> cursor(used, 0);
+        p.queues = used;
+        int i = 0;
+        while (i < consumers)
+        {
+            size_t n = static_cast<size_t>(i) % used;
+            p.consumer_cpu.push_back(groups[n][cursor[n] % groups[n].size()]);
+            p.consumer_queue[static_cast<size_t>(i)] = n;
+            cursor[n] += 1;
+            i += 1;
+        }
+        i = 0;
+        while (i < producers)
+        {
+            size_t n = static_cast<size_t>(i) % used;
+            p.producer_cpu.push_back(groups[n][cursor[n] % groups[n].size()]);
+            p.producer_queue[static_cast<size_t>(i)] = n;
+            cursor[n] += 1;
+            i += 1;
+        }
+        return p;
+    }
+
+private:
+    std::vector<int> allowed_;
+    std::vector<std::vector<int>> nodes_;
+};
+
+#endif
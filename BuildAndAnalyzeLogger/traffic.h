@@ -0,0 +1,224 @@
+#ifndef TRAFFIC_H
+#define TRAFFIC_H
+
+#include <netinet/in.h>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+// IPv6 address as two host-order halves of the network-order bytes, so
+// comparison follows the textual order.
+struct Ip6Addr
+{
+    uint64_t hi;
+    uint64_t lo;
+
+    Ip6Addr() : hi(0), lo(0) {}
+    Ip6Addr(uint64_t h, uint64_t l) : hi(h), lo(l) {}
+
+    static Ip6Addr from_bytes(const uint8_t *b)
+    {
+        Ip6Addr a;
+        int i = 0;
+        while (i < 8)
+        {
+            a.hi = (a.hi << 8) | b[i];
+            a.lo = (a.lo << 8) | b[i + 8];
+            i += 1;
+        }
+        return a;
+    }
+
+    void to_bytes(uint8_t *b) const
+    {
+        int i = 0;
+        while (i < 8)
+        {
+            b[i] = static_cast<uint8_t>(hi >> (56 - 8 * i));
+            b[i + 8] = static_cast<uint8_t>(lo >> (56 - 8 * i));
+            i += 1;
+        }
+    }
+
+    bool operator==(const Ip6Addr &o) const
+    {
+        return hi == o.hi && lo == o.lo;
+    }
+
+    bool operator!=(const Ip6Addr &o) const
+    {
+        return !(*this == o);
+    }
+
+    bool operator<(const Ip6Addr &o) const
+    {
+        return hi < o.hi || (hi == o.hi && lo < o.lo);
+    }
+};
+
+// 64 bits of an address for hashing; the identity for IPv4.
+inline uint64_t addr_bits(uint32_t a)
+{
+    return a;
+}
+
+inline uint64_t addr_bits(const Ip6Addr &a)
+{
+    return a.hi * 0x9e3779b97f4a7c15ULL ^ a.lo;
+}
+
+// The address type is a template parameter so that IPv4 keeps its 32-bit
+// keys everywhere and only IPv6 tables pay for 128-bit ones.
+template <typename A>
+struct basic_tcp_pkg
+{
+    A src_addr;
+    in_port_t src_port;
+    A dst_addr;
+    in_port_t dst_port;
+    size_t sz;
+
+    basic_tcp_pkg() : src_addr(), src_port(0), dst_addr(), dst_port(0), sz(0) {}
+    basic_tcp_pkg(A saddr, in_port_t sport, A daddr, in_port_t dport, size_t size)
+        : src_addr(saddr), src_port(sport), dst_addr(daddr), dst_port(dport), sz(size) {}
+};
+
+using tcp_traffic_pkg = basic_tcp_pkg<in_addr_t>;
+using tcp6_traffic_pkg = basic_tcp_pkg<Ip6Addr>;
+
+enum class EventType
+{
+    Connect,
+    Send,
+    Recv,
+    Disconnect
+};
+
+// Addresses, ports and size of an IPv6 event.
+struct Tcp6Body
+{
+    Ip6Addr src_addr;
+    Ip6Addr dst_addr;
+    in_port_t src_port;
+    in_port_t dst_port;
+    size_t sz;
+};
+
+// Process-wide storage for IPv6 event bodies, which live out of line so
+// that TcpEvent keeps the 40-byte IPv4 layout. A slot is taken when an
+// IPv6 event is built and given back when the event is consumed; freed
+// slots are reused and chunks never move. Only IPv6 events touch the lock.
+// The pool is local to the process, so IPv6 events cannot cross a
+// shared-memory ring.
+class Ip6BodyPool
+{
+public:
+    static Ip6BodyPool &instance()
+    {
+        static Ip6BodyPool pool;
+        return pool;
+    }
+
+    uint32_t put(const Tcp6Body &b)
+    {
+        std::lock_guard<std::mutex> lk(m_);
+        uint32_t slot = 0;
+        if (!free_.empty())
+        {
+            slot = free_.back();
+            free_.pop_back();
+        }
+        else
+        {
+            if (next_ % CHUNK == 0)
+            {
+                chunks_.push_back(std::make_unique<Tcp6Body[]>(CHUNK));
+            }
+            slot = next_;
+            next_ += 1;
+        }
+        chunks_[slot / CHUNK][slot % CHUNK] = b;
+        return slot;
+    }
+
+    Tcp6Body get(uint32_t slot)
+    {
+        std::lock_guard<std::mutex> lk(m_);
+        return chunks_[slot / CHUNK][slot % CHUNK];
+    }
+
+    void release(uint32_t slot)
+    {
+        std::lock_guard<std::mutex> lk(m_);
+        free_.push_back(slot);
+    }
+
+    // Slots handed out and not yet released.
+    size_t live()
+    {
+        std::lock_guard<std::mutex> lk(m_);
+        return next_ - free_.size();
+    }
+
+private:
+    static constexpr uint32_t CHUNK = 4096;
+
+    std::mutex m_;
+    std::vector<std::unique_ptr<Tcp6Body[]>> chunks_;
+    std::vector<uint32_t> free_;
+    uint32_t next_ = 0;
+};
+
+// Tagged by v6: IPv4 events carry their addresses in pkg, IPv6 events the
+// Ip6BodyPool slot of theirs in body6. Every IPv6 event must reach exactly
+// one take6() (or its slot a release()), which is what the analyzer does.
+struct TcpEvent
+{
+    EventType type;
+    bool abrupt;
+    bool v6;
+    union
+    {
+        tcp_traffic_pkg pkg;
+        uint32_t body6;
+    };
+    uint64_t ts_us;
+
+    TcpEvent() : type(EventType::Connect), abrupt(false), v6(false), pkg(), ts_us(0) {}
+    TcpEvent(EventType t, const tcp_traffic_pkg &p, bool ab, uint64_t ts = 0)
+        : type(t), abrupt(ab), v6(false), pkg(p), ts_us(ts) {}
+    TcpEvent(EventType t, const tcp6_traffic_pkg &p, bool ab, uint64_t ts = 0)
+        : type(t), abrupt(ab), v6(true),
+          body6(Ip6BodyPool::instance().put(Tcp6Body{p.src_addr, p.dst_addr, p.src_port, p.dst_port, p.sz})),
+          ts_us(ts) {}
+
+    tcp6_traffic_pkg pkg6() const
+    {
+        return unpack(Ip6BodyPool::instance().get(body6));
+    }
+
+    // Reads the IPv6 body and frees its slot.
+    tcp6_traffic_pkg take6() const
+    {
+        Tcp6Body b = Ip6BodyPool::instance().get(body6);
+        Ip6BodyPool::instance().release(body6);
+        return unpack(b);
+    }
+
+    uint64_t src_bits() const
+    {
+        return v6 ? addr_bits(Ip6BodyPool::instance().get(body6).src_addr) : addr_bits(pkg.src_addr);
+    }
+
+private:
+    static tcp6_traffic_pkg unpack(const Tcp6Body &b)
+    {
+        return tcp6_traffic_pkg(b.src_addr, b.src_port, b.dst_addr, b.dst_port, b.sz);
+    }
+};
+
+static_assert(sizeof(TcpEvent) == 40, "IPv6 support must not grow the IPv4 event");
+
+#endif
@@ -0,0 +1,54 @@
+#ifndef VARINT_H
+#define VARINT_H
+
+#include <cstddef>
+#include <cstdint>
+#include <stdexcept>
+#include <string>
+
+static inline void put_varint(std::string &out, uint64_t v)
+{
+    while (v >= 0x80)
+    {
+        out.push_back(static_cast<char>((v & 0x7f) | 0x80));
+        v >>= 7;
+    }
+    out.push_back(static_cast<char>(v));
+}
+
+static inline uint64_t get_varint(const uint8_t *&p, const uint8_t *end)
+{
+    uint64_t v = 0;
+    int shift = 0;
+    while (p < end && shift < 64)
+    {
+        uint8_t b = *p;
+        p += 1;
+        v |= static_cast<uint64_t>(b & 0x7f) << shift;
+        if ((b & 0x80) == 0)
+        {
+            return v;
+        }
+        shift += 7;
+    }
+    throw std::runtime_error("truncated varint");
+}
+
+static inline uint64_t fnv1a_update(uint64_t h, const uint8_t *p, size_t n)
+{
+    size_t i = 0;
+    while (i < n)
+    {
+        h ^= p[i];
+        h *= 0x100000001b3ULL;
+        i += 1;
+    }
+    return h;
+}
+
+static inline uint64_t fnv1a(const uint8_t *p, size_t n)
+{
+    return fnv1a_update(0xcbf29ce484222325ULL, p, n);
+}
+
+#endif
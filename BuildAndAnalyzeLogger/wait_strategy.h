@@ -0,0 +1,80 @@
+#ifndef WAIT_STRATEGY_H
+#define WAIT_STRATEGY_H
+
+#include <condition_variable>
+#include <cstddef>
+#include <stdexcept>
+#include <string>
+
+enum class WaitStrategy
+{
+    Block,
+    Spin,
+    SpinYield,
+    SpinPark
+};
+
+// Pause iterations before a spin-yield waiter starts yielding, and before a
+// spin-park waiter gives up and sleeps on the condition variable.
+static const size_t WAIT_SPIN_LIMIT = 256;
+static const size_t WAIT_YIELD_LIMIT = 16;
+
+static inline void cpu_relax()
+{
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+#elif defined(__aarch64__)
+    asm volatile("yield");
+#endif
+}
+
+static WaitStrategy parse_wait_strategy(const std::string &s)
+{
+    if (s == "block")
+    {
+        return WaitStrategy::Block;
+    }
+    if (s == "spin")
+    {
+        return WaitStrategy::Spin;
+    }
+    if (s == "yield")
+    {
+        return WaitStrategy::SpinYield;
+    }
+    if (s == "park")
+    {
+        return WaitStrategy::SpinPark;
+    }
+    throw std::invalid_argument("unknown wait strategy: " + s + " (block, spin, yield, park)");
+}
+
+static const char *wait_strategy_name(WaitStrategy s)
+{
+    if (s == WaitStrategy::Spin)
+    {
+        return "spin";
+    }
+    if (s == WaitStrategy::SpinYield)
+    {
+        return "yield";
+    }
+    if (s == WaitStrategy::SpinPark)
+    {
+        return "park";
+    }
+    return "block";
+}
+
+// A condition variable plus the number of threads parked on it. The count is
+// only touched under the queue mutex, so a notifier holding that mutex can
+// skip the futex wake when nobody is asleep.
+struct ParkingGate
+{
+    std::condition_variable cv;
+    size_t sleepers;
+
+    ParkingGate() : cv(), sleepers(0) {}
+};
+
+#endif
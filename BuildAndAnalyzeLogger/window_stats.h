@@ -0,0 +1,165 @@
+#ifndef WINDOW_STATS_H
+#define WINDOW_STATS_H
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+
+struct WindowTotals
+{
+    uint64_t sent;
+    uint64_t recv;
+
+    WindowTotals() : sent(0), recv(0) {}
+
+    double sent_rate(uint64_t span_s) const
+    {
+        return span_s > 0 ? static_cast<double>(sent) / static_cast<double>(span_s) : 0.0;
+    }
+
+    double recv_rate(uint64_t span_s) const
+    {
+        return span_s > 0 ? static_cast<double>(recv) / static_cast<double>(span_s) : 0.0;
+    }
+};
+
+struct IpWindows
+{
+    WindowTotals last_1s;
+    WindowTotals last_10s;
+    WindowTotals last_60s;
+};
+
+static constexpr size_t ceil_pow2(uint64_t n)
+{
+    return n <= 1 ? 1 : 2 * ceil_pow2((n + 1) / 2);
+}
+
+// Per-second sent/recv buckets of one IP, enough for the last MAX_SPAN_S
+// seconds. The ring is allocated on the first add and the owner drops it
+// once it has been idle for MAX_SPAN_S, so an IP that has gone quiet costs
+// one pointer. Seconds and counters are 32-bit; a counter saturates at
+// 4 GiB per IP per second.
+class RateWindow
+{
+public:
+    static constexpr uint64_t MAX_SPAN_S = 60;
+    static constexpr size_t SLOTS = ceil_pow2(MAX_SPAN_S);
+
+    RateWindow() : ring_() {}
+
+    // Returns true if this add allocated the ring.
+    bool add(uint64_t sec, uint64_t sent, uint64_t recv)
+    {
+        bool fresh = ring_ == nullptr;
+        if (fresh)
+        {
+            ring_ = std::make_unique<Ring>();
+        }
+        uint32_t s = static_cast<uint32_t>(sec);
+        Bucket &b = ring_->buckets[s % SLOTS];
+        if (b.sec != s)
+        {
+            if (b.sec > s)
+            {
+                return fresh;
+            }
+            b.sec = s;
+            b.sent = 0;
+            b.recv = 0;
+        }
+        b.sent = saturate(b.sent, sent);
+        b.recv = saturate(b.recv, recv);
+        if (s > ring_->last)
+        {
+            ring_->last = s;
+        }
+        return fresh;
+    }
+
+    WindowTotals sum(uint64_t now_sec, uint64_t span_s) const
+    {
+        WindowTotals t;
+        if (ring_ == nullptr)
+        {
+            return t;
+        }
+        if (span_s > MAX_SPAN_S)
+        {
+            span_s = MAX_SPAN_S;
+        }
+        for (const Bucket &b : ring_->buckets)
+        {
+            if (b.sec <= now_sec && b.sec + span_s > now_sec && (b.sent != 0 || b.recv != 0))
+            {
+                t.sent += b.sent;
+                t.recv += b.recv;
+            }
+        }
+        return t;
+    }
+
+    void add_to(IpWindows &w, uint64_t now_sec) const
+    {
+        WindowTotals a = sum(now_sec, 1);
+        WindowTotals b = sum(now_sec, 10);
+        WindowTotals c = sum(now_sec, 60);
+        w.last_1s.sent += a.sent;
+        w.last_1s.recv += a.recv;
+        w.last_10s.sent += b.sent;
+        w.last_10s.recv += b.recv;
+        w.last_60s.sent += c.sent;
+        w.last_60s.recv += c.recv;
+    }
+
+    bool allocated() const
+    {
+        return ring_ != nullptr;
+    }
+
+    // Latest second added; only meaningful while allocated.
+    uint64_t last() const
+    {
+        return ring_ != nullptr ? ring_->last : 0;
+    }
+
+    // Frees the ring if nothing in it is newer than MAX_SPAN_S before
+    // now_sec; every sum() from then on would be empty anyway.
+    bool release_if_idle(uint64_t now_sec)
+    {
+        if (ring_ == nullptr || ring_->last + MAX_SPAN_S > now_sec)
+        {
+            return false;
+        }
+        ring_.reset();
+        return true;
+    }
+
+private:
+    struct Bucket
+    {
+        uint32_t sec;
+        uint32_t sent;
+        uint32_t recv;
+
+        Bucket() : sec(0), sent(0), recv(0) {}
+    };
+
+    struct Ring
+    {
+        Bucket buckets[SLOTS];
+        uint32_t last;
+
+        Ring() : buckets(), last(0) {}
+    };
+
+    std::unique_ptr<Ring> ring_;
+
+    static uint32_t saturate(uint32_t v, uint64_t add)
+    {
+        uint64_t sum = v + add;
+        return sum > UINT32_MAX ? UINT32_MAX : static_cast<uint32_t>(sum);
+    }
+};
+
+#endif
@@ -1,13 +1,31 @@
+#define _GNU_SOURCE
+
 #include <stdio.h>
 #include <string.h>
 #include <stdint.h>
 #include <stdlib.h>
 #include <ctype.h>
 #include <inttypes.h>
+#include <errno.h>
+#include <time.h>
 
+#include <fcntl.h>
+#include <pthread.h>
 #include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/sendfile.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
 #include <sys/types.h>
+#include <sys/uio.h>
 #include <sys/wait.h>
+#include <linux/fs.h>
+#include <linux/io_uring.h>
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
 
 typedef enum
 {
@@ -18,6 +36,21 @@ typedef enum
     UNKNOWN
 } Action;
 
+// Способы копирования от быстрого к медленному; выбранный способ пробуется
+// первым, более медленные остаются запасными.
+typedef enum
+{
+    COPY_CLONE,
+    COPY_RANGE,
+    COPY_SENDFILE,
+    COPY_BUFFERED
+} CopyMethod;
+
+// Ключи ввода-вывода: -u — чтение и копирование через io_uring, -d — ещё и
+// O_DIRECT для копий.
+#define IO_URING 1
+#define IO_DIRECT 2
+
 typedef struct
 {
     Action action;
@@ -25,8 +58,15 @@ typedef struct
     const char *mask_hex;
     int copyN;
     const char *some_string;
+    const char *pattern_file;
     char *const *files;
     size_t file_count;
+    int jobs;
+    CopyMethod copy_method;
+    int read_once;
+    int ordered;
+    int io_flags;
+    const char *cache_path;
 } Cmd;
 
 int parse_int_suffix(const char *prefix, const char *last, int *n)
@@ -114,15 +154,129 @@ int parse_hex_u32(const char *s, uint32_t *out)
     return 1;
 }
 
-int parse_cmd(int argc, char **argv, Cmd *cmd)
+int default_jobs(void)
 {
-    if (argc < 3)
+    long n = sysconf(_SC_NPROCESSORS_ONLN);
+    if (n < 1)
+    {
+        return 1;
+    }
+    return (int)n;
+}
+
+int parse_copy_method(const char *s, CopyMethod *out)
+{
+    if (strcmp(s, "clone") == 0)
+    {
+        *out = COPY_CLONE;
+    }
+    else if (strcmp(s, "range") == 0)
+    {
+        *out = COPY_RANGE;
+    }
+    else if (strcmp(s, "sendfile") == 0)
+    {
+        *out = COPY_SENDFILE;
+    }
+    else if (strcmp(s, "read") == 0)
+    {
+        *out = COPY_BUFFERED;
+    }
+    else
     {
         return 0;
     }
+    return 1;
+}
 
+int parse_cmd(int argc, char **argv, Cmd *cmd)
+{
     memset(cmd, 0, sizeof(*cmd));
     cmd->action = UNKNOWN;
+    cmd->jobs = default_jobs();
+
+    cmd->copy_method = COPY_CLONE;
+
+    // Ключи перед файлами:
+    // -j N — максимальное число одновременно работающих процессов;
+    // -m clone|range|sendfile|read — с какого способа начинать копирование;
+    // -r — читать источник один раз и писать все N копий из одного буфера;
+    // -o — find печатает результаты в порядке списков, а не по готовности;
+    // -u — ввод-вывод через io_uring (если ядро его не даёт — как обычно);
+    // -d — то же с O_DIRECT для копий;
+    // -c INDEX — кэш результатов xorN, mask и find в файле INDEX.
+    while (argc >= 3 && argv[1][0] == '-')
+    {
+        if (strcmp(argv[1], "-j") == 0)
+        {
+            int jobs = 0;
+            if (!parse_int_suffix("", argv[2], &jobs) || jobs <= 0)
+            {
+                fprintf(stderr, "error N in -j N\n");
+                return 0;
+            }
+            cmd->jobs = jobs;
+            argv += 2;
+            argc -= 2;
+        }
+        else if (strcmp(argv[1], "-m") == 0)
+        {
+            if (!parse_copy_method(argv[2], &cmd->copy_method))
+            {
+                fprintf(stderr, "error method in -m\n");
+                return 0;
+            }
+            argv += 2;
+            argc -= 2;
+        }
+        else if (strcmp(argv[1], "-r") == 0)
+        {
+            cmd->read_once = 1;
+            argv += 1;
+            argc -= 1;
+        }
+        else if (strcmp(argv[1], "-o") == 0)
+        {
+            cmd->ordered = 1;
+            argv += 1;
+            argc -= 1;
+        }
+        else if (strcmp(argv[1], "-u") == 0)
+        {
+            cmd->io_flags |= IO_URING;
+            argv += 1;
+            argc -= 1;
+        }
+        else if (strcmp(argv[1], "-d") == 0)
+        {
+            cmd->io_flags |= IO_URING | IO_DIRECT;
+            argv += 1;
+            argc -= 1;
+        }
+        else if (strcmp(argv[1], "-c") == 0)
+        {
+            cmd->cache_path = argv[2];
+            argv += 2;
+            argc -= 2;
+        }
+        else
+        {
+            break;
+        }
+    }
+
+    // O_DIRECT относится к собственным чтениям и записям, а copy_file_range и
+    // sendfile копируют внутри ядра
+    if ((cmd->io_flags & IO_DIRECT) && (cmd->copy_method == COPY_RANGE || cmd->copy_method == COPY_SENDFILE))
+    {
+        fprintf(stderr, "-d cannot be combined with -m range|sendfile\n");
+        return 0;
+    }
+
+    if (argc < 3)
+    {
+        return 0;
+    }
 
     const char *last = argv[argc - 1];
     int n;
@@ -192,718 +346,3774 @@ int parse_cmd(int argc, char **argv, Cmd *cmd)
             cmd->file_count = (size_t)(argc - 3);
             return 1;
         }
+
+        if (strcmp(prev, "find-file") == 0)
+        {
+            cmd->action = ACTION_FIND;
+            cmd->pattern_file = last;
+            cmd->files = argv + 1;
+            cmd->file_count = (size_t)(argc - 3);
+            return 1;
+        }
     }
 
     return 0;
 }
 
-int xor_stream_nibble(char *const *paths, size_t count, uint8_t *out_nib)
+// Кэш результатов (-c INDEX): запись привязана к файлу ключом (путь, inode,
+// размер, mtime в нс, действие, параметр) и хранится в текстовом индексе,
+// строка на запись:
+//   <inode> <size> <mtime_ns> <action> <param hex> <value> <path>
+// Путь — realpath, параметр (маска, размер блока, строка поиска) — в hex,
+// чтобы строки с пробелами не ломали разбор. Индекс переписывается целиком
+// через временный файл и rename, только если что-то добавилось.
+#define CACHE_MAGIC "filetool-cache 1"
+#define CACHE_BUCKETS 1024
+#define CACHE_VALUE_MAX 80
+#define CACHE_MAX_ENTRIES 65536
+
+typedef struct CacheEntry
 {
-    if (!paths || count == 0 || !out_nib)
+    struct CacheEntry *next;
+    uint64_t hash;
+    char *path;
+    char *param;
+    char action[8];
+    uint64_t ino;
+    uint64_t size;
+    int64_t mtime_ns;
+    char value[CACHE_VALUE_MAX];
+    int used; // найдена или добавлена в этом запуске
+    int keep;
+} CacheEntry;
+
+typedef struct
+{
+    const char *index_path;
+    CacheEntry **buckets;
+    size_t nbuckets;
+    size_t count;
+    int dirty;
+    pthread_mutex_t lock;
+} ResultCache;
+
+uint64_t cache_hash(const char *path, const char *action, const char *param)
+{
+    uint64_t h = 1469598103934665603ull;
+    const char *parts[3] = {path, action, param};
+    for (int i = 0; i < 3; ++i)
     {
-        return 0;
+        for (const unsigned char *p = (const unsigned char *)parts[i]; *p; ++p)
+        {
+            h = (h ^ *p) * 1099511628211ull;
+        }
+        h = (h ^ 0xff) * 1099511628211ull;
     }
+    return h;
+}
 
-    uint8_t acc = 0;
-    uint8_t chunk[4096];
+int64_t stat_mtime_ns(const struct stat *st)
+{
+    return (int64_t)st->st_mtim.tv_sec * 1000000000 + st->st_mtim.tv_nsec;
+}
 
-    for (size_t i = 0; i < count; ++i)
+CacheEntry *cache_find(ResultCache *c, uint64_t h, const char *path, const char *action, const char *param)
+{
+    for (CacheEntry *e = c->buckets[h & (c->nbuckets - 1)]; e; e = e->next)
     {
-        const char *path = paths[i];
-        FILE *file = fopen(path, "rb");
-        if (!file)
+        if (e->hash == h && strcmp(e->action, action) == 0 && strcmp(e->path, path) == 0 && strcmp(e->param, param) == 0)
         {
-            fprintf(stderr, "Error opening file\n");
-            return 0;
+            return e;
         }
+    }
+    return NULL;
+}
 
-        while (1)
+// Добавляет или заменяет запись; 0 — нехватка памяти.
+int cache_insert(ResultCache *c, const char *path, const char *action, const char *param, uint64_t ino, uint64_t size, int64_t mtime_ns, const char *value, int used)
+{
+    if (strlen(action) >= sizeof(((CacheEntry *)0)->action) || strlen(value) >= CACHE_VALUE_MAX)
+    {
+        return 1;
+    }
+    uint64_t h = cache_hash(path, action, param);
+    CacheEntry *e = cache_find(c, h, path, action, param);
+    if (!e)
+    {
+        e = (CacheEntry *)calloc(1, sizeof(CacheEntry));
+        if (!e)
         {
-            size_t n = fread(chunk, 1, sizeof(chunk), file);
-            if (n == 0)
-            {
-                if (ferror(file))
-                {
-                    fprintf(stderr, "Error read file\n");
-                    fclose(file);
-                    return 0;
-                }
-                break;
-            }
-
-            for (size_t j = 0; j < n; ++j)
-            {
-                uint8_t byte = chunk[j];
-                acc ^= (uint8_t)((byte >> 4) & 0x0F);
-                acc ^= (uint8_t)(byte & 0x0F);
-            }
+            return 0;
         }
-
-        if (fclose(file) != 0)
+        e->path = strdup(path);
+        e->param = strdup(param);
+        if (!e->path || !e->param)
         {
-            fprintf(stderr, "Error close file\n");
+            free(e->path);
+            free(e->param);
+            free(e);
+            return 0;
         }
+        e->hash = h;
+        strcpy(e->action, action);
+        e->next = c->buckets[h & (c->nbuckets - 1)];
+        c->buckets[h & (c->nbuckets - 1)] = e;
+        c->count++;
     }
-    *out_nib = (uint8_t)(acc & 0x0F);
-
+    e->ino = ino;
+    e->size = size;
+    e->mtime_ns = mtime_ns;
+    strcpy(e->value, value);
+    e->used = used;
     return 1;
 }
 
-int xor_stream_blocks(char *const *paths, size_t count, size_t block_bytes, uint8_t *out_acc)
+void cache_free(ResultCache *c)
 {
-    if (!paths || count == 0 || block_bytes == 0 || !out_acc)
+    for (size_t b = 0; b < c->nbuckets; ++b)
     {
-        return 0;
+        CacheEntry *e = c->buckets[b];
+        while (e)
+        {
+            CacheEntry *next = e->next;
+            free(e->path);
+            free(e->param);
+            free(e);
+            e = next;
+        }
     }
+    free(c->buckets);
+    pthread_mutex_destroy(&c->lock);
+}
 
-    memset(out_acc, 0, block_bytes);
-
-    uint8_t *buf = (uint8_t *)malloc(block_bytes);
-    if (!buf)
+int hex_digit(char ch)
+{
+    if (ch >= '0' && ch <= '9')
     {
-        fprintf(stderr, "Memory allocation error\n");
-        free(buf);
-        return 0;
+        return ch - '0';
     }
+    if (ch >= 'a' && ch <= 'f')
+    {
+        return ch - 'a' + 10;
+    }
+    return -1;
+}
 
-    size_t filled = 0;
-    uint8_t chunk[4096];
-
-    for (size_t i = 0; i < count; i++)
+// Разбор строки индекса на месте; 0 — строка повреждена (пропускается).
+int cache_parse_line(ResultCache *c, char *line)
+{
+    char *field[7];
+    char *p = line;
+    for (int i = 0; i < 6; ++i)
     {
-        const char *path = paths[i];
-        FILE *file = fopen(path, "rb");
-        if (!file)
+        char *sp = strchr(p, ' ');
+        if (!sp)
         {
-            fprintf(stderr, "Error opening file\n");
-            free(buf);
             return 0;
         }
+        *sp = '\0';
+        field[i] = p;
+        p = sp + 1;
+    }
+    field[6] = p;
 
-        while (1)
-        {
-            size_t n = fread(chunk, 1, sizeof(chunk), file);
-            if (n == 0)
-            {
-                if (ferror(file))
-                {
-                    fprintf(stderr, "Error read file\n");
-                    fclose(file);
-                    free(buf);
-                    return 0;
-                }
-                break;
-            }
-
-            size_t pos = 0;
-            while (pos < n)
-            {
-                size_t need = block_bytes - filled;
-                size_t take;
-                if (n - pos < need)
-                {
-                    take = n - pos;
-                }
-                else
-                {
-                    take = need;
-                }
-
-                memcpy(buf + filled, chunk + pos, take);
-                filled += take;
-                pos += take;
-
-                if (filled == block_bytes)
-                {
-                    for (size_t b = 0; b < block_bytes; ++b)
-                    {
-                        out_acc[b] ^= buf[b];
-
-                        fprintf(stderr, "[blk] ");
-                        for (size_t b = 0; b < block_bytes; ++b)
-                            fprintf(stderr, "%02X", buf[b]);
-                        fprintf(stderr, "  => acc=");
-                        for (size_t b = 0; b < block_bytes; ++b)
-                            fprintf(stderr, "%02X", out_acc[b]);
-                        fprintf(stderr, "\n");
-                    }
-                    filled = 0;
-                }
-            }
-        }
-
-        if (fclose(file) != 0)
-        {
-            fprintf(stderr, "Error close file\n");
-        }
+    char *end;
+    errno = 0;
+    uint64_t ino = strtoull(field[0], &end, 10);
+    if (*end)
+    {
+        return 0;
+    }
+    uint64_t size = strtoull(field[1], &end, 10);
+    if (*end)
+    {
+        return 0;
+    }
+    int64_t mtime_ns = strtoll(field[2], &end, 10);
+    if (*end || errno != 0 || field[6][0] == '\0')
+    {
+        return 0;
     }
 
-    if (filled > 0)
+    // hex параметра декодируется в ту же строку
+    char *param = field[4];
+    size_t hex_len = strlen(param);
+    if (hex_len % 2 != 0)
     {
-        memset(buf + filled, 0, block_bytes - filled);
-        for (size_t b = 0; b < block_bytes; ++b)
+        return 0;
+    }
+    for (size_t i = 0; i < hex_len / 2; ++i)
+    {
+        int hi = hex_digit(param[2 * i]);
+        int lo = hex_digit(param[2 * i + 1]);
+        if (hi < 0 || lo < 0 || (hi == 0 && lo == 0))
         {
-            out_acc[b] ^= buf[b];
-
-            fprintf(stderr, "[tail] ");
-            for (size_t b = 0; b < block_bytes; ++b)
-                fprintf(stderr, "%02X", buf[b]);
-            fprintf(stderr, "  => acc=");
-            for (size_t b = 0; b < block_bytes; ++b)
-                fprintf(stderr, "%02X", out_acc[b]);
-            fprintf(stderr, "\n");
+            return 0;
         }
+        param[i] = (char)(hi << 4 | lo);
     }
+    param[hex_len / 2] = '\0';
 
-    free(buf);
-
-    return 1;
-}
-
-uint32_t be32_from4(const uint8_t w[4])
-{
-    return ((uint32_t)w[0] << 24) | ((uint32_t)w[1] << 16) | ((uint32_t)w[2] << 8) | (uint32_t)w[3];
+    return cache_insert(c, field[6], field[3], param, ino, size, mtime_ns, field[5], 0) ? 1 : -1;
 }
 
-int count_mask_matches_be32(char *const *paths, size_t count, uint32_t mask, uint64_t *out_count)
+// Отсутствующий индекс — пустой кэш; повреждённые строки пропускаются.
+int cache_load(ResultCache *c, const char *index_path)
 {
-    if (!paths || count == 0 || !out_count)
+    memset(c, 0, sizeof(*c));
+    c->index_path = index_path;
+    c->nbuckets = CACHE_BUCKETS;
+    c->buckets = (CacheEntry **)calloc(c->nbuckets, sizeof(CacheEntry *));
+    if (!c->buckets)
     {
+        fprintf(stderr, "memory allocation error\n");
         return 0;
     }
-    *out_count = 0;
-
-    uint8_t win[4];
-    size_t filled = 0;
-    uint8_t chunk[4096];
+    pthread_mutex_init(&c->lock, NULL);
 
-    for (size_t i = 0; i < count; ++i)
+    FILE *f = fopen(index_path, "r");
+    if (!f)
+    {
+        return 1;
+    }
+    char *line = NULL;
+    size_t cap = 0;
+    ssize_t len;
+    int ok = 1;
+    int first = 1;
+    while (ok && (len = getline(&line, &cap, f)) > 0)
     {
-        const char *path = paths[i];
-        FILE *file = fopen(path, "rb");
-        if (!file)
+        if (line[len - 1] == '\n')
         {
-            fprintf(stderr, "Error opening file\n");
-            return 0;
+            line[--len] = '\0';
         }
-
-        while (1)
+        if (first)
         {
-            size_t n = fread(chunk, 1, sizeof(chunk), file);
-            if (n == 0)
+            first = 0;
+            if (strcmp(line, CACHE_MAGIC) != 0)
             {
-                if (ferror(file))
-                {
-                    fprintf(stderr, "read error\n");
-                    return 0;
-                }
                 break;
             }
-
-            size_t pos = 0;
-            while (pos < n)
-            {
-                size_t need = 4 - filled;
-                size_t take;
-                if ((n - pos) < need)
-                {
-                    take = n - pos;
-                }
-                else
-                {
-                    take = need;
-                }
-
-                memcpy(win + filled, chunk + pos, take);
-                filled += take;
-                pos += take;
-
-                if (filled == 4)
-                {
-                    uint32_t v = be32_from4(win);
-                    if ((v & mask) == mask)
-                    {
-                        (*out_count)++;
-                    }
-                    filled = 0;
-                }
-            }
+            continue;
         }
-
-        if (fclose(file) != 0)
+        if (cache_parse_line(c, line) < 0)
         {
-            fprintf(stderr, "Close failed\n");
+            fprintf(stderr, "memory allocation error\n");
+            ok = 0;
         }
     }
-
-    return 1;
+    free(line);
+    fclose(f);
+    if (!ok)
+    {
+        cache_free(c);
+    }
+    return ok;
 }
 
-int copy_file_streamed(const char *src, const char *dst)
+// Запись устарела, если файл исчез или его inode, размер или mtime
+// изменились: значение для него больше не выдаётся, и хранить его незачем.
+int cache_entry_stale(const CacheEntry *e)
 {
-    int ok = 1;
+    struct stat st;
+    return stat(e->path, &st) != 0 || (uint64_t)st.st_ino != e->ino || (uint64_t)st.st_size != e->size || stat_mtime_ns(&st) != e->mtime_ns;
+}
 
-    FILE *input = fopen(src, "rb");
-    if (!input)
+// Индекс пишется во временный файл в том же каталоге (mkstemp, так что
+// параллельные запуски не мешают друг другу), сбрасывается на диск и
+// подменяет старый rename. Устаревшие записи отбрасываются; если записей
+// всё равно больше CACHE_MAX_ENTRIES, остаются использованные в этом запуске.
+int cache_save(ResultCache *c)
+{
+    if (!c->dirty)
     {
-        fprintf(stderr, "error opening file\n");
-        return 0;
+        return 1;
     }
-
-    FILE *output = fopen(dst, "wb");
-    if (!output)
+    size_t plen = strlen(c->index_path);
+    char *tmp = (char *)malloc(plen + 8);
+    if (!tmp)
     {
-        fprintf(stderr, "error opening file\n");
-        fclose(input);
+        fprintf(stderr, "memory allocation error\n");
         return 0;
     }
+    memcpy(tmp, c->index_path, plen);
+    memcpy(tmp + plen, ".XXXXXX", 8);
 
-    uint8_t *buf = (uint8_t *)malloc(65536);
-    if (!buf)
+    int fd = mkstemp(tmp);
+    FILE *f = fd >= 0 ? fdopen(fd, "w") : NULL;
+    if (!f)
     {
-        fprintf(stderr, "memory allocation error\n");
-        fclose(input);
-        fclose(output);
+        fprintf(stderr, "cache: cannot write %s\n", c->index_path);
+        if (fd >= 0)
+        {
+            close(fd);
+            unlink(tmp);
+        }
+        free(tmp);
         return 0;
     }
 
-    while (1)
+    size_t kept = 0;
+    for (size_t b = 0; b < c->nbuckets; ++b)
     {
-        size_t r = fread(buf, 1, 65536, input);
-        if (r == 0)
+        for (CacheEntry *e = c->buckets[b]; e; e = e->next)
         {
-            if (ferror(input))
-            {
-                fprintf(stderr, "read error input file\n");
-                ok = 0;
-            }
-            break;
+            e->keep = !cache_entry_stale(e);
+            kept += (size_t)e->keep;
         }
+    }
+    int only_used = kept > CACHE_MAX_ENTRIES;
 
-        size_t off = 0;
-        while (off < r)
+    fprintf(f, "%s\n", CACHE_MAGIC);
+    size_t written = 0;
+    for (size_t b = 0; b < c->nbuckets; ++b)
+    {
+        for (CacheEntry *e = c->buckets[b]; e; e = e->next)
         {
-            size_t w = fwrite(buf + off, 1, r - off, output);
-            if (w == 0)
+            if (!e->keep || (only_used && !e->used) || written == CACHE_MAX_ENTRIES)
             {
-                fprintf(stderr, "write error output file\n");
-                ok = 0;
-                break;
+                continue;
             }
-            off += w;
-        }
-
-        if (!ok)
-        {
-            break;
+            written++;
+            fprintf(f, "%" PRIu64 " %" PRIu64 " %" PRId64 " %s ", e->ino, e->size, e->mtime_ns, e->action);
+            for (const unsigned char *p = (const unsigned char *)e->param; *p; ++p)
+            {
+                fprintf(f, "%02x", *p);
+            }
+            fprintf(f, " %s %s\n", e->value, e->path);
         }
     }
-
-    free(buf);
-
-    if (fclose(input) != 0)
-    {
-        fprintf(stderr, "close input file failed\n");
-        ok = 0;
-    }
-
-    if (fclose(output) != 0)
+    int ok = fflush(f) == 0 && !ferror(f) && fsync(fd) == 0;
+    ok = fclose(f) == 0 && ok;
+    if (!ok || rename(tmp, c->index_path) != 0)
     {
-        fprintf(stderr, "close output file failed\n");
+        fprintf(stderr, "cache: cannot write %s\n", c->index_path);
+        unlink(tmp);
         ok = 0;
     }
-
+    free(tmp);
     return ok;
 }
 
-int build_copy_path(const char *src, int index, char **out)
+// Ключ файла: realpath и stat. 0 — файл не кэшируется (нет файла, не
+// обычный файл или в пути перевод строки); *path освобождает вызывающий.
+int cache_key(const char *file, char **path, struct stat *st)
 {
-    if (!src || index <= 0 || !out)
+    *path = NULL;
+    if (stat(file, st) != 0 || !S_ISREG(st->st_mode))
     {
         return 0;
     }
-
-    size_t slen = strlen(src);
-    char buf[32];
-    int n = snprintf(buf, sizeof(buf), "%d", index);
-
-    if (n <= 0)
+    *path = realpath(file, NULL);
+    if (!*path || strchr(*path, '\n'))
     {
+        free(*path);
+        *path = NULL;
         return 0;
     }
+    return 1;
+}
 
-    size_t newlen = slen + (size_t)n;
-    char *dst = (char *)malloc(newlen + 1);
+// 1 — в кэше есть значение для файла в состоянии st.
+int cache_get(ResultCache *c, const char *path, const struct stat *st, const char *action, const char *param, char value[CACHE_VALUE_MAX])
+{
+    pthread_mutex_lock(&c->lock);
+    CacheEntry *e = cache_find(c, cache_hash(path, action, param), path, action, param);
+    int hit = e && e->ino == (uint64_t)st->st_ino && e->size == (uint64_t)st->st_size && e->mtime_ns == stat_mtime_ns(st);
+    if (hit)
+    {
+        memcpy(value, e->value, CACHE_VALUE_MAX);
+        e->used = 1;
+    }
+    pthread_mutex_unlock(&c->lock);
+    return hit;
+}
+
+// Значение сохраняется, только если файл не менялся, пока его читали, и
+// его mtime старше CACHE_SETTLE_NS: запись в тот же квант времени
+// файловой системы могла бы не изменить ключ.
+#define CACHE_SETTLE_NS 2000000000ll
+
+void cache_put(ResultCache *c, const char *path, const struct stat *st, const char *action, const char *param, const char *value)
+{
+    struct stat now_st;
+    struct timespec now;
+    if (stat(path, &now_st) != 0 || now_st.st_ino != st->st_ino || now_st.st_size != st->st_size ||
+        stat_mtime_ns(&now_st) != stat_mtime_ns(st) || clock_gettime(CLOCK_REALTIME, &now) != 0 ||
+        (int64_t)now.tv_sec * 1000000000 + now.tv_nsec - stat_mtime_ns(st) < CACHE_SETTLE_NS)
+    {
+        return;
+    }
+    pthread_mutex_lock(&c->lock);
+    if (cache_insert(c, path, action, param, (uint64_t)st->st_ino, (uint64_t)st->st_size, stat_mtime_ns(st), value, 1))
+    {
+        c->dirty = 1;
+    }
+    pthread_mutex_unlock(&c->lock);
+}
+
+#define SCAN_CHUNK (1u << 20)
+
+// Обработчик очередного куска логического потока (все файлы подряд);
+// offset — смещение куска от начала потока. Возвращает 0 при ошибке.
+typedef int (*ChunkFn)(const uint8_t *data, size_t n, uint64_t offset, void *ctx);
+
+// Обычный файл отображается в память целиком; если mmap невозможен
+// (каналы, файлы /proc и т.п.), файл читается блоками по 1 МБ.
+int scan_file(const char *path, uint64_t *offset, uint8_t *buf, ChunkFn fn, void *ctx)
+{
+    int fd = open(path, O_RDONLY);
+    if (fd < 0)
+    {
+        fprintf(stderr, "Error opening file\n");
+        return 0;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0)
+    {
+        size_t size = (size_t)st.st_size;
+        void *map = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (map != MAP_FAILED)
+        {
+            madvise(map, size, MADV_SEQUENTIAL);
+            int ok = fn((const uint8_t *)map, size, *offset, ctx);
+            *offset += size;
+            munmap(map, size);
+            close(fd);
+            return ok;
+        }
+    }
+
+    posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+    int ok = 1;
+    while (ok)
+    {
+        ssize_t r = read(fd, buf, SCAN_CHUNK);
+        if (r == 0)
+        {
+            break;
+        }
+        if (r < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            fprintf(stderr, "Error read file\n");
+            ok = 0;
+            break;
+        }
+        ok = fn(buf, (size_t)r, *offset, ctx);
+        *offset += (uint64_t)r;
+    }
+
+    close(fd);
+    return ok;
+}
+
+int scan_files(char *const *paths, size_t count, ChunkFn fn, void *ctx)
+{
+    uint8_t *buf = (uint8_t *)malloc(SCAN_CHUNK);
+    if (!buf)
+    {
+        fprintf(stderr, "Memory allocation error\n");
+        return 0;
+    }
+
+    uint64_t offset = 0;
+    int ok = 1;
+    for (size_t i = 0; i < count && ok; ++i)
+    {
+        ok = scan_file(paths[i], &offset, buf, fn, ctx);
+    }
+
+    free(buf);
+    return ok;
+}
+
+#define URING_DEPTH 16
+#define URING_ENTRIES 64
+#define URING_ALIGN 4096
+
+// Кольцо io_uring без liburing: очереди заявок (SQ) и завершений (CQ)
+// отображаются в память, заявка публикуется сдвигом хвоста SQ, результат
+// забирается сдвигом головы CQ. У кольца depth буферов по SCAN_CHUNK,
+// выровненных на 4 КБ (для O_DIRECT); если позволяет RLIMIT_MEMLOCK, они
+// регистрируются в ядре и читаются/пишутся без отображения на каждый вызов.
+typedef struct
+{
+    int fd;
+    unsigned entries;
+    unsigned *sq_head;
+    unsigned *sq_tail;
+    unsigned sq_mask;
+    unsigned *sq_array;
+    struct io_uring_sqe *sqes;
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    unsigned cq_mask;
+    struct io_uring_cqe *cqes;
+    void *sq_map;
+    size_t sq_map_len;
+    void *cq_map;
+    size_t cq_map_len;
+    size_t sqes_len;
+    unsigned queued;   // опубликованы в SQ, но ещё не переданы ядру
+    unsigned inflight; // результат ещё не забран
+    unsigned depth;
+    uint8_t *bufs[URING_DEPTH];
+    int fixed;
+} Uring;
+
+void uring_free(Uring *r)
+{
+    if (r->fd >= 0)
+    {
+        close(r->fd);
+    }
+    if (r->sqes)
+    {
+        munmap(r->sqes, r->sqes_len);
+    }
+    if (r->cq_map && r->cq_map != r->sq_map)
+    {
+        munmap(r->cq_map, r->cq_map_len);
+    }
+    if (r->sq_map)
+    {
+        munmap(r->sq_map, r->sq_map_len);
+    }
+    for (unsigned i = 0; i < r->depth; ++i)
+    {
+        free(r->bufs[i]);
+    }
+    memset(r, 0, sizeof(*r));
+    r->fd = -1;
+}
+
+void *uring_mmap(int fd, size_t len, off_t what)
+{
+    void *p = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, what);
+    return p == MAP_FAILED ? NULL : p;
+}
+
+// 0 — io_uring недоступен (старое ядро, запрещён seccomp или
+// kernel.io_uring_disabled), вызывающий идёт обычным путём.
+int uring_init(Uring *r, unsigned depth)
+{
+    memset(r, 0, sizeof(*r));
+    r->fd = -1;
+    if (depth == 0 || depth > URING_DEPTH)
+    {
+        depth = URING_DEPTH;
+    }
+
+    struct io_uring_params p;
+    memset(&p, 0, sizeof(p));
+    int fd = (int)syscall(__NR_io_uring_setup, URING_ENTRIES, &p);
+    if (fd < 0)
+    {
+        return 0;
+    }
+    r->fd = fd;
+    r->entries = p.sq_entries;
+
+    r->sq_map_len = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    r->cq_map_len = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    int single = (p.features & IORING_FEAT_SINGLE_MMAP) != 0;
+    if (single && r->cq_map_len > r->sq_map_len)
+    {
+        r->sq_map_len = r->cq_map_len;
+    }
+    r->sq_map = uring_mmap(fd, r->sq_map_len, IORING_OFF_SQ_RING);
+    r->cq_map = single ? r->sq_map : uring_mmap(fd, r->cq_map_len, IORING_OFF_CQ_RING);
+    r->sqes_len = p.sq_entries * sizeof(struct io_uring_sqe);
+    r->sqes = (struct io_uring_sqe *)uring_mmap(fd, r->sqes_len, IORING_OFF_SQES);
+    if (!r->sq_map || !r->cq_map || !r->sqes)
+    {
+        uring_free(r);
+        return 0;
+    }
+
+    uint8_t *sq = (uint8_t *)r->sq_map;
+    r->sq_head = (unsigned *)(sq + p.sq_off.head);
+    r->sq_tail = (unsigned *)(sq + p.sq_off.tail);
+    r->sq_mask = *(unsigned *)(sq + p.sq_off.ring_mask);
+    r->sq_array = (unsigned *)(sq + p.sq_off.array);
+    uint8_t *cq = (uint8_t *)r->cq_map;
+    r->cq_head = (unsigned *)(cq + p.cq_off.head);
+    r->cq_tail = (unsigned *)(cq + p.cq_off.tail);
+    r->cq_mask = *(unsigned *)(cq + p.cq_off.ring_mask);
+    r->cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+
+    struct iovec iov[URING_DEPTH];
+    r->depth = depth;
+    for (unsigned i = 0; i < depth; ++i)
+    {
+        void *b = NULL;
+        if (posix_memalign(&b, URING_ALIGN, SCAN_CHUNK) != 0)
+        {
+            uring_free(r);
+            return 0;
+        }
+        r->bufs[i] = (uint8_t *)b;
+        iov[i].iov_base = b;
+        iov[i].iov_len = SCAN_CHUNK;
+    }
+    r->fixed = syscall(__NR_io_uring_register, fd, IORING_REGISTER_BUFFERS, iov, depth) == 0;
+    return 1;
+}
+
+// Заявка на чтение или запись; buf_index >= 0 — адрес внутри буфера кольца
+// с этим номером, тогда при регистрации используется *_FIXED. Вызывающий
+// следит, чтобы inflight не превышал entries.
+void uring_prep(Uring *r, uint8_t op, int fd, void *addr, size_t len, uint64_t off, int buf_index, uint64_t user_data)
+{
+    unsigned tail = *r->sq_tail;
+    unsigned idx = tail & r->sq_mask;
+    struct io_uring_sqe *sqe = &r->sqes[idx];
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = op;
+    if (buf_index >= 0 && r->fixed)
+    {
+        sqe->opcode = op == IORING_OP_READ ? IORING_OP_READ_FIXED : IORING_OP_WRITE_FIXED;
+        sqe->buf_index = (uint16_t)buf_index;
+    }
+    sqe->fd = fd;
+    sqe->addr = (uint64_t)(uintptr_t)addr;
+    sqe->len = (uint32_t)len;
+    sqe->off = off;
+    sqe->user_data = user_data;
+    r->sq_array[idx] = idx;
+    __atomic_store_n(r->sq_tail, tail + 1, __ATOMIC_RELEASE);
+    r->queued++;
+    r->inflight++;
+}
+
+// Отправляет накопленные заявки и ждёт хотя бы одно завершение.
+int uring_wait(Uring *r, struct io_uring_cqe *out)
+{
+    while (1)
+    {
+        unsigned head = *r->cq_head;
+        if (head != __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE))
+        {
+            *out = r->cqes[head & r->cq_mask];
+            __atomic_store_n(r->cq_head, head + 1, __ATOMIC_RELEASE);
+            r->inflight--;
+            return 1;
+        }
+        long n = syscall(__NR_io_uring_enter, r->fd, r->queued, 1, IORING_ENTER_GETEVENTS, NULL, 0);
+        if (n < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            fprintf(stderr, "io_uring_enter error: %s\n", strerror(errno));
+            return 0;
+        }
+        r->queued -= (unsigned)n;
+    }
+}
+
+typedef struct
+{
+    size_t file;
+    uint64_t file_off;
+    uint64_t offset;
+    size_t len;
+    size_t got;
+    uint64_t seq;
+    int state; // 0 — свободен, 1 — читается, 2 — прочитан
+} UringRead;
+
+// Как scan_range, но через кольцо: до depth чтений по SCAN_CHUNK в полёте
+// сразу, следующий файл начинает читаться, не дожидаясь конца предыдущего.
+// С in_order == 0 кусок отдаётся fn по мере завершения (обработчик учитывает
+// offset), иначе — в порядке потока.
+int uring_scan_range(Uring *r, char *const *paths, const uint64_t *sizes, size_t count, uint64_t begin, uint64_t end, int in_order, ChunkFn fn, void *ctx)
+{
+    int *fds = (int *)malloc(count * sizeof(int));
+    size_t *busy = (size_t *)calloc(count, sizeof(size_t));
+    if (!fds || !busy)
+    {
+        fprintf(stderr, "Memory allocation error\n");
+        free(fds);
+        free(busy);
+        return 0;
+    }
+
+    // файл и смещение в нём, с которых начинается кусок потока
+    size_t cur = 0;
+    uint64_t cur_off = begin;
+    for (size_t i = 0; i < count; ++i)
+    {
+        fds[i] = -1;
+    }
+    while (cur < count && cur_off >= sizes[cur])
+    {
+        cur_off -= sizes[cur];
+        cur++;
+    }
+
+    UringRead slot[URING_DEPTH];
+    memset(slot, 0, sizeof(slot));
+    uint64_t stream = begin;
+    uint64_t next_seq = 0;
+    uint64_t want_seq = 0;
+    int ok = 1;
+    int stop = 0;
+
+    while (1)
+    {
+        for (unsigned s = 0; s < r->depth && !stop; ++s)
+        {
+            while (cur < count && cur_off >= sizes[cur])
+            {
+                cur++;
+                cur_off = 0;
+            }
+            if (cur == count || stream >= end)
+            {
+                break;
+            }
+            if (slot[s].state != 0)
+            {
+                continue;
+            }
+            if (fds[cur] < 0)
+            {
+                fds[cur] = open(paths[cur], O_RDONLY);
+                if (fds[cur] < 0)
+                {
+                    fprintf(stderr, "Error opening file\n");
+                    ok = 0;
+                    stop = 1;
+                    break;
+                }
+                posix_fadvise(fds[cur], 0, 0, POSIX_FADV_SEQUENTIAL);
+            }
+            UringRead *u = &slot[s];
+            u->file = cur;
+            u->file_off = cur_off;
+            u->offset = stream;
+            uint64_t left = sizes[cur] - cur_off < end - stream ? sizes[cur] - cur_off : end - stream;
+            u->len = left < SCAN_CHUNK ? (size_t)left : SCAN_CHUNK;
+            u->got = 0;
+            u->seq = next_seq++;
+            u->state = 1;
+            busy[cur]++;
+            uring_prep(r, IORING_OP_READ, fds[cur], r->bufs[s], u->len, cur_off, (int)s, s);
+            cur_off += u->len;
+            stream += u->len;
+        }
+
+        if (r->inflight == 0)
+        {
+            break;
+        }
+        struct io_uring_cqe cqe;
+        if (!uring_wait(r, &cqe))
+        {
+            ok = 0;
+            break;
+        }
+
+        unsigned s = (unsigned)cqe.user_data;
+        UringRead *u = &slot[s];
+        if (!stop && (cqe.res == -EINTR || cqe.res == -EAGAIN || (cqe.res > 0 && u->got + (size_t)cqe.res < u->len)))
+        {
+            // короткое чтение: дочитываем остаток куска
+            if (cqe.res > 0)
+            {
+                u->got += (size_t)cqe.res;
+            }
+            uring_prep(r, IORING_OP_READ, fds[u->file], r->bufs[s] + u->got, u->len - u->got, u->file_off + u->got, (int)s, s);
+            continue;
+        }
+        if (cqe.res <= 0 && !stop)
+        {
+            // файл укоротился или ошибка чтения
+            fprintf(stderr, "Error read file\n");
+            ok = 0;
+            stop = 1;
+        }
+        u->state = 2;
+
+        while (1)
+        {
+            UringRead *d = NULL;
+            for (unsigned t = 0; t < r->depth && !d; ++t)
+            {
+                if (slot[t].state == 2 && (stop || !in_order || slot[t].seq == want_seq))
+                {
+                    d = &slot[t];
+                }
+            }
+            if (!d)
+            {
+                break;
+            }
+            if (!stop && !fn(r->bufs[d - slot], d->len, d->offset, ctx))
+            {
+                ok = 0;
+                stop = 1;
+            }
+            want_seq++;
+            d->state = 0;
+            if (--busy[d->file] == 0 && (d->file != cur || cur_off >= sizes[cur] || stream >= end))
+            {
+                close(fds[d->file]);
+                fds[d->file] = -1;
+            }
+        }
+    }
+
+    for (size_t i = 0; i < count; ++i)
+    {
+        if (fds[i] >= 0)
+        {
+            close(fds[i]);
+        }
+    }
+    free(fds);
+    free(busy);
+    return ok;
+}
+
+// Все файлы целиком. Возвращает -1, если так читать нельзя (не обычный
+// файл или его нет) — тогда вызывающий идёт обычным путём.
+int uring_scan(Uring *r, char *const *paths, size_t count, int in_order, ChunkFn fn, void *ctx)
+{
+    uint64_t *sizes = (uint64_t *)calloc(count, sizeof(uint64_t));
+    if (!sizes)
+    {
+        fprintf(stderr, "Memory allocation error\n");
+        return 0;
+    }
+    uint64_t total = 0;
+    for (size_t i = 0; i < count; ++i)
+    {
+        struct stat st;
+        if (stat(paths[i], &st) != 0 || !S_ISREG(st.st_mode))
+        {
+            free(sizes);
+            return -1;
+        }
+        sizes[i] = (uint64_t)st.st_size;
+        total += sizes[i];
+    }
+    int ok = uring_scan_range(r, paths, sizes, count, 0, total, in_order, fn, ctx);
+    free(sizes);
+    return ok;
+}
+
+#define PARALLEL_MIN_BYTES (4u << 20)
+
+// Кусок [begin, end) логического потока: в каждом файле, который он
+// задевает, отображается только нужная часть.
+int scan_range(char *const *paths, const uint64_t *sizes, size_t count, uint64_t begin, uint64_t end, ChunkFn fn, void *ctx)
+{
+    uint64_t page = (uint64_t)sysconf(_SC_PAGESIZE);
+    uint64_t file_start = 0;
+    for (size_t i = 0; i < count && file_start < end; ++i)
+    {
+        uint64_t file_end = file_start + sizes[i];
+        if (file_end <= begin || sizes[i] == 0)
+        {
+            file_start = file_end;
+            continue;
+        }
+
+        uint64_t lo = (begin > file_start ? begin : file_start) - file_start;
+        uint64_t hi = (end < file_end ? end : file_end) - file_start;
+
+        int fd = open(paths[i], O_RDONLY);
+        if (fd < 0)
+        {
+            fprintf(stderr, "Error opening file\n");
+            return 0;
+        }
+
+        uint64_t map_lo = lo - lo % page;
+        size_t map_len = (size_t)(hi - map_lo);
+        void *map = mmap(NULL, map_len, PROT_READ, MAP_PRIVATE, fd, (off_t)map_lo);
+        close(fd);
+        if (map == MAP_FAILED)
+        {
+            fprintf(stderr, "Error read file\n");
+            return 0;
+        }
+        madvise(map, map_len, MADV_SEQUENTIAL);
+        int ok = fn((const uint8_t *)map + (lo - map_lo), (size_t)(hi - lo), file_start + lo, ctx);
+        munmap(map, map_len);
+        if (!ok)
+        {
+            return 0;
+        }
+        file_start = file_end;
+    }
+    return 1;
+}
+
+typedef struct
+{
+    char *const *paths;
+    const uint64_t *sizes;
+    size_t count;
+    uint64_t begin;
+    uint64_t end;
+    ChunkFn fn;
+    void *ctx;
+    unsigned uring_depth; // 0 — читать через mmap
+    int in_order;
+    int ok;
+} ScanJob;
+
+// С кольцом у каждого потока своё; если его не создать, кусок читается
+// через mmap.
+void *scan_job_thread(void *arg)
+{
+    ScanJob *job = (ScanJob *)arg;
+    Uring r;
+    if (job->uring_depth > 0 && uring_init(&r, job->uring_depth))
+    {
+        job->ok = uring_scan_range(&r, job->paths, job->sizes, job->count, job->begin, job->end, job->in_order, job->fn, job->ctx);
+        uring_free(&r);
+        return NULL;
+    }
+    job->ok = scan_range(job->paths, job->sizes, job->count, job->begin, job->end, job->fn, job->ctx);
+    return NULL;
+}
+
+// Параллельная свёртка: поток файлов делится на threads кусков, границы
+// которых кратны align, и каждый кусок сворачивается своим потоком в свой
+// контекст ctxs[t] (ctx_size байт каждый); объединяет контексты вызывающий.
+// Если входы не обычные файлы или данных мало, всё делается
+// последовательно в ctxs[0]. С IO_URING каждый поток читает свой кусок
+// через своё кольцо (буферов на потоки делится URING_DEPTH, но не меньше 4);
+// in_order — отдавать ли куски fn в порядке потока.
+int scan_parallel(char *const *paths, size_t count, int threads, uint64_t align, int io_flags, int in_order, ChunkFn fn, void *ctxs, size_t ctx_size)
+{
+    uint64_t *sizes = (uint64_t *)calloc(count, sizeof(uint64_t));
+    if (!sizes)
+    {
+        fprintf(stderr, "Memory allocation error\n");
+        return 0;
+    }
+
+    uint64_t total = 0;
+    int regular = 1;
+    for (size_t i = 0; i < count && regular; ++i)
+    {
+        struct stat st;
+        if (stat(paths[i], &st) != 0 || !S_ISREG(st.st_mode))
+        {
+            regular = 0;
+            break;
+        }
+        sizes[i] = (uint64_t)st.st_size;
+        total += sizes[i];
+    }
+
+    uint64_t per = 0;
+    if (regular && threads > 1)
+    {
+        if (total / (uint64_t)threads < PARALLEL_MIN_BYTES)
+        {
+            threads = (int)(total / PARALLEL_MIN_BYTES);
+        }
+        if (threads > 1)
+        {
+            per = (total / (uint64_t)threads) / align * align;
+        }
+    }
+    if (per == 0 && regular && (io_flags & IO_URING))
+    {
+        threads = 1;
+    }
+    else if (per == 0)
+    {
+        free(sizes);
+        return scan_files(paths, count, fn, ctxs);
+    }
+    unsigned depth = 0;
+    if (io_flags & IO_URING)
+    {
+        depth = URING_DEPTH / (unsigned)threads < 4 ? 4 : URING_DEPTH / (unsigned)threads;
+    }
+
+    ScanJob *jobs = (ScanJob *)calloc((size_t)threads, sizeof(ScanJob));
+    pthread_t *tids = (pthread_t *)calloc((size_t)threads, sizeof(pthread_t));
+    int *started = (int *)calloc((size_t)threads, sizeof(int));
+    if (!jobs || !tids || !started)
+    {
+        fprintf(stderr, "Memory allocation error\n");
+        free(jobs);
+        free(tids);
+        free(started);
+        free(sizes);
+        return 0;
+    }
+
+    for (int t = 0; t < threads; ++t)
+    {
+        jobs[t].paths = paths;
+        jobs[t].sizes = sizes;
+        jobs[t].count = count;
+        jobs[t].begin = per * (uint64_t)t;
+        jobs[t].end = t == threads - 1 ? total : per * (uint64_t)(t + 1);
+        jobs[t].fn = fn;
+        jobs[t].ctx = (uint8_t *)ctxs + (size_t)t * ctx_size;
+        jobs[t].uring_depth = depth;
+        jobs[t].in_order = in_order;
+        jobs[t].ok = 0;
+        // первый кусок достаётся вызывающему потоку
+        if (t > 0 && pthread_create(&tids[t], NULL, scan_job_thread, &jobs[t]) == 0)
+        {
+            started[t] = 1;
+        }
+    }
+
+    int ok = 1;
+    for (int t = 0; t < threads; ++t)
+    {
+        if (!started[t])
+        {
+            scan_job_thread(&jobs[t]);
+        }
+    }
+    for (int t = 0; t < threads; ++t)
+    {
+        if (started[t])
+        {
+            pthread_join(tids[t], NULL);
+        }
+        if (!jobs[t].ok)
+        {
+            ok = 0;
+        }
+    }
+
+    free(jobs);
+    free(tids);
+    free(started);
+    free(sizes);
+    return ok;
+}
+
+// Ядро XOR: acc[j % 32] ^= p[j]. Блоки xorN (1..8 байт) делят 32, поэтому
+// свёртка до размера блока делается один раз в конце куска.
+typedef void (*XorKernel)(const uint8_t *p, size_t n, uint8_t acc[32]);
+
+void xor32_scalar(const uint8_t *p, size_t n, uint8_t acc[32])
+{
+    uint64_t w[4];
+    memcpy(w, acc, 32);
+    size_t i = 0;
+    for (; i + 32 <= n; i += 32)
+    {
+        uint64_t v[4];
+        memcpy(v, p + i, 32);
+        w[0] ^= v[0];
+        w[1] ^= v[1];
+        w[2] ^= v[2];
+        w[3] ^= v[3];
+    }
+    memcpy(acc, w, 32);
+    for (; i < n; ++i)
+    {
+        acc[i & 31] ^= p[i];
+    }
+}
+
+#if defined(__x86_64__)
+void xor32_sse2(const uint8_t *p, size_t n, uint8_t acc[32])
+{
+    __m128i lo = _mm_loadu_si128((const __m128i *)acc);
+    __m128i hi = _mm_loadu_si128((const __m128i *)(acc + 16));
+    size_t i = 0;
+    for (; i + 32 <= n; i += 32)
+    {
+        lo = _mm_xor_si128(lo, _mm_loadu_si128((const __m128i *)(p + i)));
+        hi = _mm_xor_si128(hi, _mm_loadu_si128((const __m128i *)(p + i + 16)));
+    }
+    _mm_storeu_si128((__m128i *)acc, lo);
+    _mm_storeu_si128((__m128i *)(acc + 16), hi);
+    for (; i < n; ++i)
+    {
+        acc[i & 31] ^= p[i];
+    }
+}
+
+__attribute__((target("avx2"))) void xor32_avx2(const uint8_t *p, size_t n, uint8_t acc[32])
+{
+    __m256i a0 = _mm256_loadu_si256((const __m256i *)acc);
+    __m256i a1 = _mm256_setzero_si256();
+    __m256i a2 = _mm256_setzero_si256();
+    __m256i a3 = _mm256_setzero_si256();
+    size_t i = 0;
+    for (; i + 128 <= n; i += 128)
+    {
+        a0 = _mm256_xor_si256(a0, _mm256_loadu_si256((const __m256i *)(p + i)));
+        a1 = _mm256_xor_si256(a1, _mm256_loadu_si256((const __m256i *)(p + i + 32)));
+        a2 = _mm256_xor_si256(a2, _mm256_loadu_si256((const __m256i *)(p + i + 64)));
+        a3 = _mm256_xor_si256(a3, _mm256_loadu_si256((const __m256i *)(p + i + 96)));
+    }
+    a0 = _mm256_xor_si256(_mm256_xor_si256(a0, a1), _mm256_xor_si256(a2, a3));
+    for (; i + 32 <= n; i += 32)
+    {
+        a0 = _mm256_xor_si256(a0, _mm256_loadu_si256((const __m256i *)(p + i)));
+    }
+    _mm256_storeu_si256((__m256i *)acc, a0);
+    for (; i < n; ++i)
+    {
+        acc[i & 31] ^= p[i];
+    }
+}
+#endif
+
+typedef enum
+{
+    SIMD_SCALAR,
+    SIMD_SSE2,
+    SIMD_AVX2
+} SimdLevel;
+
+// Уровень выбирается по процессору; FILETOOL_SIMD=scalar|sse2|avx2 может
+// только понизить его (для сравнения ядер между собой).
+SimdLevel simd_level(void)
+{
+    SimdLevel level = SIMD_SCALAR;
+#if defined(__x86_64__)
+    level = SIMD_SSE2;
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2"))
+    {
+        level = SIMD_AVX2;
+    }
+#endif
+    const char *env = getenv("FILETOOL_SIMD");
+    if (env)
+    {
+        if (strcmp(env, "scalar") == 0)
+        {
+            level = SIMD_SCALAR;
+        }
+        else if (strcmp(env, "sse2") == 0 && level > SIMD_SSE2)
+        {
+            level = SIMD_SSE2;
+        }
+    }
+    return level;
+}
+
+XorKernel select_xor_kernel(void)
+{
+#if defined(__x86_64__)
+    switch (simd_level())
+    {
+    case SIMD_AVX2:
+        return xor32_avx2;
+    case SIMD_SSE2:
+        return xor32_sse2;
+    default:
+        break;
+    }
+#endif
+    return xor32_scalar;
+}
+
+typedef struct
+{
+    XorKernel kernel;
+    size_t block_bytes;
+    uint8_t out[32];
+} XorCtx;
+
+// Байт потока со смещением g попадает в позицию g % block_bytes блока;
+// дополнение нулями до целого блока на XOR не влияет.
+void xor_fold(const uint8_t acc[32], uint64_t offset, size_t block_bytes, uint8_t *out_acc)
+{
+    size_t phase = (size_t)(offset % block_bytes);
+    for (size_t k = 0; k < 32; ++k)
+    {
+        out_acc[(phase + k) % block_bytes] ^= acc[k];
+    }
+}
+
+int xor_chunk(const uint8_t *data, size_t n, uint64_t offset, void *ctx)
+{
+    XorCtx *x = (XorCtx *)ctx;
+    uint8_t acc[32];
+    memset(acc, 0, sizeof(acc));
+    x->kernel(data, n, acc);
+    xor_fold(acc, offset, x->block_bytes, x->out);
+    return 1;
+}
+
+// С IO_URING куски сворачиваются в порядке завершения чтений.
+int xor_stream_blocks(char *const *paths, size_t count, size_t block_bytes, int threads, int io_flags, uint8_t *out_acc)
+{
+    if (!paths || count == 0 || block_bytes == 0 || block_bytes > 32 || 32 % block_bytes != 0 || threads <= 0 || !out_acc)
+    {
+        return 0;
+    }
+
+    XorCtx *ctx = (XorCtx *)calloc((size_t)threads, sizeof(XorCtx));
+    if (!ctx)
+    {
+        fprintf(stderr, "Memory allocation error\n");
+        return 0;
+    }
+    XorKernel kernel = select_xor_kernel();
+    for (int t = 0; t < threads; ++t)
+    {
+        ctx[t].kernel = kernel;
+        ctx[t].block_bytes = block_bytes;
+    }
+
+    int ok = scan_parallel(paths, count, threads, 32, io_flags, 0, xor_chunk, ctx, sizeof(XorCtx));
+
+    memset(out_acc, 0, block_bytes);
+    for (int t = 0; t < threads; ++t)
+    {
+        for (size_t b = 0; b < block_bytes; ++b)
+        {
+            out_acc[b] ^= ctx[t].out[b];
+        }
+    }
+
+    free(ctx);
+    return ok;
+}
+
+// Свёртка по файлам для xor_blocks_cached: starts[i] — смещение i-го
+// файла в потоке, out[i * block_bytes] — XOR его блоков от начала файла.
+typedef struct
+{
+    XorKernel kernel;
+    size_t block_bytes;
+    size_t count;
+    const uint64_t *starts;
+    uint8_t *out;
+} XorFilesCtx;
+
+// Номер последнего из count отрезков потока, который начинается не позже
+// offset (starts — их смещения по возрастанию). Кусок не пересекает границу
+// файла, а пустые отрезки кусков не дают, так что это отрезок куска.
+size_t stream_part_at(const uint64_t *starts, size_t count, uint64_t offset)
+{
+    size_t lo = 0;
+    size_t hi = count;
+    while (hi - lo > 1)
+    {
+        size_t mid = lo + (hi - lo) / 2;
+        if (starts[mid] <= offset)
+        {
+            lo = mid;
+        }
+        else
+        {
+            hi = mid;
+        }
+    }
+    return lo;
+}
+
+int xor_files_chunk(const uint8_t *data, size_t n, uint64_t offset, void *ctx)
+{
+    XorFilesCtx *x = (XorFilesCtx *)ctx;
+    size_t lo = stream_part_at(x->starts, x->count, offset);
+    uint8_t acc[32];
+    memset(acc, 0, sizeof(acc));
+    x->kernel(data, n, acc);
+    xor_fold(acc, offset - x->starts[lo], x->block_bytes, x->out + lo * x->block_bytes);
+    return 1;
+}
+
+// Промахи кэша сворачиваются одним проходом scan_parallel, так что -j
+// делит их общий объём, а не каждый файл по отдельности.
+int xor_files_blocks(char *const *paths, const uint64_t *sizes, size_t count, size_t block_bytes, int threads, int io_flags, uint8_t *out)
+{
+    uint64_t *starts = (uint64_t *)calloc(count, sizeof(uint64_t));
+    XorFilesCtx *ctx = (XorFilesCtx *)calloc((size_t)threads, sizeof(XorFilesCtx));
+    uint8_t *outs = (uint8_t *)calloc((size_t)threads * count, block_bytes);
+    if (!starts || !ctx || !outs)
+    {
+        fprintf(stderr, "Memory allocation error\n");
+        free(starts);
+        free(ctx);
+        free(outs);
+        return 0;
+    }
+    for (size_t i = 1; i < count; ++i)
+    {
+        starts[i] = starts[i - 1] + sizes[i - 1];
+    }
+    XorKernel kernel = select_xor_kernel();
+    for (int t = 0; t < threads; ++t)
+    {
+        ctx[t].kernel = kernel;
+        ctx[t].block_bytes = block_bytes;
+        ctx[t].count = count;
+        ctx[t].starts = starts;
+        ctx[t].out = outs + (size_t)t * count * block_bytes;
+    }
+
+    int ok = scan_parallel(paths, count, threads, 32, io_flags, 0, xor_files_chunk, ctx, sizeof(XorFilesCtx));
+
+    memset(out, 0, count * block_bytes);
+    for (int t = 0; t < threads; ++t)
+    {
+        for (size_t b = 0; b < count * block_bytes; ++b)
+        {
+            out[b] ^= ctx[t].out[b];
+        }
+    }
+
+    free(starts);
+    free(ctx);
+    free(outs);
+    return ok;
+}
+
+// xorN с кэшем: значение для файла — XOR его блоков от начала файла, в
+// общий результат оно входит со сдвигом на смещение файла в потоке.
+// Параметр — размер блока, так что xor2 и xor3 пользуются одной записью.
+int xor_blocks_cached(ResultCache *c, char *const *paths, size_t count, size_t block_bytes, int threads, int io_flags, uint8_t *out_acc)
+{
+    if (!paths || count == 0 || block_bytes == 0 || block_bytes > 32 || 32 % block_bytes != 0 || threads <= 0 || !out_acc)
+    {
+        return 0;
+    }
+    for (size_t i = 0; i < count; ++i)
+    {
+        struct stat st;
+        if (stat(paths[i], &st) != 0 || !S_ISREG(st.st_mode))
+        {
+            return xor_stream_blocks(paths, count, block_bytes, threads, io_flags, out_acc);
+        }
+    }
+
+    char **keys = (char **)calloc(count, sizeof(char *));
+    struct stat *sts = (struct stat *)calloc(count, sizeof(struct stat));
+    uint8_t *accs = (uint8_t *)calloc(count, block_bytes);
+    char **miss_paths = (char **)calloc(count, sizeof(char *));
+    uint64_t *miss_sizes = (uint64_t *)calloc(count, sizeof(uint64_t));
+    size_t *miss_idx = (size_t *)calloc(count, sizeof(size_t));
+    uint8_t *miss_accs = (uint8_t *)calloc(count, block_bytes);
+    int ok = keys && sts && accs && miss_paths && miss_sizes && miss_idx && miss_accs;
+    if (!ok)
+    {
+        fprintf(stderr, "Memory allocation error\n");
+    }
+
+    char param[8];
+    snprintf(param, sizeof(param), "%zu", block_bytes);
+    size_t misses = 0;
+    for (size_t i = 0; ok && i < count; ++i)
+    {
+        char value[CACHE_VALUE_MAX];
+        uint8_t *acc = accs + i * block_bytes;
+        int hit = cache_key(paths[i], &keys[i], &sts[i]) && cache_get(c, keys[i], &sts[i], "xor", param, value) && strlen(value) == 2 * block_bytes;
+        for (size_t b = 0; hit && b < block_bytes; ++b)
+        {
+            int hi = hex_digit(value[2 * b]);
+            int lo = hex_digit(value[2 * b + 1]);
+            hit = hi >= 0 && lo >= 0;
+            acc[b] = (uint8_t)(hi << 4 | lo);
+        }
+        if (!hit)
+        {
+            miss_paths[misses] = paths[i];
+            miss_sizes[misses] = (uint64_t)sts[i].st_size;
+            miss_idx[misses] = i;
+            ++misses;
+        }
+    }
+
+    if (ok && misses > 0)
+    {
+        ok = xor_files_blocks(miss_paths, miss_sizes, misses, block_bytes, threads, io_flags, miss_accs);
+    }
+    for (size_t m = 0; ok && m < misses; ++m)
+    {
+        size_t i = miss_idx[m];
+        memcpy(accs + i * block_bytes, miss_accs + m * block_bytes, block_bytes);
+        if (keys[i])
+        {
+            char value[CACHE_VALUE_MAX];
+            for (size_t b = 0; b < block_bytes; ++b)
+            {
+                snprintf(value + 2 * b, 3, "%02x", accs[i * block_bytes + b]);
+            }
+            cache_put(c, keys[i], &sts[i], "xor", param, value);
+        }
+    }
+
+    if (ok)
+    {
+        memset(out_acc, 0, block_bytes);
+        uint64_t offset = 0;
+        for (size_t i = 0; i < count; ++i)
+        {
+            for (size_t b = 0; b < block_bytes; ++b)
+            {
+                out_acc[(offset + b) % block_bytes] ^= accs[i * block_bytes + b];
+            }
+            offset += (uint64_t)sts[i].st_size;
+        }
+    }
+
+    for (size_t i = 0; keys && i < count; ++i)
+    {
+        free(keys[i]);
+    }
+    free(keys);
+    free(sts);
+    free(accs);
+    free(miss_paths);
+    free(miss_sizes);
+    free(miss_idx);
+    free(miss_accs);
+    return ok;
+}
+
+// XOR всех нибблов равен XOR старшей и младшей половин XOR всех байтов.
+int xor_stream_nibble(char *const *paths, size_t count, int threads, int io_flags, ResultCache *cache, uint8_t *out_nib)
+{
+    if (!paths || count == 0 || !out_nib)
+    {
+        return 0;
+    }
+
+    uint8_t acc = 0;
+    int ok = cache ? xor_blocks_cached(cache, paths, count, 1, threads, io_flags, &acc) : xor_stream_blocks(paths, count, 1, threads, io_flags, &acc);
+    if (!ok)
+    {
+        return 0;
+    }
+    *out_nib = (uint8_t)(((acc >> 4) ^ acc) & 0x0F);
+
+    return 1;
+}
+
+uint32_t be32_from4(const uint8_t w[4])
+{
+    return ((uint32_t)w[0] << 24) | ((uint32_t)w[1] << 16) | ((uint32_t)w[2] << 8) | (uint32_t)w[3];
+}
+
+uint64_t mask_count_scalar(const uint8_t *p, size_t words, uint32_t mask)
+{
+    uint64_t c = 0;
+    for (size_t i = 0; i < words; ++i)
+    {
+        uint32_t v = be32_from4(p + 4 * i);
+        if ((v & mask) == mask)
+        {
+            c++;
+        }
+    }
+    return c;
+}
+
+// Условие (v & mask) == mask проверяется побайтно, поэтому вместо
+// перестановки байтов каждого слова в big-endian достаточно один раз
+// переставить байты маски и сравнивать слова в порядке процессора.
+typedef uint64_t (*MaskKernel)(const uint8_t *p, size_t words, uint32_t mask);
+
+#if defined(__x86_64__)
+uint64_t mask_count_sse2(const uint8_t *p, size_t words, uint32_t mask)
+{
+    __m128i m = _mm_set1_epi32((int)__builtin_bswap32(mask));
+    uint64_t c = 0;
+    size_t i = 0;
+    for (; i + 8 <= words; i += 8)
+    {
+        __m128i a = _mm_loadu_si128((const __m128i *)(p + 4 * i));
+        __m128i b = _mm_loadu_si128((const __m128i *)(p + 4 * i + 16));
+        a = _mm_cmpeq_epi32(_mm_and_si128(a, m), m);
+        b = _mm_cmpeq_epi32(_mm_and_si128(b, m), m);
+        c += (uint64_t)__builtin_popcount((unsigned)_mm_movemask_ps(_mm_castsi128_ps(a)) | ((unsigned)_mm_movemask_ps(_mm_castsi128_ps(b)) << 4));
+    }
+    return c + mask_count_scalar(p + 4 * i, words - i, mask);
+}
+
+__attribute__((target("avx2,popcnt"))) uint64_t mask_count_avx2(const uint8_t *p, size_t words, uint32_t mask)
+{
+    __m256i m = _mm256_set1_epi32((int)__builtin_bswap32(mask));
+    uint64_t c = 0;
+    size_t i = 0;
+    for (; i + 16 <= words; i += 16)
+    {
+        __m256i a = _mm256_loadu_si256((const __m256i *)(p + 4 * i));
+        __m256i b = _mm256_loadu_si256((const __m256i *)(p + 4 * i + 32));
+        a = _mm256_cmpeq_epi32(_mm256_and_si256(a, m), m);
+        b = _mm256_cmpeq_epi32(_mm256_and_si256(b, m), m);
+        unsigned bits = (unsigned)_mm256_movemask_ps(_mm256_castsi256_ps(a)) | ((unsigned)_mm256_movemask_ps(_mm256_castsi256_ps(b)) << 8);
+        c += (uint64_t)__builtin_popcount(bits);
+    }
+    return c + mask_count_scalar(p + 4 * i, words - i, mask);
+}
+#endif
+
+MaskKernel select_mask_kernel(void)
+{
+#if defined(__x86_64__)
+    switch (simd_level())
+    {
+    case SIMD_AVX2:
+        return mask_count_avx2;
+    case SIMD_SSE2:
+        return mask_count_sse2;
+    default:
+        break;
+    }
+#endif
+    return mask_count_scalar;
+}
+
+// Слово, начатое в конце одного куска (или файла), дособирается в win из
+// начала следующего; хвост потока короче 4 байт не считается.
+typedef struct
+{
+    MaskKernel kernel;
+    uint32_t mask;
+    uint8_t win[4];
+    size_t filled;
+    uint64_t count;
+} MaskCtx;
+
+int mask_chunk(const uint8_t *data, size_t n, uint64_t offset, void *ctx)
+{
+    MaskCtx *m = (MaskCtx *)ctx;
+    (void)offset;
+
+    size_t pos = 0;
+    if (m->filled > 0)
+    {
+        while (m->filled < 4 && pos < n)
+        {
+            m->win[m->filled++] = data[pos++];
+        }
+        if (m->filled < 4)
+        {
+            return 1;
+        }
+        uint32_t v = be32_from4(m->win);
+        if ((v & m->mask) == m->mask)
+        {
+            m->count++;
+        }
+        m->filled = 0;
+    }
+
+    size_t words = (n - pos) / 4;
+    m->count += m->kernel(data + pos, words, m->mask);
+    pos += words * 4;
+
+    while (pos < n)
+    {
+        m->win[m->filled++] = data[pos++];
+    }
+    return 1;
+}
+
+// Слова могут пересекать границы кусков, поэтому с IO_URING куски одного
+// потока отдаются в порядке файла.
+int count_mask_matches_be32(char *const *paths, size_t count, uint32_t mask, int threads, int io_flags, uint64_t *out_count)
+{
+    if (!paths || count == 0 || threads <= 0 || !out_count)
+    {
+        return 0;
+    }
+
+    MaskCtx *ctx = (MaskCtx *)calloc((size_t)threads, sizeof(MaskCtx));
+    if (!ctx)
+    {
+        fprintf(stderr, "Memory allocation error\n");
+        return 0;
+    }
+    MaskKernel kernel = select_mask_kernel();
+    for (int t = 0; t < threads; ++t)
+    {
+        ctx[t].kernel = kernel;
+        ctx[t].mask = mask;
+    }
+
+    int ok = scan_parallel(paths, count, threads, 4, io_flags, 1, mask_chunk, ctx, sizeof(MaskCtx));
+
+    *out_count = 0;
+    for (int t = 0; t < threads; ++t)
+    {
+        *out_count += ctx[t].count;
+    }
+
+    free(ctx);
+    return ok;
+}
+
+// Счётчики по отрезкам для count_mask_cached: отрезки идут подряд, и длина
+// каждого, кроме последнего, кратна 4, так что слово не пересекает границу
+// отрезка и целиком засчитывается отрезку куска, в котором дособрано.
+typedef struct
+{
+    MaskCtx m;
+    size_t count;
+    const uint64_t *starts;
+    uint64_t *out;
+} MaskSegsCtx;
+
+int mask_segs_chunk(const uint8_t *data, size_t n, uint64_t offset, void *ctx)
+{
+    MaskSegsCtx *x = (MaskSegsCtx *)ctx;
+    uint64_t before = x->m.count;
+    mask_chunk(data, n, offset, &x->m);
+    x->out[stream_part_at(x->starts, x->count, offset)] += x->m.count - before;
+    return 1;
+}
+
+// Все отрезки-промахи считаются одним проходом scan_parallel, как в
+// xor_files_blocks: -j делит их общий объём. starts[s] — смещение s-го
+// отрезка в потоке файлов paths, out[s] — его счётчик.
+int count_mask_segments(char *const *paths, size_t count, const uint64_t *starts, size_t segs, uint32_t mask, int threads, int io_flags, uint64_t *out)
+{
+    MaskSegsCtx *ctx = (MaskSegsCtx *)calloc((size_t)threads, sizeof(MaskSegsCtx));
+    uint64_t *outs = (uint64_t *)calloc((size_t)threads * segs, sizeof(uint64_t));
+    if (!ctx || !outs)
+    {
+        fprintf(stderr, "Memory allocation error\n");
+        free(ctx);
+        free(outs);
+        return 0;
+    }
+    MaskKernel kernel = select_mask_kernel();
+    for (int t = 0; t < threads; ++t)
+    {
+        ctx[t].m.kernel = kernel;
+        ctx[t].m.mask = mask;
+        ctx[t].count = segs;
+        ctx[t].starts = starts;
+        ctx[t].out = outs + (size_t)t * segs;
+    }
+
+    int ok = scan_parallel(paths, count, threads, 4, io_flags, 1, mask_segs_chunk, ctx, sizeof(MaskSegsCtx));
+
+    memset(out, 0, segs * sizeof(uint64_t));
+    for (int t = 0; t < threads; ++t)
+    {
+        for (size_t g = 0; g < segs; ++g)
+        {
+            out[g] += ctx[t].out[g];
+        }
+    }
+
+    free(ctx);
+    free(outs);
+    return ok;
+}
+
+// mask с кэшем. Слово может начинаться в одном файле и кончаться в другом,
+// поэтому поток делится на независимые отрезки: отрезок начинается с файла,
+// чьё смещение в потоке кратно 4, и продолжается файлами, начинающимися не
+// с границы слова. Отрезок из одного файла — это сам файл, его счётчик
+// кэшируется; отрезки из нескольких файлов считаются заново. Промахи всех
+// отрезков считаются вместе одним проходом.
+int count_mask_cached(ResultCache *c, char *const *paths, size_t count, uint32_t mask, int threads, int io_flags, uint64_t *out_count)
+{
+    if (!paths || count == 0 || threads <= 0 || !out_count)
+    {
+        return 0;
+    }
+    uint64_t *sizes = (uint64_t *)malloc(count * sizeof(uint64_t));
+    if (!sizes)
+    {
+        fprintf(stderr, "Memory allocation error\n");
+        return 0;
+    }
+    for (size_t i = 0; i < count; ++i)
+    {
+        struct stat st;
+        if (stat(paths[i], &st) != 0 || !S_ISREG(st.st_mode))
+        {
+            free(sizes);
+            return count_mask_matches_be32(paths, count, mask, threads, io_flags, out_count);
+        }
+        sizes[i] = (uint64_t)st.st_size;
+    }
+
+    // Отрезков не больше, чем файлов; для промаха запоминается ключ кэша
+    // (только у отрезка из одного файла).
+    char **miss_paths = (char **)calloc(count, sizeof(char *));
+    uint64_t *miss_starts = (uint64_t *)calloc(count, sizeof(uint64_t));
+    uint64_t *miss_counts = (uint64_t *)calloc(count, sizeof(uint64_t));
+    char **miss_keys = (char **)calloc(count, sizeof(char *));
+    struct stat *miss_sts = (struct stat *)calloc(count, sizeof(struct stat));
+    int ok = miss_paths && miss_starts && miss_counts && miss_keys && miss_sts;
+    if (!ok)
+    {
+        fprintf(stderr, "Memory allocation error\n");
+    }
+
+    char param[16];
+    snprintf(param, sizeof(param), "%08" PRIX32, mask);
+    *out_count = 0;
+    size_t files = 0;
+    size_t segs = 0;
+    uint64_t miss_bytes = 0;
+    size_t i = 0;
+    while (ok && i < count)
+    {
+        size_t j = i + 1;
+        uint64_t seg = sizes[i];
+        while (j < count && seg % 4 != 0)
+        {
+            seg += sizes[j];
+            j++;
+        }
+
+        char *path = NULL;
+        struct stat st;
+        char value[CACHE_VALUE_MAX];
+        int keyed = j == i + 1 && cache_key(paths[i], &path, &st) && (uint64_t)st.st_size == sizes[i];
+        char *end = NULL;
+        uint64_t n = 0;
+        if (keyed && cache_get(c, path, &st, "mask", param, value))
+        {
+            n = strtoull(value, &end, 10);
+        }
+        if (end && *end == '\0')
+        {
+            *out_count += n;
+            free(path);
+        }
+        else
+        {
+            miss_starts[segs] = miss_bytes;
+            miss_keys[segs] = keyed ? path : NULL;
+            if (keyed)
+            {
+                miss_sts[segs] = st;
+            }
+            else
+            {
+                free(path);
+            }
+            for (size_t k = i; k < j; ++k)
+            {
+                miss_paths[files++] = paths[k];
+            }
+            miss_bytes += seg;
+            segs++;
+        }
+        i = j;
+    }
+
+    if (ok && segs > 0)
+    {
+        ok = count_mask_segments(miss_paths, files, miss_starts, segs, mask, threads, io_flags, miss_counts);
+    }
+    for (size_t g = 0; ok && g < segs; ++g)
+    {
+        *out_count += miss_counts[g];
+        if (miss_keys[g])
+        {
+            char value[CACHE_VALUE_MAX];
+            snprintf(value, sizeof(value), "%" PRIu64, miss_counts[g]);
+            cache_put(c, miss_keys[g], &miss_sts[g], "mask", param, value);
+        }
+    }
+
+    for (size_t g = 0; miss_keys && g < segs; ++g)
+    {
+        free(miss_keys[g]);
+    }
+    free(sizes);
+    free(miss_paths);
+    free(miss_starts);
+    free(miss_counts);
+    free(miss_keys);
+    free(miss_sts);
+    return ok;
+}
+
+#define COPY_CHUNK (1u << 20)
+
+// Ошибки, при которых способ копирования просто не поддерживается для этой
+// пары файлов (файловая система, ядро) и нужно перейти к следующему.
+int copy_unsupported(int err)
+{
+    return err == ENOSYS || err == EXDEV || err == EINVAL || err == EOPNOTSUPP || err == ENOTTY || err == EBADF;
+}
+
+int write_all(int fd, const uint8_t *buf, size_t len)
+{
+    size_t off = 0;
+    while (off < len)
+    {
+        ssize_t w = write(fd, buf + off, len - off);
+        if (w < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            return 0;
+        }
+        off += (size_t)w;
+    }
+    return 1;
+}
+
+// Все функции copy_fd_* возвращают 1 — файл скопирован, 0 — способ не
+// поддерживается, -1 — ошибка. Копирование идёт от текущих смещений
+// дескрипторов, поэтому следующий способ продолжает с того же места.
+
+// reflink: общие экстенты без копирования данных (btrfs, xfs)
+int copy_fd_clone(int in, int out)
+{
+    if (ioctl(out, FICLONE, in) == 0)
+    {
+        return 1;
+    }
+    return 0;
+}
+
+int copy_fd_range(int in, int out)
+{
+    while (1)
+    {
+        ssize_t n = copy_file_range(in, NULL, out, NULL, COPY_CHUNK, 0);
+        if (n == 0)
+        {
+            return 1;
+        }
+        if (n < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            if (copy_unsupported(errno))
+            {
+                return 0;
+            }
+            fprintf(stderr, "copy_file_range error: %s\n", strerror(errno));
+            return -1;
+        }
+    }
+}
+
+int copy_fd_sendfile(int in, int out)
+{
+    while (1)
+    {
+        ssize_t n = sendfile(out, in, NULL, COPY_CHUNK);
+        if (n == 0)
+        {
+            return 1;
+        }
+        if (n < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            if (copy_unsupported(errno))
+            {
+                return 0;
+            }
+            fprintf(stderr, "sendfile error: %s\n", strerror(errno));
+            return -1;
+        }
+    }
+}
+
+int copy_fd_buffered(int in, int out)
+{
+    uint8_t *buf = (uint8_t *)malloc(COPY_CHUNK);
+    if (!buf)
+    {
+        fprintf(stderr, "memory allocation error\n");
+        return -1;
+    }
+
+    int rc = 1;
+    while (1)
+    {
+        ssize_t r = read(in, buf, COPY_CHUNK);
+        if (r == 0)
+        {
+            break;
+        }
+        if (r < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            fprintf(stderr, "read error input file\n");
+            rc = -1;
+            break;
+        }
+        if (!write_all(out, buf, (size_t)r))
+        {
+            fprintf(stderr, "write error output file\n");
+            rc = -1;
+            break;
+        }
+    }
+
+    free(buf);
+    return rc;
+}
+
+int copy_fd(int in, int out, CopyMethod method)
+{
+    int rc = 0;
+    if (method <= COPY_CLONE)
+    {
+        rc = copy_fd_clone(in, out);
+    }
+    if (rc == 0 && method <= COPY_RANGE)
+    {
+        rc = copy_fd_range(in, out);
+    }
+    if (rc == 0 && method <= COPY_SENDFILE)
+    {
+        rc = copy_fd_sendfile(in, out);
+    }
+    if (rc == 0)
+    {
+        rc = copy_fd_buffered(in, out);
+    }
+    return rc == 1;
+}
+
+// O_DIRECT поддерживают не все файловые системы (у старых tmpfs — EINVAL);
+// тогда файл открывается обычным образом.
+int open_direct(const char *path, int flags, int direct)
+{
+    if (direct)
+    {
+        int fd = open(path, flags | O_DIRECT, 0666);
+        if (fd >= 0 || errno != EINVAL)
+        {
+            return fd;
+        }
+    }
+    return open(path, flags, 0666);
+}
+
+typedef struct
+{
+    uint64_t off;
+    size_t len;  // данных в куске
+    size_t wlen; // длина записи: с direct округлена до URING_ALIGN
+    size_t got;
+    int next_out;
+    int writes;
+    int state; // 0 — свободен, 1 — читается, 2 — пишется
+} UringChunk;
+
+// user_data заявки: номер буфера, номер копии + 1 (0 — чтение источника) и
+// сколько байт этой записи уже сделано.
+uint64_t uring_copy_tag(unsigned slot, int k, size_t done)
+{
+    return (uint64_t)slot | ((uint64_t)(k + 1) << 8) | ((uint64_t)done << 32);
+}
+
+// Копирование из in во все out[k] >= 0 с позиции start до size через кольцо
+// (до start копии уже записаны другим способом): чтения
+// источника и записи копий идут вперемешку, в полёте до depth кусков, кусок
+// освобождается, когда записан во все копии. С direct длины чтений и записей
+// округляются до 4 КБ (как требует O_DIRECT), а лишнее в конце копий
+// срезается ftruncate; короткое чтение или запись, после которых остаток
+// оказался бы не выровнен, считаются ошибкой. Копия с ошибкой закрывается и
+// помечается -1.
+// Возвращает число неудачных копий.
+int uring_copy(Uring *r, int in, int *out, int nout, uint64_t start, uint64_t size, int direct)
+{
+    UringChunk ch[URING_DEPTH];
+    memset(ch, 0, sizeof(ch));
+    int live = 0;
+    for (int k = 0; k < nout; ++k)
+    {
+        live += out[k] >= 0;
+    }
+
+    int failed = 0;
+    int read_failed = 0;
+    uint64_t next = start;
+    while (1)
+    {
+        for (unsigned s = 0; s < r->depth; ++s)
+        {
+            UringChunk *c = &ch[s];
+            while (c->state == 2 && c->next_out < nout && r->inflight < r->entries)
+            {
+                int k = c->next_out++;
+                if (out[k] >= 0)
+                {
+                    uring_prep(r, IORING_OP_WRITE, out[k], r->bufs[s], c->wlen, c->off, (int)s, uring_copy_tag(s, k, 0));
+                    c->writes++;
+                }
+            }
+            if (c->state == 2 && c->next_out == nout && c->writes == 0)
+            {
+                c->state = 0;
+            }
+            if (c->state == 0 && next < size && live > 0 && !read_failed && r->inflight < r->entries)
+            {
+                c->off = next;
+                c->len = size - next < SCAN_CHUNK ? (size_t)(size - next) : SCAN_CHUNK;
+                c->wlen = direct ? (c->len + URING_ALIGN - 1) & ~(size_t)(URING_ALIGN - 1) : c->len;
+                c->got = 0;
+                c->state = 1;
+                uring_prep(r, IORING_OP_READ, in, r->bufs[s], c->wlen, c->off, (int)s, uring_copy_tag(s, -1, 0));
+                next += c->len;
+            }
+        }
+
+        if (r->inflight == 0)
+        {
+            break;
+        }
+        struct io_uring_cqe cqe;
+        if (!uring_wait(r, &cqe))
+        {
+            // кольцо сломано: недописанные копии считаются неудачными
+            read_failed = 1;
+            break;
+        }
+
+        unsigned s = (unsigned)(cqe.user_data & 0xff);
+        int k = (int)((cqe.user_data >> 8) & 0xffffff) - 1;
+        size_t done = (size_t)(cqe.user_data >> 32);
+        UringChunk *c = &ch[s];
+        int again = cqe.res == -EINTR || cqe.res == -EAGAIN;
+
+        if (k < 0)
+        {
+            if (cqe.res > 0)
+            {
+                c->got += (size_t)cqe.res;
+            }
+            if (!again && cqe.res > 0 && c->got < c->len && direct && c->got % URING_ALIGN != 0)
+            {
+                // остаток по невыровненному смещению O_DIRECT не примет
+                fprintf(stderr, "read error input file: short O_DIRECT read is not 4 KiB aligned\n");
+                read_failed = 1;
+                c->state = 0;
+                continue;
+            }
+            if (again || (cqe.res > 0 && c->got < c->len))
+            {
+                uring_prep(r, IORING_OP_READ, in, r->bufs[s] + c->got, c->wlen - c->got, c->off + c->got, (int)s, uring_copy_tag(s, -1, 0));
+                continue;
+            }
+            if (cqe.res <= 0)
+            {
+                if (!read_failed)
+                {
+                    fprintf(stderr, "read error input file\n");
+                }
+                read_failed = 1;
+                c->state = 0;
+                continue;
+            }
+            memset(r->bufs[s] + c->len, 0, c->wlen - c->len);
+            c->state = read_failed ? 0 : 2;
+            c->next_out = 0;
+            c->writes = 0;
+            continue;
+        }
+
+        c->writes--;
+        if (again || (cqe.res > 0 && done + (size_t)cqe.res < c->wlen))
+        {
+            done += cqe.res > 0 ? (size_t)cqe.res : 0;
+            if (out[k] >= 0 && direct && done % URING_ALIGN != 0)
+            {
+                fprintf(stderr, "write error output file: short O_DIRECT write is not 4 KiB aligned\n");
+                close(out[k]);
+                out[k] = -1;
+                failed++;
+                live--;
+            }
+            else if (out[k] >= 0)
+            {
+                uring_prep(r, IORING_OP_WRITE, out[k], r->bufs[s] + done, c->wlen - done, c->off + done, (int)s, uring_copy_tag(s, k, done));
+                c->writes++;
+            }
+        }
+        else if (cqe.res <= 0 && out[k] >= 0)
+        {
+            fprintf(stderr, "write error output file\n");
+            close(out[k]);
+            out[k] = -1;
+            failed++;
+            live--;
+        }
+        if (c->next_out == nout && c->writes == 0)
+        {
+            c->state = 0;
+        }
+    }
+
+    for (int k = 0; k < nout; ++k)
+    {
+        if (out[k] < 0)
+        {
+            continue;
+        }
+        if (read_failed || (direct && ftruncate(out[k], (off_t)size) != 0))
+        {
+            if (!read_failed)
+            {
+                fprintf(stderr, "write error output file\n");
+            }
+            close(out[k]);
+            out[k] = -1;
+            failed++;
+        }
+    }
+    return failed;
+}
+
+// 1 — скопировано, 0 — ошибка, -1 — io_uring недоступен или источник не
+// обычный файл (ничего ещё не создано, можно копировать обычным путём).
+int copy_file_uring(const char *src, const char *dst, CopyMethod method, int io_flags)
+{
+    struct stat st;
+    if (stat(src, &st) != 0 || !S_ISREG(st.st_mode))
+    {
+        return -1;
+    }
+    Uring r;
+    if (!uring_init(&r, URING_DEPTH))
+    {
+        return -1;
+    }
+
+    int direct = (io_flags & IO_DIRECT) != 0;
+    int input = open_direct(src, O_RDONLY, direct);
+    if (input < 0)
+    {
+        fprintf(stderr, "error opening file\n");
+        uring_free(&r);
+        return 0;
+    }
+    int output = open_direct(dst, O_WRONLY | O_CREAT | O_TRUNC, direct);
+    if (output < 0)
+    {
+        fprintf(stderr, "error opening file\n");
+        close(input);
+        uring_free(&r);
+        return 0;
+    }
+
+    // кольцо заменяет только цикл read/write: reflink и копирование внутри
+    // ядра пробуются как обычно, с O_DIRECT — только reflink
+    int rc = 0;
+    if (method <= COPY_CLONE)
+    {
+        rc = copy_fd_clone(input, output);
+    }
+    if (rc == 0 && !direct && method <= COPY_RANGE)
+    {
+        rc = copy_fd_range(input, output);
+    }
+    if (rc == 0 && !direct && method <= COPY_SENDFILE)
+    {
+        rc = copy_fd_sendfile(input, output);
+    }
+    if (rc == 0)
+    {
+        off_t pos = lseek(input, 0, SEEK_CUR);
+        rc = pos >= 0 && uring_copy(&r, input, &output, 1, (uint64_t)pos, (uint64_t)st.st_size, direct) == 0 ? 1 : -1;
+    }
+    int ok = rc == 1;
+
+    close(input);
+    if (output >= 0 && close(output) != 0)
+    {
+        fprintf(stderr, "close output file failed\n");
+        ok = 0;
+    }
+    uring_free(&r);
+    return ok;
+}
+
+int copy_file(const char *src, const char *dst, CopyMethod method, int io_flags)
+{
+    if (io_flags & IO_URING)
+    {
+        int rc = copy_file_uring(src, dst, method, io_flags);
+        if (rc >= 0)
+        {
+            return rc;
+        }
+    }
+
+    int input = open(src, O_RDONLY);
+    if (input < 0)
+    {
+        fprintf(stderr, "error opening file\n");
+        return 0;
+    }
+
+    int output = open(dst, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    if (output < 0)
+    {
+        fprintf(stderr, "error opening file\n");
+        close(input);
+        return 0;
+    }
+
+    int ok = copy_fd(input, output, method);
+
+    close(input);
+    if (close(output) != 0)
+    {
+        fprintf(stderr, "close output file failed\n");
+        ok = 0;
+    }
+
+    return ok;
+}
+
+int build_copy_path(const char *src, int index, char **out)
+{
+    if (!src || index <= 0 || !out)
+    {
+        return 0;
+    }
+
+    size_t slen = strlen(src);
+    char buf[32];
+    int n = snprintf(buf, sizeof(buf), "%d", index);
+
+    if (n <= 0)
+    {
+        return 0;
+    }
+
+    size_t newlen = slen + (size_t)n;
+    char *dst = (char *)malloc(newlen + 1);
+
+    if (!dst)
+    {
+        return 0;
+    }
+
+    memcpy(dst, src, slen);
+    memcpy(dst + slen, buf, (size_t)n);
+
+    dst[newlen] = '\0';
+    *out = dst;
+    return 1;
+}
+
+// Режим «прочитать один раз»: источник читается единственный раз, и каждый
+// блок пишется во все N копий из того же буфера. Копии, которые удалось
+// сделать reflink'ом, из записи исключаются. С IO_URING чтение и записи идут
+// через кольцо (uring_copy). Возвращает число неудачных копий.
+int copy_file_fanout(const char *src, int N, CopyMethod method, int io_flags)
+{
+    struct stat st;
+    Uring ring;
+    int use_ring = (io_flags & IO_URING) && stat(src, &st) == 0 && S_ISREG(st.st_mode) && uring_init(&ring, URING_DEPTH);
+    int direct = use_ring && (io_flags & IO_DIRECT);
+
+    int input = open_direct(src, O_RDONLY, direct);
+    if (input < 0)
+    {
+        fprintf(stderr, "error opening file\n");
+        if (use_ring)
+        {
+            uring_free(&ring);
+        }
+        return N;
+    }
+
+    int *out = (int *)malloc((size_t)N * sizeof(int));
+    uint8_t *buf = (uint8_t *)malloc(COPY_CHUNK);
+    if (!out || !buf)
+    {
+        fprintf(stderr, "memory allocation error\n");
+        free(out);
+        free(buf);
+        close(input);
+        if (use_ring)
+        {
+            uring_free(&ring);
+        }
+        return N;
+    }
+
+    int failed = 0;
+    int pending = 0;
+    for (int k = 0; k < N; ++k)
+    {
+        char *dst = NULL;
+        out[k] = -1;
+        if (!build_copy_path(src, k + 1, &dst))
+        {
+            fprintf(stderr, "failed build path\n");
+            failed++;
+            continue;
+        }
+        out[k] = open_direct(dst, O_WRONLY | O_CREAT | O_TRUNC, direct);
+        free(dst);
+        if (out[k] < 0)
+        {
+            fprintf(stderr, "error opening file\n");
+            failed++;
+            continue;
+        }
+        if (method <= COPY_CLONE && copy_fd_clone(input, out[k]) == 1)
+        {
+            close(out[k]);
+            out[k] = -1;
+            continue;
+        }
+        pending++;
+    }
+
+    if (use_ring)
+    {
+        if (pending > 0)
+        {
+            failed += uring_copy(&ring, input, out, N, 0, (uint64_t)st.st_size, direct);
+            pending = 0;
+        }
+        uring_free(&ring);
+    }
+
+    while (pending > 0)
+    {
+        ssize_t r = read(input, buf, COPY_CHUNK);
+        if (r == 0)
+        {
+            break;
+        }
+        if (r < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            fprintf(stderr, "read error input file\n");
+            failed += pending;
+            for (int k = 0; k < N; ++k)
+            {
+                if (out[k] >= 0)
+                {
+                    close(out[k]);
+                    out[k] = -1;
+                }
+            }
+            pending = 0;
+            break;
+        }
+        for (int k = 0; k < N; ++k)
+        {
+            if (out[k] >= 0 && !write_all(out[k], buf, (size_t)r))
+            {
+                fprintf(stderr, "write error output file\n");
+                close(out[k]);
+                out[k] = -1;
+                failed++;
+                pending--;
+            }
+        }
+    }
+
+    for (int k = 0; k < N; ++k)
+    {
+        if (out[k] >= 0 && close(out[k]) != 0)
+        {
+            fprintf(stderr, "close output file failed\n");
+            failed++;
+        }
+    }
+
+    free(out);
+    free(buf);
+    close(input);
+    return failed;
+}
+
+typedef struct
+{
+    pid_t pid;
+    size_t task;
+} CopySlot;
+
+// Код завершения — число неудачных копий (не больше 255).
+void run_copy_child(const char *src, int k, int N, CopyMethod method, int io_flags)
+{
+    if (k == 0)
+    {
+        int failed = copy_file_fanout(src, N, method, io_flags);
+        _exit(failed > 255 ? 255 : failed);
+    }
+
+    char *dst = NULL;
+    if (!build_copy_path(src, k, &dst))
+    {
+        fprintf(stderr, "failed build path\n");
+        _exit(1);
+    }
+    int ok = copy_file(src, dst, method, io_flags);
+    free(dst);
+    if (ok)
+    {
+        _exit(0);
+    }
+    else
+    {
+        _exit(1);
+    }
+}
+
+// Задача с номером t — копия (t % N) + 1 файла files[t / N], а в режиме
+// read_once — все N копий файла files[t] одним процессом. Одновременно
+// работает не больше jobs дочерних процессов; завершившиеся забираются
+// waitpid(-1) в порядке окончания, и на их место сразу запускаются новые.
+int do_copyN(char *const *files, size_t file_count, int N, int jobs, CopyMethod method, int read_once, int io_flags)
+{
+    if (!files || file_count == 0 || N <= 0 || jobs <= 0)
+    {
+        return 0;
+    }
+
+    size_t per_file = read_once ? 1 : (size_t)N;
+    size_t total = file_count * per_file;
+    if ((size_t)jobs > total)
+    {
+        jobs = (int)total;
+    }
+
+    CopySlot *slots = (CopySlot *)calloc((size_t)jobs, sizeof(CopySlot));
+    size_t *failed = (size_t *)calloc(file_count, sizeof(size_t));
+    if (!slots || !failed)
+    {
+        fprintf(stderr, "memory allocation error\n");
+        free(slots);
+        free(failed);
+        return 0;
+    }
+
+    size_t next = 0;
+    size_t running = 0;
+    int overall_ok = 1;
+
+    while (next < total || running > 0)
+    {
+        while (next < total && running < (size_t)jobs)
+        {
+            pid_t pid = fork();
+
+            if (pid < 0)
+            {
+                // нехватку процессов пережидаем, пока завершится кто-то из своих
+                if (errno == EAGAIN && running > 0)
+                {
+                    break;
+                }
+                fprintf(stderr, "fork failed\n");
+                failed[next / per_file] += (size_t)N / per_file;
+                next++;
+                continue;
+            }
+
+            if (pid == 0)
+            {
+                free(slots);
+                free(failed);
+                run_copy_child(files[next / per_file], read_once ? 0 : (int)(next % per_file) + 1, N, method, io_flags);
+            }
+
+            slots[running].pid = pid;
+            slots[running].task = next;
+            running++;
+            next++;
+        }
+
+        if (running == 0)
+        {
+            continue;
+        }
+
+        int status = 0;
+        pid_t done = waitpid(-1, &status, 0);
+        if (done < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            fprintf(stderr, "waitpid failed\n");
+            for (size_t s = 0; s < running; ++s)
+            {
+                failed[slots[s].task / per_file] += (size_t)N / per_file;
+            }
+            overall_ok = 0;
+            break;
+        }
+
+        for (size_t s = 0; s < running; ++s)
+        {
+            if (slots[s].pid == done)
+            {
+                if (!WIFEXITED(status))
+                {
+                    failed[slots[s].task / per_file] += (size_t)N / per_file;
+                }
+                else
+                {
+                    failed[slots[s].task / per_file] += (size_t)WEXITSTATUS(status);
+                }
+                slots[s] = slots[running - 1];
+                running--;
+                break;
+            }
+        }
+    }
+
+    for (size_t i = 0; i < file_count; ++i)
+    {
+        if (failed[i] > 0)
+        {
+            fprintf(stderr, "copy file failed: %s (%zu of %d copies)\n", files[i], failed[i], N);
+            overall_ok = 0;
+        }
+    }
+
+    free(slots);
+    free(failed);
+    return overall_ok;
+}
+
+#define NEEDLE_SHORT 32
+
+struct Needle;
+typedef const uint8_t *(*SearchFn)(const uint8_t *h, size_t n, const struct Needle *nd);
+
+// Подготовленная строка поиска: способ поиска выбирается один раз по длине
+// строки и возможностям процессора.
+typedef struct Needle
+{
+    const uint8_t *p;
+    size_t m;
+    size_t rare_pos;
+    size_t skip[256];
+    SearchFn search;
+} Needle;
+
+// Грубая оценка частоты байта в текстовых файлах: чем меньше, тем реже.
+int byte_rank(uint8_t c)
+{
+    if (c == ' ' || c == 'e' || c == 't' || c == 'a' || c == 'o' || c == 'i' || c == 'n')
+    {
+        return 255;
+    }
+    if (c == 's' || c == 'r' || c == 'h' || c == 'l' || c == 'd' || c == '\n' || c == 'c' || c == 'u')
+    {
+        return 220;
+    }
+    if (c >= 'a' && c <= 'z')
+    {
+        return 160;
+    }
+    if ((c >= '0' && c <= '9') || (c >= 'A' && c <= 'Z') || c == '.' || c == ',' || c == '\t' || c == '\r')
+    {
+        return 120;
+    }
+    if (c >= 0x20 && c < 0x7F)
+    {
+        return 60;
+    }
+    return 0;
+}
+
+const uint8_t *search_memchr(const uint8_t *h, size_t n, const Needle *nd)
+{
+    return (const uint8_t *)memchr(h, nd->p[0], n);
+}
+
+// Ищем самый редкий байт строки через memchr и проверяем кандидата целиком.
+const uint8_t *search_rare(const uint8_t *h, size_t n, const Needle *nd)
+{
+    size_t m = nd->m;
+    if (n < m)
+    {
+        return NULL;
+    }
+    size_t k = nd->rare_pos;
+    uint8_t b = nd->p[k];
+    const uint8_t *cur = h + k;
+    const uint8_t *stop = h + (n - m) + k + 1;
+    while (cur < stop)
+    {
+        const uint8_t *q = (const uint8_t *)memchr(cur, b, (size_t)(stop - cur));
+        if (!q)
+        {
+            return NULL;
+        }
+        if (memcmp(q - k, nd->p, m) == 0)
+        {
+            return q - k;
+        }
+        cur = q + 1;
+    }
+    return NULL;
+}
+
+// Boyer–Moore–Horspool для длинных строк: сдвиг по последнему байту окна.
+const uint8_t *search_horspool(const uint8_t *h, size_t n, const Needle *nd)
+{
+    size_t m = nd->m;
+    uint8_t last = nd->p[m - 1];
+    size_t i = 0;
+    while (i + m <= n)
+    {
+        uint8_t c = h[i + m - 1];
+        if (c == last && memcmp(h + i, nd->p, m - 1) == 0)
+        {
+            return h + i;
+        }
+        i += nd->skip[c];
+    }
+    return NULL;
+}
+
+#if defined(__x86_64__)
+// Короткие строки: сравниваем сразу 16/32 позиции по первому и последнему
+// байту строки, memcmp только для позиций, где совпали оба.
+const uint8_t *search_sse2(const uint8_t *h, size_t n, const Needle *nd)
+{
+    size_t m = nd->m;
+    __m128i first = _mm_set1_epi8((char)nd->p[0]);
+    __m128i last = _mm_set1_epi8((char)nd->p[m - 1]);
+    size_t i = 0;
+    for (; i + m - 1 + 16 <= n; i += 16)
+    {
+        __m128i f = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)(h + i)), first);
+        __m128i l = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)(h + i + m - 1)), last);
+        unsigned bits = (unsigned)_mm_movemask_epi8(_mm_and_si128(f, l));
+        while (bits)
+        {
+            size_t k = (size_t)__builtin_ctz(bits);
+            if (memcmp(h + i + k + 1, nd->p + 1, m - 2) == 0)
+            {
+                return h + i + k;
+            }
+            bits &= bits - 1;
+        }
+    }
+    return search_rare(h + i, n - i, nd);
+}
+
+__attribute__((target("avx2"))) const uint8_t *search_avx2(const uint8_t *h, size_t n, const Needle *nd)
+{
+    size_t m = nd->m;
+    __m256i first = _mm256_set1_epi8((char)nd->p[0]);
+    __m256i last = _mm256_set1_epi8((char)nd->p[m - 1]);
+    size_t i = 0;
+    for (; i + m - 1 + 32 <= n; i += 32)
+    {
+        __m256i f = _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i *)(h + i)), first);
+        __m256i l = _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i *)(h + i + m - 1)), last);
+        unsigned bits = (unsigned)_mm256_movemask_epi8(_mm256_and_si256(f, l));
+        while (bits)
+        {
+            size_t k = (size_t)__builtin_ctz(bits);
+            if (memcmp(h + i + k + 1, nd->p + 1, m - 2) == 0)
+            {
+                return h + i + k;
+            }
+            bits &= bits - 1;
+        }
+    }
+    return search_rare(h + i, n - i, nd);
+}
+#endif
+
+void needle_init(Needle *nd, const char *needle)
+{
+    nd->p = (const uint8_t *)needle;
+    nd->m = strlen(needle);
+
+    nd->rare_pos = 0;
+    for (size_t i = 1; i < nd->m; ++i)
+    {
+        if (byte_rank(nd->p[i]) < byte_rank(nd->p[nd->rare_pos]))
+        {
+            nd->rare_pos = i;
+        }
+    }
+
+    for (size_t c = 0; c < 256; ++c)
+    {
+        nd->skip[c] = nd->m;
+    }
+    for (size_t i = 0; i + 1 < nd->m; ++i)
+    {
+        nd->skip[nd->p[i]] = nd->m - 1 - i;
+    }
+
+    if (nd->m <= 1)
+    {
+        nd->search = search_memchr;
+        return;
+    }
+    if (nd->m > NEEDLE_SHORT)
+    {
+        nd->search = search_horspool;
+        return;
+    }
+    nd->search = search_rare;
+#if defined(__x86_64__)
+    switch (simd_level())
+    {
+    case SIMD_AVX2:
+        nd->search = search_avx2;
+        break;
+    case SIMD_SSE2:
+        nd->search = search_sse2;
+        break;
+    default:
+        break;
+    }
+#endif
+}
 
-    if (!dst)
+// Поиск по кускам из кольца: вхождение на стыке ищется в carry — последних
+// m - 1 байтах предыдущих кусков и первых m - 1 байтах текущего.
+typedef struct
+{
+    const Needle *nd;
+    uint8_t *carry;
+    size_t tail;
+    int found;
+} SubstrCtx;
+
+int substr_chunk(const uint8_t *data, size_t n, uint64_t offset, void *ctx)
+{
+    SubstrCtx *sc = (SubstrCtx *)ctx;
+    const Needle *nd = sc->nd;
+    size_t overlap = nd->m - 1;
+    (void)offset;
+
+    size_t head = n < overlap ? n : overlap;
+    if (sc->tail > 0)
+    {
+        memcpy(sc->carry + sc->tail, data, head);
+        if (nd->search(sc->carry, sc->tail + head, nd) != NULL)
+        {
+            sc->found = 1;
+            return 0;
+        }
+    }
+    if (nd->search(data, n, nd) != NULL)
+    {
+        sc->found = 1;
+        return 0;
+    }
+
+    if (n >= overlap)
+    {
+        memcpy(sc->carry, data + n - overlap, overlap);
+        sc->tail = overlap;
+    }
+    else
+    {
+        size_t total = sc->tail + n;
+        size_t keep = total < overlap ? total : overlap;
+        memmove(sc->carry, sc->carry + total - keep, keep);
+        sc->tail = keep;
+    }
+    return 1;
+}
+
+// Как file_contains_substring через кольцо; 0 — так читать нельзя.
+int uring_file_substring(Uring *r, const char *path, const Needle *nd, int *result)
+{
+    SubstrCtx sc;
+    memset(&sc, 0, sizeof(sc));
+    sc.nd = nd;
+    sc.carry = (uint8_t *)malloc(2 * nd->m);
+    if (!sc.carry)
+    {
+        fprintf(stderr, "memory allocation error\n");
+        *result = -1;
+        return 1;
+    }
+    char *const paths[1] = {(char *)path};
+    int rc = uring_scan(r, paths, 1, 1, substr_chunk, &sc);
+    free(sc.carry);
+    if (rc < 0)
+    {
+        return 0;
+    }
+    *result = sc.found ? 1 : rc == 0 ? -1 : 0;
+    return 1;
+}
+
+// 1 — строка найдена, 0 — нет (или файл не открылся), -1 — ошибка чтения.
+// Обычный файл просматривается целиком через mmap, остальные — блоками с
+// перекрытием в m - 1 байт. С ring обычный файл читается через кольцо.
+int file_contains_substring(const char *path, const Needle *nd, Uring *ring)
+{
+    if (!path || !nd)
+    {
+        return 0;
+    }
+
+    size_t nlen = nd->m;
+    if (nlen == 0)
+    {
+        return 1;
+    }
+
+    int result = 0;
+    if (ring && uring_file_substring(ring, path, nd, &result))
+    {
+        return result;
+    }
+
+    int fd = open(path, O_RDONLY);
+    if (fd < 0)
+    {
+        return 0;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode))
+    {
+        if (st.st_size == 0)
+        {
+            close(fd);
+            return 0;
+        }
+        size_t size = (size_t)st.st_size;
+        void *map = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (map != MAP_FAILED)
+        {
+            madvise(map, size, MADV_SEQUENTIAL);
+            int found = nd->search((const uint8_t *)map, size, nd) != NULL;
+            munmap(map, size);
+            close(fd);
+            return found;
+        }
+    }
+
+    size_t overlap = nlen - 1;
+    size_t buf_size = 65536;
+    uint8_t *buf = (uint8_t *)malloc(buf_size + overlap);
+    if (!buf)
+    {
+        fprintf(stderr, "memory allocation error\n");
+        close(fd);
+        return -1;
+    }
+
+    size_t tail = 0; // уже лежат в начале buf
+    int found = 0;
+    int err = 0;
+
+    while (1)
+    {
+        ssize_t r = read(fd, buf + tail, buf_size);
+        if (r == 0)
+        {
+            break;
+        }
+        if (r < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            fprintf(stderr, "read error\n");
+            err = 1;
+            break;
+        }
+
+        size_t span = tail + (size_t)r;
+        if (nd->search(buf, span, nd) != NULL)
+        {
+            found = 1;
+            break;
+        }
+
+        size_t copy_len = span < overlap ? span : overlap;
+        if (copy_len > 0)
+        {
+            memmove(buf, buf + span - copy_len, copy_len);
+        }
+        tail = copy_len;
+    }
+
+    free(buf);
+    close(fd);
+    if (err)
+    {
+        return -1;
+    }
+    return found;
+}
+
+#define AC_OUT_FLAG 0x80000000u
+
+// Автомат Ахо–Корасик для поиска всех строк из файла образцов за один
+// проход. Байты, которых нет ни в одном образце, сливаются в класс 0, так
+// что таблица переходов — states × classes, а не states × 256. Переходы
+// полные (ДКА): в записи сразу лежит смещение строки следующего состояния,
+// старший бит — у него есть выход. На байт входа — одно чтение таблицы.
+typedef struct
+{
+    uint32_t *delta;
+    uint8_t cls[256];
+    size_t classes;
+    size_t states;
+    int32_t *out;      // первый образец, оканчивающийся в состоянии, или -1
+    int32_t *out_next; // следующий образец с тем же состоянием (повторы)
+    uint32_t *dict;    // ближайшее по суффиксным ссылкам состояние с выходом
+    char **patterns;
+    size_t count;
+} AcAutomaton;
+
+void ac_free(AcAutomaton *ac)
+{
+    free(ac->delta);
+    free(ac->out);
+    free(ac->out_next);
+    free(ac->dict);
+    for (size_t i = 0; i < ac->count; ++i)
+    {
+        free(ac->patterns[i]);
+    }
+    free(ac->patterns);
+    memset(ac, 0, sizeof(*ac));
+}
+
+int ac_build(AcAutomaton *ac)
+{
+    size_t classes = 1;
+    memset(ac->cls, 0, sizeof(ac->cls));
+    size_t max_states = 1;
+    for (size_t i = 0; i < ac->count; ++i)
+    {
+        for (const uint8_t *p = (const uint8_t *)ac->patterns[i]; *p; ++p)
+        {
+            if (ac->cls[*p] == 0)
+            {
+                ac->cls[*p] = (uint8_t)classes++;
+            }
+            max_states++;
+        }
+    }
+    if (classes > 256 || max_states * classes >= AC_OUT_FLAG)
+    {
+        fprintf(stderr, "too many patterns\n");
+        return 0;
+    }
+    ac->classes = classes;
+
+    uint32_t *fail = (uint32_t *)calloc(max_states, sizeof(uint32_t));
+    uint32_t *queue = (uint32_t *)calloc(max_states, sizeof(uint32_t));
+    ac->delta = (uint32_t *)calloc(max_states * classes, sizeof(uint32_t));
+    ac->out = (int32_t *)malloc(max_states * sizeof(int32_t));
+    ac->out_next = (int32_t *)malloc(ac->count * sizeof(int32_t));
+    ac->dict = (uint32_t *)calloc(max_states, sizeof(uint32_t));
+    if (!fail || !queue || !ac->delta || !ac->out || !ac->out_next || !ac->dict)
+    {
+        fprintf(stderr, "memory allocation error\n");
+        free(fail);
+        free(queue);
+        return 0;
+    }
+    for (size_t st = 0; st < max_states; ++st)
+    {
+        ac->out[st] = -1;
+    }
+
+    // бор; 0 в таблице пока означает «нет ребра» (в корень рёбер бора нет)
+    size_t states = 1;
+    for (size_t i = 0; i < ac->count; ++i)
+    {
+        uint32_t st = 0;
+        for (const uint8_t *p = (const uint8_t *)ac->patterns[i]; *p; ++p)
+        {
+            uint32_t *e = &ac->delta[st * classes + ac->cls[*p]];
+            if (*e == 0)
+            {
+                *e = (uint32_t)states++;
+            }
+            st = *e;
+        }
+        ac->out_next[i] = ac->out[st];
+        ac->out[st] = (int32_t)i;
+    }
+    ac->states = states;
+
+    // обход в ширину: суффиксные ссылки и недостающие переходы
+    size_t head = 0;
+    size_t tail = 0;
+    queue[tail++] = 0;
+    while (head < tail)
+    {
+        uint32_t u = queue[head++];
+        for (size_t c = 0; c < classes; ++c)
+        {
+            uint32_t v = ac->delta[u * classes + c];
+            if (v != 0)
+            {
+                fail[v] = u == 0 ? 0 : ac->delta[fail[u] * classes + c];
+                ac->dict[v] = ac->out[fail[v]] >= 0 ? fail[v] : ac->dict[fail[v]];
+                queue[tail++] = v;
+            }
+            else if (u != 0)
+            {
+                ac->delta[u * classes + c] = ac->delta[fail[u] * classes + c];
+            }
+        }
+    }
+
+    for (size_t i = 0; i < states * classes; ++i)
+    {
+        uint32_t v = ac->delta[i];
+        uint32_t e = v * (uint32_t)classes;
+        if (ac->out[v] >= 0 || ac->dict[v] != 0)
+        {
+            e |= AC_OUT_FLAG;
+        }
+        ac->delta[i] = e;
+    }
+
+    free(fail);
+    free(queue);
+    return 1;
+}
+
+// Образцы — по одному в строке файла, пустые строки пропускаются.
+int ac_load(AcAutomaton *ac, const char *path)
+{
+    memset(ac, 0, sizeof(*ac));
+    FILE *file = fopen(path, "rb");
+    if (!file)
+    {
+        fprintf(stderr, "error opening file\n");
+        return 0;
+    }
+
+    // образец — строка целиком: снимается только перевод строки (\n или
+    // \r\n), пробелы и табуляции по краям остаются частью образца
+    size_t cap = 0;
+    int ok = 1;
+    char *buf = NULL;
+    size_t buf_cap = 0;
+    ssize_t len;
+    while ((len = getline(&buf, &buf_cap, file)) > 0)
+    {
+        if (buf[len - 1] == '\n')
+        {
+            buf[--len] = '\0';
+        }
+        if (len > 0 && buf[len - 1] == '\r')
+        {
+            buf[--len] = '\0';
+        }
+        if (len == 0)
+        {
+            continue;
+        }
+        char *line = strdup(buf);
+        if (!line)
+        {
+            fprintf(stderr, "error allocation memory\n");
+            ok = 0;
+            break;
+        }
+        if (ac->count == cap)
+        {
+            size_t ncap = cap ? cap * 2 : 64;
+            char **np = (char **)realloc(ac->patterns, ncap * sizeof(char *));
+            if (!np)
+            {
+                fprintf(stderr, "error realloc\n");
+                free(line);
+                ok = 0;
+                break;
+            }
+            ac->patterns = np;
+            cap = ncap;
+        }
+        ac->patterns[ac->count++] = line;
+    }
+    if (ok && ferror(file))
+    {
+        fprintf(stderr, "error read file\n");
+        ok = 0;
+    }
+    free(buf);
+    fclose(file);
+
+    if (ok && ac->count == 0)
+    {
+        fprintf(stderr, "no patterns in %s\n", path);
+        ok = 0;
+    }
+    if (ok)
+    {
+        ok = ac_build(ac);
+    }
+    if (!ok)
+    {
+        ac_free(ac);
+    }
+    return ok;
+}
+
+// Отмечает в hits все образцы, оканчивающиеся в состоянии с этой строкой
+// таблицы; возвращает число впервые найденных.
+size_t ac_report(const AcAutomaton *ac, uint32_t row, uint8_t *hits)
+{
+    size_t fresh = 0;
+    uint32_t st = row / (uint32_t)ac->classes;
+    while (st != 0)
+    {
+        for (int32_t p = ac->out[st]; p >= 0; p = ac->out_next[p])
+        {
+            uint8_t bit = (uint8_t)(1u << (p & 7));
+            if (!(hits[p >> 3] & bit))
+            {
+                hits[p >> 3] |= bit;
+                fresh++;
+            }
+        }
+        st = ac->dict[st];
+    }
+    return fresh;
+}
+
+// Возвращает 1, когда найдены все образцы (дальше можно не смотреть).
+int ac_scan(const AcAutomaton *ac, const uint8_t *h, size_t n, uint32_t *row, uint8_t *hits, size_t *found)
+{
+    const uint32_t *delta = ac->delta;
+    const uint8_t *cls = ac->cls;
+    uint32_t r = *row;
+    for (size_t i = 0; i < n; ++i)
+    {
+        uint32_t e = delta[r + cls[h[i]]];
+        r = e & ~AC_OUT_FLAG;
+        if (e & AC_OUT_FLAG)
+        {
+            *found += ac_report(ac, r, hits);
+            if (*found == ac->count)
+            {
+                *row = r;
+                return 1;
+            }
+        }
+    }
+    *row = r;
+    return 0;
+}
+
+typedef struct
+{
+    const AcAutomaton *ac;
+    uint8_t *hits;
+    uint32_t row;
+    size_t found;
+    int all;
+} AcCtx;
+
+int ac_chunk(const uint8_t *data, size_t n, uint64_t offset, void *ctx)
+{
+    AcCtx *a = (AcCtx *)ctx;
+    (void)offset;
+    a->all = ac_scan(a->ac, data, n, &a->row, a->hits, &a->found);
+    return !a->all;
+}
+
+// Как file_contains_substring, но для всех образцов автомата: найденные
+// отмечаются в битовом наборе hits.
+int file_match_patterns(const char *path, const AcAutomaton *ac, uint8_t *hits, Uring *ring)
+{
+    if (ring)
+    {
+        AcCtx a;
+        memset(&a, 0, sizeof(a));
+        a.ac = ac;
+        a.hits = hits;
+        char *const paths[1] = {(char *)path};
+        int rc = uring_scan(ring, paths, 1, 1, ac_chunk, &a);
+        if (rc >= 0)
+        {
+            if (rc == 0 && !a.all)
+            {
+                return -1;
+            }
+            return a.found > 0;
+        }
+    }
+
+    int fd = open(path, O_RDONLY);
+    if (fd < 0)
     {
         return 0;
     }
-
-    memcpy(dst, src, slen);
-    memcpy(dst + slen, buf, (size_t)n);
-
-    dst[newlen] = '\0';
-    *out = dst;
-    return 1;
-}
-
-int do_copyN(char *const *files, size_t file_count, int N)
-{
-    if (!files || file_count == 0 || N <= 0)
+
+    uint32_t row = 0;
+    size_t found = 0;
+    struct stat st;
+    if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode))
+    {
+        if (st.st_size == 0)
+        {
+            close(fd);
+            return 0;
+        }
+        size_t size = (size_t)st.st_size;
+        void *map = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (map != MAP_FAILED)
+        {
+            madvise(map, size, MADV_SEQUENTIAL);
+            ac_scan(ac, (const uint8_t *)map, size, &row, hits, &found);
+            munmap(map, size);
+            close(fd);
+            return found > 0;
+        }
+    }
+
+    uint8_t *buf = (uint8_t *)malloc(65536);
+    if (!buf)
+    {
+        fprintf(stderr, "memory allocation error\n");
+        close(fd);
+        return -1;
+    }
+    int err = 0;
+    while (1)
+    {
+        ssize_t r = read(fd, buf, 65536);
+        if (r == 0)
+        {
+            break;
+        }
+        if (r < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            fprintf(stderr, "read error\n");
+            err = 1;
+            break;
+        }
+        if (ac_scan(ac, buf, (size_t)r, &row, hits, &found))
+        {
+            break;
+        }
+    }
+    free(buf);
+    close(fd);
+    if (err)
     {
-        return 0;
+        return -1;
     }
+    return found > 0;
+}
 
-    int overall_ok = 1;
+#define LIST_BLOCK 65536
+#define FIND_QUEUE 1024
 
-    for (size_t i = 0; i < file_count; ++i)
+// Чтение списка путей большими блоками: строки выделяются memchr'ом по
+// '\n', хвостовые '\r', пробелы и табуляции отбрасываются, пустые строки
+// пропускаются.
+typedef struct
+{
+    FILE *file;
+    char *buf;
+    size_t len;
+    size_t pos;
+    size_t cap;
+    int eof;
+} LineReader;
+
+// 1 — строка в *out_line (освобождает вызывающий), 0 — конец, -1 — ошибка.
+int line_reader_next(LineReader *lr, char **out_line)
+{
+    while (1)
     {
-        const char *src = files[i];
-
-        for (int k = 1; k <= N; ++k)
+        char *start = lr->buf + lr->pos;
+        char *nl = (char *)memchr(start, '\n', lr->len - lr->pos);
+        size_t line_len;
+        if (nl)
         {
-            pid_t pid = fork();
-
-            if (pid < 0)
+            line_len = (size_t)(nl - start);
+            lr->pos += line_len + 1;
+        }
+        else if (lr->eof)
+        {
+            if (lr->pos == lr->len)
             {
-                fprintf(stderr, "fork failed\n");
-                overall_ok = 0;
-                continue;
+                return 0;
             }
-
-            if (pid == 0)
+            line_len = lr->len - lr->pos;
+            lr->pos = lr->len;
+        }
+        else
+        {
+            // неполная строка: переносим в начало и дочитываем блок
+            memmove(lr->buf, start, lr->len - lr->pos);
+            lr->len -= lr->pos;
+            lr->pos = 0;
+            if (lr->cap - lr->len < LIST_BLOCK)
             {
-                char *dst = NULL;
-                if (!build_copy_path(src, k, &dst))
-                {
-                    fprintf(stderr, "failed build path\n");
-                    _exit(1);
-                }
-                int ok = copy_file_streamed(src, dst);
-                free(dst);
-                if (ok)
+                size_t ncap = lr->cap ? lr->cap * 2 : LIST_BLOCK * 2;
+                char *nbuf = (char *)realloc(lr->buf, ncap);
+                if (!nbuf)
                 {
-                    _exit(0);
+                    fprintf(stderr, "error realloc\n");
+                    return -1;
                 }
-                else
+                lr->buf = nbuf;
+                lr->cap = ncap;
+            }
+            size_t r = fread(lr->buf + lr->len, 1, LIST_BLOCK, lr->file);
+            if (r == 0)
+            {
+                if (ferror(lr->file))
                 {
-                    _exit(1);
+                    return -1;
                 }
+                lr->eof = 1;
             }
+            lr->len += r;
+            continue;
+        }
 
-            int status = 0;
-            if (waitpid(pid, &status, 0) < 0)
-            {
-                fprintf(stderr, "waitpid failed\n");
-                overall_ok = 0;
-            }
-            else if (!WIFEXITED(status) || WEXITSTATUS(status) != 0)
-            {
-                fprintf(stderr, "copy file failed\n");
-                overall_ok = 0;
-            }
+        while (line_len > 0 && (start[line_len - 1] == '\r' || start[line_len - 1] == ' ' || start[line_len - 1] == '\t'))
+        {
+            line_len--;
+        }
+        if (line_len == 0)
+        {
+            continue;
+        }
+
+        char *line = (char *)malloc(line_len + 1);
+        if (!line)
+        {
+            fprintf(stderr, "error allocation memory\n");
+            return -1;
         }
+        memcpy(line, start, line_len);
+        line[line_len] = '\0';
+        *out_line = line;
+        return 1;
     }
+}
 
-    return overall_ok;
+// Элемент конвейера: файл для поиска или, при path == NULL, отметка конца
+// списка list (по ней печатается сообщение, если в списке ничего нет).
+typedef struct
+{
+    size_t seq;
+    size_t list;
+    char *path;
+    int result;
+    uint8_t *hits;
+} FindItem;
+
+typedef struct
+{
+    size_t pending;
+    int found;
+    int closed;
+} FindList;
+
+// Конвейер find: читатель (вызывающий поток) разбирает списки и кладёт
+// файлы в ограниченную очередь, -j рабочих потоков ищут и сразу отдают
+// результат на печать. С ordered результаты проходят через кольцо
+// переупорядочивания и печатаются в порядке списков; кольцо фиксированного
+// размера, и читатель не выдаёт номер, пока тот в него не помещается, так
+// что медленный ранний файл не даёт кольцу расти.
+typedef struct
+{
+    const Needle *needle;
+    const AcAutomaton *ac;
+    size_t hit_stride;
+    int ordered;
+    int io_flags;
+    ResultCache *cache;
+
+    pthread_mutex_t qlock;
+    pthread_cond_t not_empty;
+    pthread_cond_t not_full;
+    FindItem *queue[FIND_QUEUE];
+    size_t qhead;
+    size_t qcount;
+    int qclosed;
+
+    pthread_mutex_t olock;
+    pthread_cond_t ring_space;
+    FindList *lists;
+    FindItem **ring;
+    size_t ring_cap;
+    size_t next_seq;
+    int ok;
+} FindEngine;
+
+void find_item_free(FindItem *item)
+{
+    free(item->path);
+    free(item->hits);
+    free(item);
 }
 
-int read_next_path_line(FILE *file, char **out_line)
+// С кэшем для find хранится ответ «есть строка в файле или нет»; ошибки
+// чтения не кэшируются.
+void find_search(FindEngine *e, FindItem *item, Uring *ring)
 {
-    if (!file || !out_line)
+    if (e->ac)
     {
-        return 0;
+        item->result = file_match_patterns(item->path, e->ac, item->hits, ring);
+        return;
     }
 
-    size_t cap = 128;
-    size_t len = 0;
+    char *path = NULL;
+    struct stat st;
+    char value[CACHE_VALUE_MAX];
+    const char *needle = (const char *)e->needle->p;
+    int keyed = e->cache && cache_key(item->path, &path, &st);
+    if (keyed && cache_get(e->cache, path, &st, "find", needle, value) && (value[0] == '0' || value[0] == '1') && value[1] == '\0')
+    {
+        item->result = value[0] - '0';
+        free(path);
+        return;
+    }
 
-    char *buf = (char *)malloc(cap);
-    if (!buf)
+    item->result = file_contains_substring(item->path, e->needle, ring);
+    if (keyed && item->result >= 0)
     {
-        fprintf(stderr, "error allocation memory\n");
-        return -1;
+        cache_put(e->cache, path, &st, "find", needle, item->result ? "1" : "0");
     }
+    free(path);
+}
 
-    int got_any = 0;
-    while (1)
+// Под olock: печать результата и учёт списка.
+void find_emit(FindEngine *e, FindItem *item)
+{
+    FindList *l = &e->lists[item->list];
+    if (!item->path)
+    {
+        l->closed = 1;
+    }
+    else
     {
-        int c = fgetc(file);
-        if (c == EOF)
+        if (item->result == 1 && e->ac)
         {
-            if (ferror(file))
+            for (size_t p = 0; p < e->ac->count; ++p)
             {
-                free(buf);
-                return -1;
+                if (item->hits[p >> 3] & (1u << (p & 7)))
+                {
+                    printf("%s\t%s\n", item->path, e->ac->patterns[p]);
+                }
             }
-            break;
+            l->found = 1;
         }
-
-        got_any = 1;
-
-        if (len + 1 >= cap)
+        else if (item->result == 1)
         {
-            size_t ncap = cap * 2;
-            char *nbuf = (char *)realloc(buf, ncap);
-            if (!nbuf)
-            {
-                fprintf(stderr, "error realloc\n");
-                free(buf);
-                return -1;
-            }
-
-            buf = nbuf;
-            cap = ncap;
+            printf("%s\n", item->path);
+            l->found = 1;
         }
-
-        buf[len++] = (char)c;
-        if (c == '\n')
+        else if (item->result < 0)
         {
-            break;
+            e->ok = 0;
         }
+        l->pending--;
     }
 
-    if (!got_any)
+    if (l->closed && l->pending == 0)
     {
-        free(buf);
-        return 0;
+        if (!l->found)
+        {
+            printf("*Stirng not found in files*\n");
+        }
+        l->closed = 0;
     }
+    fflush(stdout);
+    find_item_free(item);
+}
 
-    while (len > 0 && (buf[len - 1] == '\n' || buf[len - 1] == '\r' || buf[len - 1] == ' ' || buf[len - 1] == '\t'))
+int find_complete(FindEngine *e, FindItem *item)
+{
+    pthread_mutex_lock(&e->olock);
+    if (!e->ordered)
     {
-        len--;
+        find_emit(e, item);
+        pthread_mutex_unlock(&e->olock);
+        return 1;
     }
 
-    buf[len] = '\0';
+    // find_wait_slot не выдаёт номер дальше ring_cap от next_seq
+    e->ring[item->seq & (e->ring_cap - 1)] = item;
 
-    if (len == 0)
+    size_t before = e->next_seq;
+    while (e->ring[e->next_seq & (e->ring_cap - 1)])
     {
-        free(buf);
-        return 2;
+        size_t slot = e->next_seq & (e->ring_cap - 1);
+        FindItem *it = e->ring[slot];
+        e->ring[slot] = NULL;
+        e->next_seq++;
+        find_emit(e, it);
     }
-
-    *out_line = buf;
+    if (e->next_seq != before)
+    {
+        pthread_cond_signal(&e->ring_space);
+    }
+    pthread_mutex_unlock(&e->olock);
     return 1;
 }
 
-int file_contains_substring(const char *path, const char *needle)
+// Читатель ждёт, пока номер seq не поместится в кольцо: все меньшие номера
+// уже выданы и будут завершены рабочими потоками.
+void find_wait_slot(FindEngine *e, size_t seq)
 {
-    if (!path || !needle)
+    if (!e->ordered)
     {
-        return 0;
+        return;
     }
-
-    size_t nlen = strlen(needle);
-    if (nlen == 0)
+    pthread_mutex_lock(&e->olock);
+    while (seq - e->next_seq >= e->ring_cap)
     {
-        return 1;
+        pthread_cond_wait(&e->ring_space, &e->olock);
     }
+    pthread_mutex_unlock(&e->olock);
+}
 
-    FILE *file = fopen(path, "rb");
-    if (!file)
+void find_push(FindEngine *e, FindItem *item)
+{
+    pthread_mutex_lock(&e->qlock);
+    while (e->qcount == FIND_QUEUE)
     {
-        // fprintf(stderr, "error opening file\n");
-        // return -1;
-        return 0;
+        pthread_cond_wait(&e->not_full, &e->qlock);
     }
+    e->queue[(e->qhead + e->qcount) % FIND_QUEUE] = item;
+    e->qcount++;
+    pthread_cond_signal(&e->not_empty);
+    pthread_mutex_unlock(&e->qlock);
+}
 
-    size_t overlap = 0;
-    if (nlen > 1)
+FindItem *find_pop(FindEngine *e)
+{
+    pthread_mutex_lock(&e->qlock);
+    while (e->qcount == 0 && !e->qclosed)
     {
-        overlap = nlen - 1;
+        pthread_cond_wait(&e->not_empty, &e->qlock);
     }
-
-    size_t buf_size = 65536;
-    uint8_t *buf = (uint8_t *)malloc(buf_size + overlap);
-    if (!buf)
+    FindItem *item = NULL;
+    if (e->qcount > 0)
     {
-        fprintf(stderr, "memory allocation error\n");
-        fclose(file);
-        return -1;
+        item = e->queue[e->qhead];
+        e->qhead = (e->qhead + 1) % FIND_QUEUE;
+        e->qcount--;
+        pthread_cond_signal(&e->not_full);
     }
+    pthread_mutex_unlock(&e->qlock);
+    return item;
+}
 
-    size_t tail = 0; // уже лежат в начале buf
-    int found = 0;
-    int err = 0;
+// С IO_URING у каждого рабочего потока своё кольцо: файлы списков обычно
+// небольшие, поэтому буферов у него меньше, чем у xorN и copyN.
+#define FIND_URING_DEPTH 4
 
-    while (1)
+void *find_worker(void *arg)
+{
+    FindEngine *e = (FindEngine *)arg;
+    Uring ring;
+    Uring *r = NULL;
+    if ((e->io_flags & IO_URING) && uring_init(&ring, FIND_URING_DEPTH))
     {
-        size_t r = fread(buf + tail, 1, buf_size, file);
-        if (r == 0)
-        {
-            if (ferror(file))
-            {
-                fprintf(stderr, "read error\n");
-                err = 1;
-            }
-            break;
-        }
-
-        size_t span = tail + r;
-        for (size_t i = 0; i + nlen <= span; ++i)
-        {
-            if (memcmp(buf + i, needle, nlen) == 0)
-            {
-                found = 1;
-                break;
-            }
-        }
-
-        if (found)
-        {
-            break;
-        }
-
-        if (overlap > 0)
-        {
-            size_t copy_len;
-            if (span < overlap)
-            {
-                copy_len = span;
-            }
-            else
-            {
-                copy_len = overlap;
-            }
-
-            if (copy_len > 0)
-            {
-                memmove(buf, buf + span - copy_len, copy_len);
-            }
-
-            tail = copy_len;
-        }
-        else
-        {
-            tail = 0;
-        }
+        r = &ring;
     }
-
-    free(buf);
-    if (fclose(file) != 0)
+    FindItem *item;
+    while ((item = find_pop(e)) != NULL)
     {
-        fprintf(stderr, "error close file\n");
+        find_search(e, item, r);
+        find_complete(e, item);
     }
-    if (err)
+    if (r)
     {
-        return -1;
+        uring_free(r);
     }
-    if (found)
+    return NULL;
+}
+
+FindItem *find_item_new(FindEngine *e, size_t seq, size_t list, char *path)
+{
+    FindItem *item = (FindItem *)calloc(1, sizeof(FindItem));
+    if (!item)
     {
-        return 1;
+        return NULL;
     }
-    else
+    item->seq = seq;
+    item->list = list;
+    item->path = path;
+    if (path && e->ac)
     {
-        return 0;
+        item->hits = (uint8_t *)calloc(1, e->hit_stride);
+        if (!item->hits)
+        {
+            free(item);
+            return NULL;
+        }
     }
+    return item;
 }
 
-int process_find_list_file(const char *list_path, const char *needle)
+// Ищет needle (или все образцы ac) в файлах из списков lists.
+int run_find(char *const *lists, size_t list_count, const Needle *needle, const AcAutomaton *ac, int threads, int ordered, int io_flags, ResultCache *cache)
 {
-    if (!list_path || !needle)
+    FindEngine e;
+    memset(&e, 0, sizeof(e));
+    e.needle = needle;
+    e.ac = ac;
+    e.hit_stride = ac ? (ac->count + 7) / 8 : 0;
+    e.ordered = ordered;
+    e.io_flags = io_flags;
+    e.cache = cache;
+    e.ok = 1;
+    e.ring_cap = 2 * FIND_QUEUE;
+    e.lists = (FindList *)calloc(list_count, sizeof(FindList));
+    e.ring = (FindItem **)calloc(e.ring_cap, sizeof(FindItem *));
+    pthread_t *tids = (pthread_t *)calloc((size_t)threads, sizeof(pthread_t));
+    if (!e.lists || !e.ring || !tids)
     {
-        fprintf(stderr, "find: null args\n");
+        fprintf(stderr, "memory allocation error\n");
+        free(e.lists);
+        free(e.ring);
+        free(tids);
         return 0;
     }
-
-    FILE *file = fopen(list_path, "rb");
-    if (!file)
+    pthread_mutex_init(&e.qlock, NULL);
+    pthread_cond_init(&e.not_empty, NULL);
+    pthread_cond_init(&e.not_full, NULL);
+    pthread_mutex_init(&e.olock, NULL);
+    pthread_cond_init(&e.ring_space, NULL);
+
+    int started = 0;
+    while (started < threads && pthread_create(&tids[started], NULL, find_worker, &e) == 0)
     {
-        fprintf(stderr, "error opening file\n");
-        return 0;
+        started++;
     }
 
-    int any_found = 0;
-    int overall_ok = 1;
-
-    while (1)
+    size_t seq = 0;
+    for (size_t li = 0; li < list_count; ++li)
     {
-        char *line = NULL;
-        int rc = read_next_path_line(file, &line);
-        if (rc == 0)
-        {
-            break;
-        }
-        if (rc == -1)
-        {
-            overall_ok = 0;
-            break;
-        }
-        if (rc == 2)
+        LineReader lr;
+        memset(&lr, 0, sizeof(lr));
+        lr.file = fopen(lists[li], "rb");
+        if (!lr.file)
         {
+            fprintf(stderr, "error opening file\n");
+            pthread_mutex_lock(&e.olock);
+            e.ok = 0;
+            pthread_mutex_unlock(&e.olock);
             continue;
         }
 
-        // fprintf(stderr, "[find] from '%s' read path: '%s'\n", list_path, line);
-
-        pid_t pid = fork();
-        if (pid < 0)
-        {
-            fprintf(stderr, "error fork()\n");
-            overall_ok = 0;
-            free(line);
-            continue;
-        }
-        if (pid == 0)
+        while (1)
         {
-            int r = file_contains_substring(line, needle);
-            if (r == 1)
+            char *line = NULL;
+            int rc = line_reader_next(&lr, &line);
+            if (rc <= 0)
+            {
+                if (rc < 0)
+                {
+                    pthread_mutex_lock(&e.olock);
+                    e.ok = 0;
+                    pthread_mutex_unlock(&e.olock);
+                }
+                break;
+            }
+
+            find_wait_slot(&e, seq);
+            FindItem *item = find_item_new(&e, seq, li, line);
+            if (!item)
             {
-                _exit(0);
+                fprintf(stderr, "memory allocation error\n");
+                free(line);
+                pthread_mutex_lock(&e.olock);
+                e.ok = 0;
+                pthread_mutex_unlock(&e.olock);
+                break;
             }
-            else if (r == 0)
+            seq++;
+            pthread_mutex_lock(&e.olock);
+            e.lists[li].pending++;
+            pthread_mutex_unlock(&e.olock);
+
+            if (started > 0)
             {
-                _exit(1);
+                find_push(&e, item);
             }
             else
             {
-                _exit(2);
+                find_search(&e, item, NULL);
+                find_complete(&e, item);
             }
         }
 
-        int status = 0;
-        if (waitpid(pid, &status, 0) < 0)
+        free(lr.buf);
+        if (fclose(lr.file) != 0)
         {
-            fprintf(stderr, "error waitpid()\n");
-
-            overall_ok = 0;
+            fprintf(stderr, "error close file\n");
         }
-        else
+
+        find_wait_slot(&e, seq);
+        FindItem *end = find_item_new(&e, seq, li, NULL);
+        if (!end)
         {
-            if (WIFEXITED(status))
-            {
-                int code = WEXITSTATUS(status);
-                // fprintf(stderr, "[find] '%s' exit code = %d\n", line, code);
-                if (code == 0)
-                {
-                    printf("%s\n", line);
-                    any_found = 1;
-                }
-                else if (code == 2)
-                {
-                    overall_ok = 0;
-                }
-            }
-            else
-            {
-                overall_ok = 0;
-            }
+            fprintf(stderr, "memory allocation error\n");
+            pthread_mutex_lock(&e.olock);
+            e.ok = 0;
+            pthread_mutex_unlock(&e.olock);
+            break;
         }
-        free(line);
+        seq++;
+        find_complete(&e, end);
     }
 
-    if (fclose(file) != 0)
+    pthread_mutex_lock(&e.qlock);
+    e.qclosed = 1;
+    pthread_cond_broadcast(&e.not_empty);
+    pthread_mutex_unlock(&e.qlock);
+    for (int t = 0; t < started; ++t)
     {
-        fprintf(stderr, "error close file\n");
+        pthread_join(tids[t], NULL);
     }
 
-    if (!any_found)
-    {
-        printf("*Stirng not found in files*\n");
-    }
-
-    return overall_ok;
+    pthread_mutex_destroy(&e.qlock);
+    pthread_cond_destroy(&e.not_empty);
+    pthread_cond_destroy(&e.not_full);
+    pthread_cond_destroy(&e.ring_space);
+    pthread_mutex_destroy(&e.olock);
+    free(e.lists);
+    free(e.ring);
+    free(tids);
+    return e.ok;
 }
 
 void print_hex_upper(const uint8_t *buf, size_t len)
@@ -918,23 +4128,16 @@ void print_hex_upper(const uint8_t *buf, size_t len)
     putchar('\n');
 }
 
-int main(int argc, char *argv[])
+int run_cmd(const Cmd *cmd, ResultCache *cache)
 {
-    Cmd cmd;
-    if (!parse_cmd(argc, argv, &cmd))
-    {
-        fprintf(stderr, "error when parsing command line arguments\n");
-        return -1;
-    }
-
-    switch (cmd.action)
+    switch (cmd->action)
     {
     case ACTION_XOR:
     {
-        if (cmd.xorN == 2)
+        if (cmd->xorN == 2)
         {
             uint8_t nib = 0;
-            if (!xor_stream_nibble(cmd.files, cmd.file_count, &nib))
+            if (!xor_stream_nibble(cmd->files, cmd->file_count, cmd->jobs, cmd->io_flags, cache, &nib))
             {
                 fprintf(stderr, "error in xor2\n");
                 return -1;
@@ -948,7 +4151,7 @@ int main(int argc, char *argv[])
         }
         else
         {
-            size_t block_bytes = (size_t)1u << (cmd.xorN - 3);
+            size_t block_bytes = (size_t)1u << (cmd->xorN - 3);
             uint8_t *acc = (uint8_t *)malloc(block_bytes);
             if (!acc)
             {
@@ -956,7 +4159,9 @@ int main(int argc, char *argv[])
                 return -1;
             }
 
-            if (!xor_stream_blocks(cmd.files, cmd.file_count, block_bytes, acc))
+            int ok = cache ? xor_blocks_cached(cache, cmd->files, cmd->file_count, block_bytes, cmd->jobs, cmd->io_flags, acc)
+                           : xor_stream_blocks(cmd->files, cmd->file_count, block_bytes, cmd->jobs, cmd->io_flags, acc);
+            if (!ok)
             {
                 free(acc);
                 return -1;
@@ -973,14 +4178,16 @@ int main(int argc, char *argv[])
     case ACTION_MASK:
     {
         uint32_t mask = 0;
-        if (!parse_hex_u32(cmd.mask_hex, &mask))
+        if (!parse_hex_u32(cmd->mask_hex, &mask))
         {
             fprintf(stderr, "error: invalid <hex> mask\n");
             return -1;
         }
 
         uint64_t cnt = 0;
-        if (!count_mask_matches_be32(cmd.files, cmd.file_count, mask, &cnt))
+        int ok = cache ? count_mask_cached(cache, cmd->files, cmd->file_count, mask, cmd->jobs, cmd->io_flags, &cnt)
+                       : count_mask_matches_be32(cmd->files, cmd->file_count, mask, cmd->jobs, cmd->io_flags, &cnt);
+        if (!ok)
         {
             return -1;
         }
@@ -991,13 +4198,13 @@ int main(int argc, char *argv[])
 
     case ACTION_COPY:
     {
-        if (cmd.copyN > 10000)
+        if (cmd->copyN > 10000)
         {
             fprintf(stderr, "error large N\n");
             return -1;
         }
 
-        int status = do_copyN(cmd.files, cmd.file_count, cmd.copyN);
+        int status = do_copyN(cmd->files, cmd->file_count, cmd->copyN, cmd->jobs, cmd->copy_method, cmd->read_once, cmd->io_flags);
         if (!status)
         {
             return -1;
@@ -1008,14 +4215,31 @@ int main(int argc, char *argv[])
 
     case ACTION_FIND:
     {
-        int overall_ok = 1;
-        for (size_t i = 0; i < cmd.file_count; ++i)
+        Needle needle;
+        AcAutomaton ac;
+        const AcAutomaton *patterns = NULL;
+        if (cmd->pattern_file)
         {
-            if (!process_find_list_file(cmd.files[i], cmd.some_string))
+            if (!ac_load(&ac, cmd->pattern_file))
             {
-                overall_ok = 0;
-                fprintf(stderr, "error in find <some-string>\n");
+                return -1;
             }
+            patterns = &ac;
+        }
+        else
+        {
+            needle_init(&needle, cmd->some_string);
+        }
+
+        int overall_ok = run_find(cmd->files, cmd->file_count, patterns ? NULL : &needle, patterns, cmd->jobs, cmd->ordered, cmd->io_flags, cache);
+        if (!overall_ok)
+        {
+            fprintf(stderr, "error in find <some-string>\n");
+        }
+
+        if (patterns)
+        {
+            ac_free(&ac);
         }
 
         if (overall_ok)
@@ -1031,4 +4255,35 @@ int main(int argc, char *argv[])
     default:
         return -1;
     }
-}
\ No newline at end of file
+}
+
+int main(int argc, char *argv[])
+{
+    Cmd cmd;
+    if (!parse_cmd(argc, argv, &cmd))
+    {
+        fprintf(stderr, "error when parsing command line arguments\n");
+        return -1;
+    }
+
+    // copyN кэш не использует, и его не нужно наследовать дочерним процессам
+    ResultCache cache;
+    ResultCache *rc = NULL;
+    if (cmd.cache_path && cmd.action != ACTION_COPY)
+    {
+        if (!cache_load(&cache, cmd.cache_path))
+        {
+            return -1;
+        }
+        rc = &cache;
+    }
+
+    int code = run_cmd(&cmd, rc);
+
+    if (rc)
+    {
+        cache_save(rc);
+        cache_free(rc);
+    }
+    return code;
+}